@@ -1,18 +1,83 @@
 // ftp_client_improved.c - Cliente FTP
-// Compilar: gcc ftp_client.c -o ftp_client.exe -lws2_32
+// Compilar (Windows): gcc ftp_client.c -o ftp_client.exe -lws2_32 -lz
+// Compilar (Linux):   gcc ftp_client.c -o ftp_client -lpthread -lz
+// Uso: ftp_client                  (menú interactivo)
+//      ftp_client mirror <dir_remoto> <dir_local> [usuario] [clave] [conexiones]
+//      ftp_client batch [-h host] [-p puerto] [-u usuario] [-w clave] [-o informe.jsonl] [script]
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
-#include <time.h>
 #include <windows.h>
+#include <io.h>
+#include <direct.h>
+#include <sys/utime.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
+typedef HANDLE FileHandle;
+typedef HANDLE ThreadHandle;
+#define INVALID_FILE_HANDLE INVALID_HANDLE_VALUE
+#else
+// Capa de compatibilidad POSIX (mismos nombres que Winsock)
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+typedef int SOCKET;
+typedef unsigned long DWORD;
+typedef void* LPVOID;
+typedef int FileHandle;
+typedef pthread_t ThreadHandle;
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+#define WINAPI
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define INVALID_FILE_HANDLE (-1)
+#define closesocket(s) close(s)
+#define WSAGetLastError() errno
+#define InitializeCriticalSection(cs) pthread_mutex_init(cs, NULL)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#endif
+
 #define BUFFER_SIZE 8192
 #define FTP_PORT 21 // Puerto estándar FTP
+#define MAX_SEGMENTS 16
+#define SEGMENT_MIN_SIZE (1024 * 1024) // Por debajo de esto no vale la pena segmentar
+#define SEGMENT_RETRIES 3
+#define ZBUF_SIZE 65536 // Buffer de zlib del canal de datos en MODE Z
+#define MAX_BATCH_CONNECTIONS 16 // mget/mput: conexiones simultáneas como máximo
+#define BATCH_RETRIES 3
+#define PROGRESS_INTERVAL 0.25 // Segundos entre líneas de progreso (por archivo y agregado)
+// Buffer de datos de RETR/STOR: pocas llamadas a recv/fwrite por archivo
+#ifndef TRANSFER_BUFFER_SIZE
+#define TRANSFER_BUFFER_SIZE (1024 * 1024)
+#endif
+// SO_RCVBUF/SO_SNDBUF del canal de datos. Con 0 no se tocan: fijarlos
+// desactiva el autoajuste del kernel, que en Linux y Windows crece solo
+// hasta lo que pida el enlace.
+#ifndef DATA_SOCKET_BUFFER
+#define DATA_SOCKET_BUFFER 0
+#endif
+#define MIRROR_STATE_FILE ".ftpmirror" // Estado de la última sincronización (en el directorio local)
 
 typedef struct {
     SOCKET ctrl_sock;
@@ -21,39 +86,272 @@ typedef struct {
     int server_port;
     int pasv_port;
     char pasv_ip[64];
+    char username[64];
+    char password[64];
+    int quiet; // No imprimir el diálogo de control (conexiones auxiliares)
+    int mode_z; // MODE Z activo: el canal de datos va comprimido con deflate
+    int z_level; // Nivel de deflate para las subidas (0 = por defecto de zlib)
+    int last_code;        // Código de la última respuesta (0 = conexión perdida)
+    long long last_bytes; // Bytes de datos de la última transferencia
+    // Bytes recibidos en el canal de control que aún no forman una respuesta completa
+    char pending[BUFFER_SIZE];
+    int pending_len;
 } FTPClient;
 
+// --- Utilidades de plataforma ---
+
+// Reloj de pared en segundos (clock() mide tiempo de CPU)
+double now_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+#ifndef _WIN32
+typedef struct {
+    DWORD (*fn)(LPVOID);
+    LPVOID arg;
+} ThreadStart;
+
+static void* thread_trampoline(void* param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return NULL;
+}
+#endif
+
+int thread_start(ThreadHandle* thread, DWORD (WINAPI *fn)(LPVOID), LPVOID arg) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    if (!start) return 0;
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(thread, NULL, thread_trampoline, start) != 0) {
+        free(start);
+        return 0;
+    }
+    return 1;
+#endif
+}
+
+void thread_join(ThreadHandle thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+// Fija el tamaño del archivo (lo extiende con huecos o lo recorta). 1 si pudo.
+int set_file_size(FileHandle file, long long size) {
+#ifdef _WIN32
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+    return SetFilePointerEx(file, pos, NULL, FILE_BEGIN) && SetEndOfFile(file);
+#else
+    return ftruncate(file, (off_t)size) == 0;
+#endif
+}
+
+// Abre (o crea) el archivo local de destino y fija su tamaño final
+FileHandle open_output_file(const char* path, long long size) {
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) return h;
+    if (!set_file_size(h, size)) {
+        CloseHandle(h);
+        return INVALID_HANDLE_VALUE;
+    }
+    return h;
+#else
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) return fd;
+    if (!set_file_size(fd, size)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+// Escritura posicional: varios hilos escriben rangos distintos del mismo archivo
+int write_at(FileHandle file, const char* data, int len, long long offset) {
+    while (len > 0) {
+#ifdef _WIN32
+        OVERLAPPED ov;
+        DWORD written = 0;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(file, data, (DWORD)len, &written, &ov) || written == 0) return 0;
+#else
+        ssize_t written = pwrite(file, data, len, (off_t)offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return 0;
+#endif
+        data += written;
+        offset += written;
+        len -= (int)written;
+    }
+    return 1;
+}
+
+void close_file_handle(FileHandle file) {
+#ifdef _WIN32
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+long long local_file_size(const char* path) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_stati64(path, &st) != 0) return -1;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+#endif
+    return (long long)st.st_size;
+}
+
+// Tamaño y fecha de modificación (segundos UTC) de un archivo regular local
+int local_file_info(const char* path, long long* size, long long* mtime) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_stati64(path, &st) != 0 || !(st.st_mode & _S_IFREG)) return 0;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+#endif
+    *size = (long long)st.st_size;
+    *mtime = (long long)st.st_mtime;
+    return 1;
+}
+
+int set_local_mtime(const char* path, long long mtime) {
+#ifdef _WIN32
+    struct _utimbuf times;
+    times.actime = times.modtime = (time_t)mtime;
+    return _utime(path, &times) == 0;
+#else
+    struct utimbuf times;
+    times.actime = times.modtime = (time_t)mtime;
+    return utime(path, &times) == 0;
+#endif
+}
+
+// Crea el directorio si no existe (no crea los intermedios)
+int make_local_dir(const char* path) {
+#ifdef _WIN32
+    if (_mkdir(path) == 0) return 1;
+#else
+    if (mkdir(path, 0755) == 0) return 1;
+#endif
+    return errno == EEXIST;
+}
+
+// modify de MLSD (AAAAMMDDhhmmss, UTC) a segundos desde 1970
+long long mlsd_time(long long modify) {
+    struct tm tm;
+    if (modify <= 0) return 0;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = (int)(modify / 10000000000LL) - 1900;
+    tm.tm_mon = (int)(modify / 100000000LL % 100) - 1;
+    tm.tm_mday = (int)(modify / 1000000LL % 100);
+    tm.tm_hour = (int)(modify / 10000 % 100);
+    tm.tm_min = (int)(modify / 100 % 100);
+    tm.tm_sec = (int)(modify % 100);
+#ifdef _WIN32
+    return (long long)_mkgmtime(&tm);
+#else
+    return (long long)timegm(&tm);
+#endif
+}
+
 void send_command(FTPClient* client, const char* command) {
     char buffer[BUFFER_SIZE];
     snprintf(buffer, sizeof(buffer), "%s\r\n", command);
     send(client->ctrl_sock, buffer, strlen(buffer), 0);
-    printf(">> %s", buffer);
+    if (!client->quiet) printf(">> %s", buffer);
 }
 
-int recv_response(FTPClient* client, char* response, int max_len) {
-    int bytes = recv(client->ctrl_sock, response, max_len - 1, 0);
-    if (bytes > 0) {
-        response[bytes] = '\0';
-        printf("<< %s", response);
-        
-        // Extraer código de respuesta
-        char code[4];
-        strncpy(code, response, 3);
-        code[3] = '\0';
-        return atoi(code);
+// Longitud de la primera respuesta completa en 'data' (incluye respuestas
+// multilínea "123-...\r\n...\r\n123 fin\r\n"), o 0 si aún falta recibir.
+static int complete_response_length(const char* data, int len) {
+    const char* line = data;
+    const char* end = data + len;
+    while (line < end) {
+        const char* nl = memchr(line, '\n', end - line);
+        if (!nl) return 0;
+        if (nl - line >= 4 && strncmp(line, data, 3) == 0 && line[3] == ' ') {
+            return (int)(nl - data) + 1;
+        }
+        if (line == data && (nl - line < 4 || line[3] != '-')) {
+            return (int)(nl - data) + 1; // Respuesta de una sola línea
+        }
+        line = nl + 1;
     }
     return 0;
 }
 
+int recv_response(FTPClient* client, char* response, int max_len) {
+    int len;
+    while ((len = complete_response_length(client->pending, client->pending_len)) == 0) {
+        if (client->pending_len == (int)sizeof(client->pending)) {
+            len = client->pending_len; // Respuesta desmedida: se entrega tal cual
+            break;
+        }
+        int bytes = recv(client->ctrl_sock, client->pending + client->pending_len,
+                         sizeof(client->pending) - client->pending_len, 0);
+        if (bytes <= 0) {
+            client->last_code = 0;
+            return 0;
+        }
+        client->pending_len += bytes;
+    }
+
+    int copy = len < max_len - 1 ? len : max_len - 1;
+    memcpy(response, client->pending, copy);
+    response[copy] = '\0';
+    client->pending_len -= len;
+    memmove(client->pending, client->pending + len, client->pending_len);
+    if (!client->quiet) printf("<< %s", response);
+
+    // Extraer código de respuesta
+    char code[4];
+    strncpy(code, response, 3);
+    code[3] = '\0';
+    client->last_code = atoi(code);
+    return client->last_code;
+}
+
 int connect_ftp(FTPClient* client, const char* server, int port) {
-    WSADATA wsa;
     struct sockaddr_in addr;
     char response[BUFFER_SIZE];
     
+#ifdef _WIN32
+    WSADATA wsa;
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
         printf("Error inicializando Winsock: %d\n", WSAGetLastError());
         return 0;
     }
+#endif
+    client->pending_len = 0;
+    client->data_sock = INVALID_SOCKET;
     
     client->ctrl_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (client->ctrl_sock == INVALID_SOCKET) {
@@ -61,11 +359,12 @@ int connect_ftp(FTPClient* client, const char* server, int port) {
         return 0;
     }
     
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = inet_addr(server);
     addr.sin_port = htons(port);
     
-    printf("Conectando a %s:%d...\n", server, port);
+    if (!client->quiet) printf("Conectando a %s:%d...\n", server, port);
     if (connect(client->ctrl_sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
         printf("Error conectando: %d\n", WSAGetLastError());
         closesocket(client->ctrl_sock);
@@ -75,15 +374,23 @@ int connect_ftp(FTPClient* client, const char* server, int port) {
     strncpy(client->server_ip, server, sizeof(client->server_ip) - 1);
     client->server_port = port;
     
-    // Recibir mensaje de bienvenida
+    // Recibir mensaje de bienvenida (421 si el servidor está lleno)
     int code = recv_response(client, response, sizeof(response));
-    return (code == 220);
+    if (code != 220) {
+        closesocket(client->ctrl_sock);
+        client->ctrl_sock = INVALID_SOCKET;
+        return 0;
+    }
+    return 1;
 }
 
 int login_ftp(FTPClient* client, const char* username, const char* password) {
     char response[BUFFER_SIZE];
     char command[256];
     
+    strncpy(client->username, username, sizeof(client->username) - 1);
+    strncpy(client->password, password, sizeof(client->password) - 1);
+    
     snprintf(command, sizeof(command), "USER %s", username);
     send_command(client, command);
     int code = recv_response(client, response, sizeof(response));
@@ -131,7 +438,7 @@ int enter_passive_mode(FTPClient* client) {
         return 0;
     }
     
-    printf("Modo pasivo: %s:%d\n", client->pasv_ip, client->pasv_port);
+    if (!client->quiet) printf("Modo pasivo: %s:%d\n", client->pasv_ip, client->pasv_port);
     return 1;
 }
 
@@ -144,11 +451,19 @@ int connect_data_socket(FTPClient* client) {
         return 0;
     }
     
+    if (DATA_SOCKET_BUFFER > 0) {
+        // Antes de connect: la ventana TCP se negocia en el handshake
+        int buffer_size = DATA_SOCKET_BUFFER;
+        setsockopt(client->data_sock, SOL_SOCKET, SO_RCVBUF, (const char*)&buffer_size, sizeof(buffer_size));
+        setsockopt(client->data_sock, SOL_SOCKET, SO_SNDBUF, (const char*)&buffer_size, sizeof(buffer_size));
+    }
+    
+    memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = inet_addr(client->pasv_ip);
     addr.sin_port = htons(client->pasv_port);
     
-    printf("Conectando canal de datos a %s:%d...\n", client->pasv_ip, client->pasv_port);
+    if (!client->quiet) printf("Conectando canal de datos a %s:%d...\n", client->pasv_ip, client->pasv_port);
     if (connect(client->data_sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
         printf("Error conectando canal de datos: %d\n", WSAGetLastError());
         closesocket(client->data_sock);
@@ -159,6 +474,142 @@ int connect_data_socket(FTPClient* client) {
     return 1;
 }
 
+// --- MODE Z ---
+// Canal de datos comprimido: con 'active' = 0 los datos pasan sin tocar.
+
+typedef struct {
+    z_stream z;
+    int active;
+    int deflating;
+    int ended;
+    long long wire; // Bytes que pasaron realmente por el socket
+    unsigned char buf[ZBUF_SIZE];
+} ZChannel;
+
+int zchannel_begin(ZChannel* zc, int active, int deflating, int level) {
+    memset(&zc->z, 0, sizeof(zc->z));
+    zc->active = active;
+    zc->deflating = deflating;
+    zc->ended = 0;
+    zc->wire = 0;
+    if (!active) return 1;
+    if (deflating) return deflateInit(&zc->z, level) == Z_OK;
+    return inflateInit(&zc->z) == Z_OK;
+}
+
+void zchannel_end(ZChannel* zc) {
+    if (!zc->active) return;
+    if (zc->deflating) deflateEnd(&zc->z);
+    else inflateEnd(&zc->z);
+}
+
+static int send_all_data(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent <= 0) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Recibe hasta 'len' bytes ya descomprimidos. 0 = fin, -1 = error.
+int zchannel_recv(ZChannel* zc, SOCKET sock, char* out, int len) {
+    if (!zc->active) {
+        int n = recv(sock, out, len, 0);
+        if (n > 0) zc->wire += n;
+        return n;
+    }
+    if (zc->ended) return 0;
+
+    zc->z.next_out = (Bytef*)out;
+    zc->z.avail_out = (uInt)len;
+    while (zc->z.avail_out == (uInt)len) {
+        if (zc->z.avail_in == 0) {
+            int n = recv(sock, (char*)zc->buf, sizeof(zc->buf), 0);
+            if (n <= 0) {
+                zc->ended = 1;
+                return n < 0 ? -1 : len - (int)zc->z.avail_out;
+            }
+            zc->wire += n;
+            zc->z.next_in = zc->buf;
+            zc->z.avail_in = (uInt)n;
+        }
+        int result = inflate(&zc->z, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            zc->ended = 1;
+            break;
+        }
+        if (result != Z_OK && result != Z_BUF_ERROR) return -1;
+    }
+    return len - (int)zc->z.avail_out;
+}
+
+// Envía 'len' bytes (comprimidos si corresponde); 'finish' cierra el stream
+int zchannel_send(ZChannel* zc, SOCKET sock, const char* data, int len, int finish) {
+    if (!zc->active) {
+        if (len > 0 && send_all_data(sock, data, len) != 0) return -1;
+        zc->wire += len;
+        return 0;
+    }
+
+    zc->z.next_in = (Bytef*)data;
+    zc->z.avail_in = (uInt)len;
+    int result;
+    do {
+        zc->z.next_out = zc->buf;
+        zc->z.avail_out = sizeof(zc->buf);
+        result = deflate(&zc->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_ERROR) return -1;
+        int have = (int)(sizeof(zc->buf) - zc->z.avail_out);
+        if (have > 0) {
+            if (send_all_data(sock, (const char*)zc->buf, have) != 0) return -1;
+            zc->wire += have;
+        }
+    } while (zc->z.avail_out == 0 || (finish && result != Z_STREAM_END));
+    return 0;
+}
+
+// Activa o desactiva MODE Z en la sesión; 'level' (1-9, 0 = el del servidor)
+int set_mode_z(FTPClient* client, int enable, int level) {
+    char response[BUFFER_SIZE];
+    char command[64];
+
+    send_command(client, enable ? "MODE Z" : "MODE S");
+    if (recv_response(client, response, sizeof(response)) != 200) {
+        return 0;
+    }
+    if (enable && level > 0) {
+        snprintf(command, sizeof(command), "OPTS MODE Z LEVEL %d", level);
+        send_command(client, command);
+        recv_response(client, response, sizeof(response));
+    }
+    client->mode_z = enable;
+    client->z_level = level;
+    return 1;
+}
+
+static void print_compression(long long raw, long long wire) {
+    if (wire > 0 && raw != wire) {
+        printf("MODE Z: %lld bytes en la red (%.2fx)\n", wire, (double)raw / wire);
+    }
+}
+
+// Progreso de una transferencia, como mucho cada PROGRESS_INTERVAL: imprimir
+// en cada bloque hace que la consola consuma más CPU que la propia descarga
+static void print_progress(const FTPClient* client, const char* label, long long bytes, double start, double* last) {
+    double now = now_seconds();
+    if (client->quiet || now - *last < PROGRESS_INTERVAL) return;
+    *last = now;
+    printf("\r%s: %lld bytes (%.2f MB/s)   ", label, bytes, bytes / 1048576.0 / (now - start));
+    fflush(stdout);
+}
+
+static void print_throughput(const char* label, long long bytes, double duration) {
+    if (duration <= 0) duration = 0.001;
+    printf("%s: %lld bytes en %.2f segundos (%.2f MB/s)\n", label, bytes, duration, bytes / 1048576.0 / duration);
+}
+
 int list_directory(FTPClient* client) {
     char response[BUFFER_SIZE];
     
@@ -182,17 +633,24 @@ int list_directory(FTPClient* client) {
     printf("\n--- Listado de archivos ---\n");
     int bytes;
     long total_bytes = 0;
-    clock_t start = clock();
+    double start = now_seconds();
+    ZChannel* zc = (ZChannel*)malloc(sizeof(ZChannel));
     
-    while ((bytes = recv(client->data_sock, response, sizeof(response) - 1, 0)) > 0) {
-        response[bytes] = '\0';
-        printf("%s", response);
-        total_bytes += bytes;
+    if (zc && zchannel_begin(zc, client->mode_z, 0, 0)) {
+        while ((bytes = zchannel_recv(zc, client->data_sock, response, sizeof(response) - 1)) > 0) {
+            response[bytes] = '\0';
+            printf("%s", response);
+            total_bytes += bytes;
+        }
+        zchannel_end(zc);
     }
     
-    double duration = (double)(clock() - start) / CLOCKS_PER_SEC;
+    double duration = now_seconds() - start;
     printf("---------------------------\n");
-    printf("Total: %ld bytes (%.2f segundos)\n\n", total_bytes, duration);
+    printf("Total: %ld bytes (%.2f segundos)\n", total_bytes, duration);
+    if (zc) print_compression(total_bytes, zc->wire);
+    printf("\n");
+    free(zc);
     
     closesocket(client->data_sock);
     client->data_sock = INVALID_SOCKET;
@@ -202,10 +660,44 @@ int list_directory(FTPClient* client) {
     return 1;
 }
 
-int download_file(FTPClient* client, const char* remote_file, const char* local_file) {
+// Tamaño del archivo remoto con SIZE, o -1 si el servidor no lo informa
+long long remote_file_size(FTPClient* client, const char* remote_file) {
     char response[BUFFER_SIZE];
     char command[256];
     
+    snprintf(command, sizeof(command), "SIZE %s", remote_file);
+    send_command(client, command);
+    if (recv_response(client, response, sizeof(response)) != 213) {
+        return -1;
+    }
+    return strtoll(response + 4, NULL, 10);
+}
+
+// Con resume = 1 y un archivo local parcial, continúa desde su tamaño (REST)
+int download_file(FTPClient* client, const char* remote_file, const char* local_file, int resume) {
+    char response[BUFFER_SIZE];
+    char command[256];
+    long long offset = 0;
+    
+    if (resume) {
+        offset = local_file_size(local_file);
+        long long remote_size = remote_file_size(client, remote_file);
+        if (offset > 0 && remote_size >= 0 && offset >= remote_size) {
+            printf("El archivo local ya está completo (%lld bytes)\n", offset);
+            return 1;
+        }
+        if (offset > 0) {
+            snprintf(command, sizeof(command), "REST %lld", offset);
+            send_command(client, command);
+            if (recv_response(client, response, sizeof(response)) != 350) {
+                printf("El servidor no admite REST, descargando completo\n");
+                offset = 0;
+            }
+        } else {
+            offset = 0;
+        }
+    }
+    
     if (!enter_passive_mode(client)) {
         return 0;
     }
@@ -225,41 +717,250 @@ int download_file(FTPClient* client, const char* remote_file, const char* local_
         return 0;
     }
     
-    FILE* file = fopen(local_file, "wb");
+    FILE* file = fopen(local_file, offset > 0 ? "ab" : "wb");
     if (!file) {
         printf("Error creando archivo local: %s\n", local_file);
         closesocket(client->data_sock);
         client->data_sock = INVALID_SOCKET;
+        recv_response(client, response, sizeof(response)); // 426
         return 0;
     }
     
-    printf("Descargando %s -> %s...\n", remote_file, local_file);
-    clock_t start = clock();
-    long total_bytes = 0;
-    int bytes;
+    if (client->quiet) {
+        // Conexión auxiliar (mget): sin progreso por archivo
+    } else if (offset > 0) {
+        printf("Reanudando %s desde el byte %lld -> %s...\n", remote_file, offset, local_file);
+    } else {
+        printf("Descargando %s -> %s...\n", remote_file, local_file);
+    }
+    double start = now_seconds();
+    double last_progress = start;
+    long long total_bytes = 0;
+    int bytes = -1;
+    int failed = 0;
+    int filled = 0;
+    char* buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    ZChannel* zc = (ZChannel*)malloc(sizeof(ZChannel));
+    setvbuf(file, NULL, _IONBF, 0); // Se escribe en bloques grandes: sin copia intermedia de stdio
     
-    while ((bytes = recv(client->data_sock, response, sizeof(response), 0)) > 0) {
-        fwrite(response, 1, bytes, file);
-        total_bytes += bytes;
-        printf("\rDescargados: %ld bytes", total_bytes);
+    if (buffer && zc && zchannel_begin(zc, client->mode_z, 0, 0)) {
+        // Se recibe directamente en el buffer grande y se escribe al llenarse
+        while ((bytes = zchannel_recv(zc, client->data_sock, buffer + filled, TRANSFER_BUFFER_SIZE - filled)) > 0) {
+            filled += bytes;
+            total_bytes += bytes;
+            if (filled == TRANSFER_BUFFER_SIZE) {
+                if (fwrite(buffer, 1, filled, file) != (size_t)filled) {
+                    failed = 1;
+                    break;
+                }
+                filled = 0;
+            }
+            print_progress(client, "Descargados", total_bytes, start, &last_progress);
+        }
+        if (bytes < 0 && client->mode_z) printf("\nError: datos comprimidos inválidos");
+        if (!failed && filled > 0 && fwrite(buffer, 1, filled, file) != (size_t)filled) failed = 1;
+        if (failed) printf("\nError escribiendo %s", local_file);
+        zchannel_end(zc);
     }
+    if (!buffer || !zc || bytes < 0) failed = 1;
+    long long wire_bytes = zc ? zc->wire : 0;
+    free(zc);
+    free(buffer);
     
-    double duration = (double)(clock() - start) / CLOCKS_PER_SEC;
-    fclose(file);
+    double duration = now_seconds() - start;
+    client->last_bytes = total_bytes;
+    if (fclose(file) != 0) failed = 1;
     closesocket(client->data_sock);
     client->data_sock = INVALID_SOCKET;
     
-    printf("\n");
-    recv_response(client, response, sizeof(response)); // 226
+    if (!client->quiet) printf("\n");
+    // El 226 confirma el archivo completo (también si está vacío)
+    if (recv_response(client, response, sizeof(response)) != 226) failed = 1;
     
-    if (total_bytes > 0) {
-        printf("Descarga completada: %ld bytes en %.2f segundos (%.2f KB/s)\n",
-               total_bytes, duration, (total_bytes / 1024.0) / duration);
-        return 1;
-    } else {
-        printf("Error: archivo vacío o no se pudo descargar\n");
+    if (failed) {
+        printf("Error: no se pudo descargar %s\n", remote_file);
+        return 0;
+    }
+    if (!client->quiet) {
+        print_throughput("Descarga completada", total_bytes, duration);
+        print_compression(total_bytes, wire_bytes);
+    }
+    return 1;
+}
+
+void disconnect_ftp(FTPClient* client) {
+    char response[BUFFER_SIZE];
+    send_command(client, "QUIT");
+    recv_response(client, response, sizeof(response));
+    
+    if (client->data_sock != INVALID_SOCKET) {
+        closesocket(client->data_sock);
+    }
+    closesocket(client->ctrl_sock);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// ==================== DESCARGA SEGMENTADA ====================
+// El archivo se divide en N rangos; cada uno viaja por su propia conexión
+// de control + datos (REST inicio, RETR y se corta al completar el rango)
+// y se escribe en su posición del archivo local.
+
+typedef struct {
+    const FTPClient* parent; // Servidor y credenciales
+    const char* remote_file;
+    FileHandle out;
+    long long start;
+    long long end;  // Exclusivo
+    long long done; // Bytes ya escritos: un reintento continúa desde aquí
+} Segment;
+
+// Descarga un intento del rango pendiente. Devuelve 1 si quedó completo.
+static int fetch_segment(Segment* seg) {
+    FTPClient conn;
+    char response[BUFFER_SIZE];
+    char command[256];
+    
+    memset(&conn, 0, sizeof(conn));
+    conn.quiet = 1;
+    if (!connect_ftp(&conn, seg->parent->server_ip, seg->parent->server_port)) {
+        return 0;
+    }
+    if (!login_ftp(&conn, seg->parent->username, seg->parent->password)) {
+        disconnect_ftp(&conn);
+        return 0;
+    }
+    
+    snprintf(command, sizeof(command), "REST %lld", seg->start + seg->done);
+    send_command(&conn, command);
+    if (recv_response(&conn, response, sizeof(response)) != 350 ||
+        !enter_passive_mode(&conn) || !connect_data_socket(&conn)) {
+        disconnect_ftp(&conn);
+        return 0;
+    }
+    
+    snprintf(command, sizeof(command), "RETR %s", seg->remote_file);
+    send_command(&conn, command);
+    if (recv_response(&conn, response, sizeof(response)) != 150) {
+        disconnect_ftp(&conn);
+        return 0;
+    }
+    
+    // Se acumula en un buffer grande y se escribe con una sola llamada al llenarse;
+    // 'done' sólo avanza con lo ya escrito, para que el reintento no pierda datos
+    char* buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    int filled = 0;
+    int bytes;
+    while (buffer && seg->start + seg->done + filled < seg->end) {
+        long long remaining = seg->end - (seg->start + seg->done + filled);
+        int room = TRANSFER_BUFFER_SIZE - filled;
+        int want = remaining < (long long)room ? (int)remaining : room;
+        bytes = recv(conn.data_sock, buffer + filled, want, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        filled += bytes;
+        if (filled == TRANSFER_BUFFER_SIZE || seg->start + seg->done + filled == seg->end) {
+            if (!write_at(seg->out, buffer, filled, seg->start + seg->done)) break;
+            seg->done += filled;
+            filled = 0;
+        }
+    }
+    if (buffer && filled > 0 && write_at(seg->out, buffer, filled, seg->start + seg->done)) {
+        seg->done += filled;
+    }
+    free(buffer);
+    
+    // Cerrar el canal de datos corta la transferencia en el servidor (226 o 426)
+    closesocket(conn.data_sock);
+    conn.data_sock = INVALID_SOCKET;
+    recv_response(&conn, response, sizeof(response));
+    disconnect_ftp(&conn);
+    return seg->start + seg->done == seg->end;
+}
+
+DWORD WINAPI segment_worker(LPVOID param) {
+    Segment* seg = (Segment*)param;
+    for (int attempt = 0; attempt < SEGMENT_RETRIES; attempt++) {
+        if (fetch_segment(seg)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int download_file_segmented(FTPClient* client, const char* remote_file, const char* local_file, int segments) {
+    long long size = remote_file_size(client, remote_file);
+    if (size < 0) {
+        printf("Error: no se pudo obtener el tamaño de %s (SIZE)\n", remote_file);
+        return 0;
+    }
+    
+    if (segments > MAX_SEGMENTS) segments = MAX_SEGMENTS;
+    if (segments > 1 && size / segments < SEGMENT_MIN_SIZE) {
+        segments = (int)(size / SEGMENT_MIN_SIZE);
+    }
+    if (segments <= 1) {
+        return download_file(client, remote_file, local_file, 0);
+    }
+    
+    FileHandle out = open_output_file(local_file, size);
+    if (out == INVALID_FILE_HANDLE) {
+        printf("Error creando archivo local: %s\n", local_file);
+        return 0;
+    }
+    
+    printf("Descargando %s -> %s en %d segmentos (%lld bytes)...\n",
+           remote_file, local_file, segments, size);
+    
+    Segment segs[MAX_SEGMENTS];
+    ThreadHandle threads[MAX_SEGMENTS];
+    int started[MAX_SEGMENTS];
+    long long chunk = size / segments;
+    double start = now_seconds();
+    
+    for (int i = 0; i < segments; i++) {
+        segs[i].parent = client;
+        segs[i].remote_file = remote_file;
+        segs[i].out = out;
+        segs[i].start = i * chunk;
+        segs[i].end = (i == segments - 1) ? size : (i + 1) * chunk;
+        segs[i].done = 0;
+        started[i] = thread_start(&threads[i], segment_worker, &segs[i]);
+        if (!started[i]) {
+            segment_worker(&segs[i]); // Sin hilo disponible: descargar en este mismo
+        }
+    }
+    
+    long long total_bytes = 0;
+    long long prefix = 0; // Bytes contiguos completos desde el inicio
+    int failed = 0;
+    for (int i = 0; i < segments; i++) {
+        if (started[i]) thread_join(threads[i]);
+        total_bytes += segs[i].done;
+        if (!failed) prefix = segs[i].start + segs[i].done;
+        if (segs[i].start + segs[i].done != segs[i].end) {
+            printf("Segmento %d incompleto: %lld de %lld bytes\n",
+                   i + 1, segs[i].done, segs[i].end - segs[i].start);
+            failed = 1;
+        }
+    }
+    double duration = now_seconds() - start;
+    
+    if (failed) {
+        // Se deja sólo el prefijo contiguo: los huecos de los segmentos
+        // incompletos harían creer a "Reanudar descarga" que ya está completo
+        if (!set_file_size(out, prefix)) prefix = 0;
+        close_file_handle(out);
+        if (prefix == 0) remove(local_file);
+        printf("Error: descarga segmentada incompleta (%lld de %lld bytes)\n", total_bytes, size);
+        if (prefix > 0) printf("Se conservan %lld bytes; puede reanudar la descarga\n", prefix);
         return 0;
     }
+    close_file_handle(out);
+    print_throughput("Descarga completada", total_bytes, duration);
+    return 1;
 }
 
 int upload_file(FTPClient* client, const char* local_file, const char* remote_file) {
@@ -294,75 +995,1204 @@ int upload_file(FTPClient* client, const char* local_file, const char* remote_fi
         return 0;
     }
     
-    printf("Subiendo %s -> %s...\n", local_file, remote_file);
-    clock_t start = clock();
-    long total_bytes = 0;
+    if (!client->quiet) printf("Subiendo %s -> %s...\n", local_file, remote_file);
+    double start = now_seconds();
+    double last_progress = start;
+    long long total_bytes = 0;
     int bytes;
+    int failed = 0;
+    char* buffer = (char*)malloc(TRANSFER_BUFFER_SIZE);
+    ZChannel* zc = (ZChannel*)malloc(sizeof(ZChannel));
+    long long wire_bytes = 0;
+    setvbuf(file, NULL, _IONBF, 0);
     
-    while ((bytes = fread(response, 1, sizeof(response), file)) > 0) {
-        int sent = send(client->data_sock, response, bytes, 0);
-        if (sent > 0) {
-            total_bytes += sent;
-            printf("\rEnviados: %ld bytes", total_bytes);
+    if (!buffer) {
+        failed = 1;
+    } else if (client->mode_z) {
+        // MODE Z: se comprime al vuelo; el final del stream marca el fin del archivo
+        if (zc && zchannel_begin(zc, 1, 1, client->z_level > 0 ? client->z_level : Z_DEFAULT_COMPRESSION)) {
+            while ((bytes = fread(buffer, 1, TRANSFER_BUFFER_SIZE, file)) > 0) {
+                if (zchannel_send(zc, client->data_sock, buffer, bytes, 0) != 0) {
+                    failed = 1;
+                    break;
+                }
+                total_bytes += bytes;
+                print_progress(client, "Enviados", total_bytes, start, &last_progress);
+            }
+            if (failed || zchannel_send(zc, client->data_sock, NULL, 0, 1) != 0) {
+                printf("\nError enviando datos\n");
+                failed = 1;
+            }
+            wire_bytes = zc->wire;
+            zchannel_end(zc);
         } else {
-            printf("\nError enviando datos\n");
-            break;
+            failed = 1;
+        }
+    } else {
+        while ((bytes = fread(buffer, 1, TRANSFER_BUFFER_SIZE, file)) > 0) {
+            if (send_all_data(client->data_sock, buffer, bytes) != 0) {
+                printf("\nError enviando datos\n");
+                failed = 1;
+                break;
+            }
+            total_bytes += bytes;
+            print_progress(client, "Enviados", total_bytes, start, &last_progress);
         }
     }
+    free(zc);
+    free(buffer);
     
-    double duration = (double)(clock() - start) / CLOCKS_PER_SEC;
+    double duration = now_seconds() - start;
+    client->last_bytes = total_bytes;
     fclose(file);
     closesocket(client->data_sock);
     client->data_sock = INVALID_SOCKET;
     
-    printf("\n");
-    recv_response(client, response, sizeof(response)); // 226
+    if (!client->quiet) printf("\n");
+    // El 226 confirma que el servidor guardó el archivo (también si está vacío)
+    if (recv_response(client, response, sizeof(response)) != 226) failed = 1;
     
-    if (total_bytes > 0) {
-        printf("Carga completada: %ld bytes en %.2f segundos (%.2f KB/s)\n",
-               total_bytes, duration, (total_bytes / 1024.0) / duration);
-        return 1;
-    } else {
-        printf("Error: no se pudo subir el archivo\n");
+    if (failed) {
+        printf("Error: no se pudo subir %s\n", local_file);
         return 0;
     }
+    if (!client->quiet) {
+        print_throughput("Carga completada", total_bytes, duration);
+        print_compression(total_bytes, wire_bytes);
+    }
+    return 1;
 }
 
-void disconnect_ftp(FTPClient* client) {
-    char response[BUFFER_SIZE];
-    send_command(client, "QUIT");
-    recv_response(client, response, sizeof(response));
-    
-    if (client->data_sock != INVALID_SOCKET) {
-        closesocket(client->data_sock);
+// ==================== TRANSFERENCIAS MÚLTIPLES (mget/mput) ====================
+// Los archivos que coinciden con el patrón forman una cola ordenada de mayor
+// a menor; N hilos, cada uno con su propia conexión de control + datos ya
+// autenticada, van tomando el siguiente archivo. Empezar por los grandes
+// evita que uno pesado quede solo al final con las demás conexiones ociosas.
+
+typedef struct {
+    char* name;       // Relativo a remote_dir / local_dir (puede incluir subdirectorios)
+    long long size;
+    long long mtime;  // Descargas: fecha remota a aplicar al archivo local (0 = no tocar)
+    int ok;
+} BatchJob;
+
+typedef struct {
+    const FTPClient* parent; // Servidor, credenciales y MODE Z
+    const char* label;       // "mget", "mput" o "mirror" en los informes
+    int upload;
+    char remote_dir[512];    // Directorio remoto de la sesión principal (PWD)
+    char local_dir[512];
+    BatchJob* jobs;
+    int count;
+    int next;                // Siguiente trabajo sin asignar
+    int done;
+    int failed;
+    long long bytes;
+    double start;
+    double last_report;
+    CRITICAL_SECTION lock;
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    FTPClient* shared; // Conexión principal (sin conexiones auxiliares disponibles)
+    int files;
+    long long bytes;
+    int connected;
+} BatchWorker;
+
+// Comodines estilo shell: '*', '?' y clases [abc], [a-z], [!abc]
+int glob_match(const char* pattern, const char* text) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*text) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+            continue;
+        }
+        if (*pattern == '[') {
+            const char* p = pattern + 1;
+            int negate = *p == '!' || *p == '^';
+            int matched = 0;
+            if (negate) p++;
+            do {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    if ((unsigned char)*text >= (unsigned char)p[0] && (unsigned char)*text <= (unsigned char)p[2]) {
+                        matched = 1;
+                    }
+                    p += 3;
+                } else {
+                    if (*p == *text) matched = 1;
+                    p++;
+                }
+            } while (*p && *p != ']');
+            if (*p == ']' && matched != negate) {
+                pattern = p + 1;
+                text++;
+                continue;
+            }
+        } else if (*pattern && (*pattern == '?' || *pattern == *text)) {
+            pattern++;
+            text++;
+            continue;
+        }
+        if (!star) return 0;
+        pattern = star + 1;
+        text = ++resume;
     }
-    closesocket(client->ctrl_sock);
-    WSACleanup();
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
 }
 
-void print_menu() {
-    printf("\n=== Cliente FTP ===\n");
-    printf("1. Listar archivos (LIST)\n");
-    printf("2. Descargar archivo (RETR)\n");
-    printf("3. Subir archivo (STOR)\n");
-    printf("4. Cambiar directorio (CWD)\n");
-    printf("5. Mostrar directorio actual (PWD)\n");
-    printf("6. Información del sistema (SYST)\n");
-    printf("7. Salir (QUIT)\n");
-    printf("Opción: ");
+static BatchJob* batch_add_job(Batch* batch, const char* name, long long size) {
+    if (batch->count >= 16 && (batch->count & (batch->count - 1)) == 0) { // Capacidad: potencias de 2
+        BatchJob* grown = (BatchJob*)realloc(batch->jobs, batch->count * 2 * sizeof(BatchJob));
+        if (!grown) return NULL;
+        batch->jobs = grown;
+    } else if (!batch->jobs) {
+        batch->jobs = (BatchJob*)malloc(16 * sizeof(BatchJob));
+        if (!batch->jobs) return NULL;
+    }
+    BatchJob* job = &batch->jobs[batch->count];
+    job->name = strdup(name);
+    if (!job->name) return NULL;
+    job->size = size;
+    job->mtime = 0;
+    job->ok = 0;
+    batch->count++;
+    return job;
 }
 
-void get_input(const char* prompt, char* buffer, size_t size) {
-    printf("%s", prompt);
-    fgets(buffer, size, stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
+static void batch_free(Batch* batch) {
+    for (int i = 0; i < batch->count; i++) free(batch->jobs[i].name);
+    free(batch->jobs);
+    batch->jobs = NULL;
+    batch->count = 0;
 }
 
-int main() {
-    // Configurar consola para UTF-8 (acentos)
-    SetConsoleOutputCP(65001);
+static int compare_jobs(const void* a, const void* b) {
+    long long sa = ((const BatchJob*)a)->size;
+    long long sb = ((const BatchJob*)b)->size;
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+// Directorio remoto actual, de la respuesta 257 "/ruta"
+static int remote_pwd(FTPClient* client, char* dir, size_t size) {
+    char response[BUFFER_SIZE];
+    send_command(client, "PWD");
+    if (recv_response(client, response, sizeof(response)) != 257) return 0;
+    char* start = strchr(response, '"');
+    char* end = start ? strrchr(start + 1, '"') : NULL;
+    if (!start || !end || (size_t)(end - start - 1) >= size) return 0;
+    memcpy(dir, start + 1, end - start - 1);
+    dir[end - start - 1] = '\0';
+    return 1;
+}
+
+typedef struct {
+    const char* name;
+    int is_dir;
+    long long size;
+    long long modify; // AAAAMMDDhhmmss en UTC (0 si el servidor no lo informa)
+} MlsdEntry;
+
+// Listado MLSD completo del directorio actual (terminado en '\0'), o NULL
+static char* fetch_mlsd(FTPClient* client) {
+    char response[BUFFER_SIZE];
+    
+    if (!enter_passive_mode(client) || !connect_data_socket(client)) {
+        return NULL;
+    }
+    send_command(client, "MLSD");
+    if (recv_response(client, response, sizeof(response)) != 150) {
+        closesocket(client->data_sock);
+        client->data_sock = INVALID_SOCKET;
+        return NULL;
+    }
+    
+    char* listing = (char*)malloc(BUFFER_SIZE);
+    size_t len = 0, capacity = BUFFER_SIZE;
+    int bytes = -1;
+    int ok = listing != NULL;
+    ZChannel* zc = (ZChannel*)malloc(sizeof(ZChannel));
+    if (ok && zc && zchannel_begin(zc, client->mode_z, 0, 0)) {
+        while ((bytes = zchannel_recv(zc, client->data_sock, response, sizeof(response))) > 0) {
+            if (len + bytes + 1 > capacity) {
+                capacity = (len + bytes + 1) * 2;
+                char* grown = (char*)realloc(listing, capacity);
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                listing = grown;
+            }
+            memcpy(listing + len, response, bytes);
+            len += bytes;
+        }
+        zchannel_end(zc);
+    }
+    if (!zc || bytes < 0) ok = 0;
+    free(zc);
+    closesocket(client->data_sock);
+    client->data_sock = INVALID_SOCKET;
+    if (recv_response(client, response, sizeof(response)) != 226) ok = 0;
+    
+    if (!ok) {
+        free(listing);
+        return NULL;
+    }
+    listing[len] = '\0';
+    return listing;
+}
+
+// Un nombre recibido del servidor se une a rutas locales: vacío, "." o "..",
+// o con separadores, podría escribir fuera del directorio de destino
+static int safe_remote_name(const char* name) {
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strpbrk(name, "/\\");
+}
+
+// Siguiente entrada "type=file;size=N;modify=...; nombre" del listado (modifica el buffer)
+static int mlsd_next(char** cursor, MlsdEntry* entry) {
+    while (**cursor) {
+        char* line = *cursor;
+        char* eol = strstr(line, "\r\n");
+        if (eol) {
+            *eol = '\0';
+            *cursor = eol + 2;
+        } else {
+            *cursor = line + strlen(line);
+        }
+        char* name = strstr(line, "; ");
+        if (!name) continue;
+        *name = '\0';
+        
+        int type = 0;
+        memset(entry, 0, sizeof(*entry));
+        entry->name = name + 2;
+        for (char* fact = line; fact && *fact; ) {
+            char* next = strchr(fact, ';');
+            if (next) *next++ = '\0';
+            if (strcmp(fact, "type=file") == 0) type = 1;
+            else if (strcmp(fact, "type=dir") == 0) type = 2; // cdir/pdir se ignoran
+            else if (strncmp(fact, "size=", 5) == 0) entry->size = strtoll(fact + 5, NULL, 10);
+            else if (strncmp(fact, "modify=", 7) == 0) entry->modify = strtoll(fact + 7, NULL, 10);
+            fact = next;
+        }
+        if (type == 0) continue;
+        entry->is_dir = type == 2;
+        return 1;
+    }
+    return 0;
+}
 
+// Archivos remotos del directorio actual que coinciden con el patrón (MLSD)
+static int list_remote_jobs(FTPClient* client, Batch* batch, const char* pattern) {
+    char* listing = fetch_mlsd(client);
+    if (!listing) return 0;
+    
+    char* cursor = listing;
+    MlsdEntry entry;
+    int ok = 1;
+    while (ok && mlsd_next(&cursor, &entry)) {
+        if (entry.is_dir || !glob_match(pattern, entry.name)) continue;
+        if (!safe_remote_name(entry.name)) {
+            printf("Se omite nombre remoto no válido: %s\n", entry.name);
+            continue;
+        }
+        ok = batch_add_job(batch, entry.name, entry.size) != NULL;
+    }
+    free(listing);
+    return ok;
+}
+
+// Archivos regulares de 'dir' que coinciden con el patrón
+static int list_local_jobs(Batch* batch, const char* dir, const char* pattern) {
+    char path[1024];
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    snprintf(path, sizeof(path), "%s\\*", dir);
+    HANDLE hFind = FindFirstFileA(path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) return 0;
+    do {
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        if (!glob_match(pattern, find_data.cFileName)) continue;
+        long long size = ((long long)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+        if (!batch_add_job(batch, find_data.cFileName, size)) {
+            FindClose(hFind);
+            return 0;
+        }
+    } while (FindNextFileA(hFind, &find_data));
+    FindClose(hFind);
+#else
+    DIR* d = opendir(dir);
+    if (!d) return 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        struct stat st;
+        if (!glob_match(pattern, entry->d_name)) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path) ||
+            stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (!batch_add_job(batch, entry->d_name, (long long)st.st_size)) {
+            closedir(d);
+            return 0;
+        }
+    }
+    closedir(d);
+#endif
+    return 1;
+}
+
+// Conexión auxiliar: login, mismo directorio remoto y MODE Z que la principal
+static int batch_connect(Batch* batch, FTPClient* conn) {
+    char response[BUFFER_SIZE];
+    char command[600];
+    
+    memset(conn, 0, sizeof(*conn));
+    conn->quiet = 1;
+    if (!connect_ftp(conn, batch->parent->server_ip, batch->parent->server_port)) {
+        return 0;
+    }
+    if (!login_ftp(conn, batch->parent->username, batch->parent->password)) {
+        disconnect_ftp(conn);
+        return 0;
+    }
+    snprintf(command, sizeof(command), "CWD %s", batch->remote_dir);
+    send_command(conn, command);
+    if (recv_response(conn, response, sizeof(response)) != 250 ||
+        (batch->parent->mode_z && !set_mode_z(conn, 1, batch->parent->z_level))) {
+        disconnect_ftp(conn);
+        return 0;
+    }
+    return 1;
+}
+
+static int batch_transfer(Batch* batch, FTPClient* conn, BatchJob* job) {
+    char local_path[1024];
+    snprintf(local_path, sizeof(local_path), "%s/%s", batch->local_dir, job->name);
+    if (batch->upload) return upload_file(conn, local_path, job->name);
+    if (!download_file(conn, job->name, local_path, 0)) return 0;
+    if (job->mtime > 0) set_local_mtime(local_path, job->mtime);
+    return 1;
+}
+
+// Progreso agregado, como mucho cada PROGRESS_INTERVAL (con el lock tomado)
+static void batch_report(Batch* batch, int force) {
+    double now = now_seconds();
+    if (!force && now - batch->last_report < PROGRESS_INTERVAL) return;
+    batch->last_report = now;
+    double elapsed = now - batch->start > 0 ? now - batch->start : 0.001;
+    printf("\r[%d/%d archivos] %.2f MB, %.2f MB/s, %d fallidos   ", batch->done + batch->failed, batch->count,
+           batch->bytes / 1048576.0, batch->bytes / 1048576.0 / elapsed, batch->failed);
+    fflush(stdout);
+}
+
+DWORD WINAPI batch_worker(LPVOID param) {
+    BatchWorker* worker = (BatchWorker*)param;
+    Batch* batch = worker->batch;
+    FTPClient own;
+    FTPClient* conn = worker->shared ? worker->shared : &own;
+    
+    // Si la conexión inicial falla el hilo no toma trabajos: los hacen los demás
+    if (!worker->shared && !(worker->connected = batch_connect(batch, conn))) return 0;
+    
+    while (1) {
+        EnterCriticalSection(&batch->lock);
+        BatchJob* job = batch->next < batch->count ? &batch->jobs[batch->next++] : NULL;
+        LeaveCriticalSection(&batch->lock);
+        if (!job) break;
+        
+        for (int attempt = 0; attempt < BATCH_RETRIES && !job->ok; attempt++) {
+            if (worker->shared) {
+                job->ok = batch_transfer(batch, conn, job);
+                break; // La conexión principal no se reabre
+            }
+            if (!worker->connected && !(worker->connected = batch_connect(batch, conn))) continue;
+            job->ok = batch_transfer(batch, conn, job);
+            if (!job->ok) {
+                // Se reintenta con una conexión nueva (la anterior puede haber quedado a medias)
+                disconnect_ftp(conn);
+                worker->connected = 0;
+            }
+        }
+        
+        EnterCriticalSection(&batch->lock);
+        if (job->ok) {
+            batch->done++;
+            batch->bytes += job->size;
+            worker->files++;
+            worker->bytes += job->size;
+        } else {
+            batch->failed++;
+        }
+        batch_report(batch, 0);
+        LeaveCriticalSection(&batch->lock);
+    }
+    
+    if (worker->connected) {
+        disconnect_ftp(conn);
+        worker->connected = 0;
+    }
+    return 0;
+}
+
+// Reparte los trabajos de 'batch' (ya listados) entre 'connections' conexiones
+// y muestra el informe final. Devuelve 1 si no falló ninguno.
+static int batch_run(FTPClient* client, Batch* batch, int connections) {
+    qsort(batch->jobs, batch->count, sizeof(BatchJob), compare_jobs);
+    
+    if (connections > MAX_BATCH_CONNECTIONS) connections = MAX_BATCH_CONNECTIONS;
+    if (connections > batch->count) connections = batch->count;
+    if (connections < 1) connections = 1;
+    long long total_size = 0;
+    for (int i = 0; i < batch->count; i++) total_size += batch->jobs[i].size;
+    printf("%s %d archivos (%lld bytes) con %d conexiones...\n", batch->upload ? "Subiendo" : "Descargando",
+           batch->count, total_size, connections);
+    
+    BatchWorker workers[MAX_BATCH_CONNECTIONS];
+    ThreadHandle threads[MAX_BATCH_CONNECTIONS];
+    int started[MAX_BATCH_CONNECTIONS];
+    memset(workers, 0, sizeof(workers));
+    InitializeCriticalSection(&batch->lock);
+    batch->start = now_seconds();
+    batch->last_report = batch->start;
+    
+    for (int i = 0; i < connections; i++) {
+        workers[i].batch = batch;
+        started[i] = thread_start(&threads[i], batch_worker, &workers[i]);
+    }
+    int running = 0;
+    for (int i = 0; i < connections; i++) {
+        if (started[i]) {
+            thread_join(threads[i]);
+            running++;
+        }
+    }
+    
+    // Sin hilos o sin conexiones auxiliares (p. ej. límite por IP del servidor):
+    // lo que quede en la cola va por la conexión principal
+    if (batch->next < batch->count) {
+        int quiet = client->quiet;
+        client->quiet = 1;
+        workers[0].shared = client;
+        batch_worker(&workers[0]);
+        client->quiet = quiet;
+    }
+    double duration = now_seconds() - batch->start;
+    if (duration <= 0) duration = 0.001;
+    client->last_bytes = batch->bytes;
+    
+    EnterCriticalSection(&batch->lock);
+    batch_report(batch, 1);
+    LeaveCriticalSection(&batch->lock);
+    DeleteCriticalSection(&batch->lock);
+    
+    printf("\n%s: %d de %d archivos, %lld bytes en %.2f segundos (%.2f MB/s, %.1f archivos/s)\n",
+           batch->label, batch->done, batch->count, batch->bytes, duration,
+           batch->bytes / 1048576.0 / duration, batch->done / duration);
+    for (int i = 0; i < connections; i++) {
+        if (workers[i].files > 0) {
+            printf("  Conexión %d: %d archivos, %lld bytes\n", i + 1, workers[i].files, workers[i].bytes);
+        }
+    }
+    if (running < connections) {
+        printf("  (%d de %d hilos iniciados)\n", running, connections);
+    }
+    for (int i = 0; i < batch->count; i++) {
+        if (!batch->jobs[i].ok) printf("  Fallido: %s\n", batch->jobs[i].name);
+    }
+    return batch->failed == 0;
+}
+
+// mget (upload = 0) o mput (upload = 1) con 'connections' conexiones simultáneas.
+// En mget el patrón se aplica al directorio remoto actual y los archivos se
+// guardan en 'local_dir'; en mput se aplica a 'local_dir' y se suben al actual.
+int transfer_batch(FTPClient* client, int upload, const char* pattern, const char* local_dir, int connections) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.parent = client;
+    batch.label = upload ? "mput" : "mget";
+    batch.upload = upload;
+    snprintf(batch.local_dir, sizeof(batch.local_dir), "%s", local_dir[0] ? local_dir : ".");
+    
+    if (!remote_pwd(client, batch.remote_dir, sizeof(batch.remote_dir))) {
+        printf("Error: no se pudo obtener el directorio remoto (PWD)\n");
+        return 0;
+    }
+    int listed = upload ? list_local_jobs(&batch, batch.local_dir, pattern)
+                        : list_remote_jobs(client, &batch, pattern);
+    if (!listed) {
+        printf("Error: no se pudo listar %s\n", upload ? batch.local_dir : batch.remote_dir);
+        batch_free(&batch);
+        return 0;
+    }
+    if (batch.count == 0) {
+        printf("Ningún archivo coincide con %s\n", pattern);
+        return 1;
+    }
+    int ok = batch_run(client, &batch, connections);
+    batch_free(&batch);
+    return ok;
+}
+
+// ==================== SINCRONIZACIÓN (mirror) ====================
+// Copia el árbol remoto en un directorio local descargando sólo lo que cambió.
+// El árbol remoto se recorre con un MLSD por directorio (tamaño y fecha de
+// cada archivo); el estado de la última sincronización se guarda en
+// MIRROR_STATE_FILE dentro del directorio local: un archivo se omite si el
+// remoto conserva tamaño y fecha y el local sigue como se dejó. Sin estado,
+// basta con que coincidan tamaño y fecha (las descargas reciben la fecha
+// remota). Lo que cambió se descarga con el pool de mget.
+
+typedef struct {
+    char* path;            // Relativa a la raíz sincronizada, con '/'
+    long long size;
+    long long mtime;       // Fecha remota (segundos UTC)
+    long long local_mtime; // Fecha del archivo local tras descargarlo
+} MirrorEntry;
+
+typedef struct {
+    MirrorEntry* entries;
+    int count;
+    int capacity;
+} MirrorState;
+
+static int mirror_state_add(MirrorState* state, const char* path, long long size, long long mtime, long long local_mtime) {
+    if (state->count == state->capacity) {
+        int capacity = state->capacity ? state->capacity * 2 : 1024;
+        MirrorEntry* grown = (MirrorEntry*)realloc(state->entries, capacity * sizeof(MirrorEntry));
+        if (!grown) return 0;
+        state->entries = grown;
+        state->capacity = capacity;
+    }
+    MirrorEntry* entry = &state->entries[state->count];
+    entry->path = strdup(path);
+    if (!entry->path) return 0;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->local_mtime = local_mtime;
+    state->count++;
+    return 1;
+}
+
+static void mirror_state_free(MirrorState* state) {
+    for (int i = 0; i < state->count; i++) free(state->entries[i].path);
+    free(state->entries);
+    memset(state, 0, sizeof(*state));
+}
+
+static int compare_mirror_entries(const void* a, const void* b) {
+    return strcmp(((const MirrorEntry*)a)->path, ((const MirrorEntry*)b)->path);
+}
+
+// Una línea por archivo: "tamaño fecha_remota fecha_local ruta"
+static void mirror_state_load(MirrorState* state, const char* file) {
+    char line[1200];
+    FILE* f = fopen(file, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        long long size, mtime, local_mtime;
+        int consumed = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' ||
+            sscanf(line, "%lld %lld %lld %n", &size, &mtime, &local_mtime, &consumed) != 3 || consumed == 0) {
+            continue;
+        }
+        if (!mirror_state_add(state, line + consumed, size, mtime, local_mtime)) break;
+    }
+    fclose(f);
+    qsort(state->entries, state->count, sizeof(MirrorEntry), compare_mirror_entries);
+}
+
+static const MirrorEntry* mirror_state_find(const MirrorState* state, const char* path) {
+    MirrorEntry key;
+    key.path = (char*)path;
+    if (state->count == 0) return NULL;
+    return (const MirrorEntry*)bsearch(&key, state->entries, state->count, sizeof(MirrorEntry), compare_mirror_entries);
+}
+
+// Se escribe en un temporal y se renombra: un corte a medias no deja el estado roto
+static int mirror_state_save(const MirrorState* state, const char* file) {
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE* f = fopen(tmp, "w");
+    if (!f) return 0;
+    fprintf(f, "# ftp_client mirror: tamaño fecha_remota fecha_local ruta\n");
+    for (int i = 0; i < state->count; i++) {
+        const MirrorEntry* e = &state->entries[i];
+        fprintf(f, "%lld %lld %lld %s\n", e->size, e->mtime, e->local_mtime, e->path);
+    }
+    int ok = fclose(f) == 0;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp, file, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp, file) == 0;
+#endif
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+static int mirror_join(char* out, size_t size, const char* base, const char* name) {
+    int len;
+    if (!base[0]) len = snprintf(out, size, "%s", name);
+    else if (!name[0]) len = snprintf(out, size, "%s", base);
+    else len = snprintf(out, size, "%s%s%s", base, base[strlen(base) - 1] == '/' ? "" : "/", name);
+    return len >= 0 && (size_t)len < size;
+}
+
+// Sincroniza 'remote_root' (absoluto o relativo al directorio actual) en
+// 'local_root'. Devuelve 1 si todo quedó al día.
+int mirror_sync(FTPClient* client, const char* remote_root, const char* local_root, int connections) {
+    char response[BUFFER_SIZE];
+    char command[1200];
+    char original_dir[512];
+    char state_file[1024];
+    Batch batch;
+    MirrorState old_state, new_state;
+    memset(&batch, 0, sizeof(batch));
+    memset(&old_state, 0, sizeof(old_state));
+    memset(&new_state, 0, sizeof(new_state));
+    batch.parent = client;
+    batch.label = "mirror";
+    snprintf(batch.local_dir, sizeof(batch.local_dir), "%s", local_root[0] ? local_root : ".");
+    
+    // Raíz remota absoluta (los hilos de descarga hacen CWD a ella)
+    int quiet = client->quiet;
+    client->quiet = 1;
+    if (!remote_pwd(client, original_dir, sizeof(original_dir))) {
+        client->quiet = quiet;
+        printf("Error: no se pudo obtener el directorio remoto (PWD)\n");
+        return 0;
+    }
+    snprintf(command, sizeof(command), "CWD %s", remote_root[0] ? remote_root : original_dir);
+    send_command(client, command);
+    if (recv_response(client, response, sizeof(response)) != 250 ||
+        !remote_pwd(client, batch.remote_dir, sizeof(batch.remote_dir))) {
+        client->quiet = quiet;
+        printf("Error: el directorio remoto %s no existe\n", remote_root);
+        return 0;
+    }
+    if (!make_local_dir(batch.local_dir)) {
+        client->quiet = quiet;
+        printf("Error: no se pudo crear el directorio local %s\n", batch.local_dir);
+        return 0;
+    }
+    snprintf(state_file, sizeof(state_file), "%s/%s", batch.local_dir, MIRROR_STATE_FILE);
+    mirror_state_load(&old_state, state_file);
+    
+    printf("Sincronizando %s -> %s...\n", batch.remote_dir, batch.local_dir);
+    double start = now_seconds();
+    double last_report = start;
+    
+    // Recorrido por niveles: cola de directorios relativos a la raíz
+    char** dirs = (char**)malloc(sizeof(char*));
+    int dir_count = 0, dir_capacity = 1;
+    int remote_files = 0, unchanged = 0;
+    long long remote_bytes = 0;
+    int ok = dirs != NULL && (dirs[dir_count++] = strdup("")) != NULL;
+    int walked;
+    
+    for (int d = 0; ok && d < dir_count; d++) {
+        char remote_dir[1100];
+        char local_dir[1100];
+        if (!mirror_join(remote_dir, sizeof(remote_dir), batch.remote_dir, dirs[d]) ||
+            !mirror_join(local_dir, sizeof(local_dir), batch.local_dir, dirs[d])) {
+            printf("\nRuta demasiado larga: %s\n", dirs[d]);
+            ok = 0;
+            break;
+        }
+        snprintf(command, sizeof(command), "CWD %s", remote_dir);
+        send_command(client, command);
+        char* listing = NULL;
+        if (recv_response(client, response, sizeof(response)) != 250 || !(listing = fetch_mlsd(client))) {
+            printf("\nError listando %s\n", remote_dir);
+            ok = 0;
+            break;
+        }
+        if (d > 0 && !make_local_dir(local_dir)) {
+            printf("\nError: no se pudo crear %s\n", local_dir);
+            free(listing);
+            ok = 0;
+            break;
+        }
+        
+        char* cursor = listing;
+        MlsdEntry entry;
+        while (ok && mlsd_next(&cursor, &entry)) {
+            char path[1100];
+            if (!safe_remote_name(entry.name)) {
+                // Un directorio "." o ".." se volvería a encolar sin fin
+                printf("\nSe omite nombre remoto no válido: %s\n", entry.name);
+                continue;
+            }
+            if (!mirror_join(path, sizeof(path), dirs[d], entry.name)) continue;
+            if (entry.is_dir) {
+                if (dir_count == dir_capacity) {
+                    char** grown = (char**)realloc(dirs, dir_capacity * 2 * sizeof(char*));
+                    if (!grown) {
+                        ok = 0;
+                        break;
+                    }
+                    dirs = grown;
+                    dir_capacity *= 2;
+                }
+                ok = (dirs[dir_count++] = strdup(path)) != NULL;
+                continue;
+            }
+            if (d == 0 && strcmp(entry.name, MIRROR_STATE_FILE) == 0) continue;
+            
+            // ¿Sigue igual que en la última sincronización?
+            char local_path[1100];
+            long long mtime = mlsd_time(entry.modify);
+            long long local_size, local_mtime;
+            const MirrorEntry* known = mirror_state_find(&old_state, path);
+            int have_local = mirror_join(local_path, sizeof(local_path), batch.local_dir, path) &&
+                             local_file_info(local_path, &local_size, &local_mtime);
+            int same = have_local && local_size == entry.size &&
+                       (known ? known->size == entry.size && known->mtime == mtime && known->local_mtime == local_mtime
+                              : mtime > 0 && local_mtime == mtime);
+            remote_files++;
+            remote_bytes += entry.size;
+            if (same) {
+                unchanged++;
+                ok = mirror_state_add(&new_state, path, entry.size, mtime, local_mtime);
+            } else {
+                BatchJob* job = batch_add_job(&batch, path, entry.size);
+                if (job) job->mtime = mtime;
+                ok = job != NULL;
+            }
+        }
+        free(listing);
+        
+        double now = now_seconds();
+        if (now - last_report >= PROGRESS_INTERVAL) {
+            last_report = now;
+            printf("\rExplorando: %d directorios, %d archivos, %d cambios   ", d + 1, remote_files, batch.count);
+            fflush(stdout);
+        }
+    }
+    walked = ok;
+    for (int d = 0; d < dir_count; d++) free(dirs[d]);
+    free(dirs);
+    
+    snprintf(command, sizeof(command), "CWD %s", original_dir);
+    send_command(client, command);
+    recv_response(client, response, sizeof(response));
+    client->quiet = quiet;
+    double scan = now_seconds() - start;
+    printf("\rExplorado: %d directorios, %d archivos (%lld bytes), %d sin cambios en %.2f segundos\n",
+           dir_count, remote_files, remote_bytes, unchanged, scan);
+    
+    if (ok && batch.count > 0) {
+        ok = batch_run(client, &batch, connections);
+        for (int i = 0; i < batch.count; i++) {
+            char local_path[1100];
+            long long local_size, local_mtime;
+            BatchJob* job = &batch.jobs[i];
+            if (job->ok && mirror_join(local_path, sizeof(local_path), batch.local_dir, job->name) &&
+                local_file_info(local_path, &local_size, &local_mtime) &&
+                !mirror_state_add(&new_state, job->name, job->size, job->mtime, local_mtime)) {
+                ok = 0;
+            }
+        }
+    }
+    
+    // Aunque fallen descargas se guarda lo ya sincronizado: la próxima vez sólo falta el resto
+    if (walked) {
+        qsort(new_state.entries, new_state.count, sizeof(MirrorEntry), compare_mirror_entries);
+        if (!mirror_state_save(&new_state, state_file)) {
+            printf("Aviso: no se pudo guardar %s\n", state_file);
+        }
+    }
+    printf("mirror: %d archivos, %d sin cambios, %d descargados, %d fallidos (%.2f segundos)\n",
+           remote_files, unchanged, batch.done, batch.failed, now_seconds() - start);
+    
+    mirror_state_free(&old_state);
+    mirror_state_free(&new_state);
+    batch_free(&batch);
+    return ok;
+}
+
+// ==================== MODO BATCH ====================
+// ftp_client batch [-h host] [-p puerto] [-u usuario] [-w clave] [-o informe.jsonl] [script]
+//
+// Ejecuta un script (o stdin) con una sola sesión autenticada y escribe una
+// línea JSON por operación con su código, bytes y tiempo. Las órdenes
+// simples consecutivas (cd, pwd, delete, size, mdtm, hash, noop, quote) se
+// envían juntas en un solo send y después se leen sus respuestas en orden,
+// así una serie de N órdenes cuesta un viaje de ida y vuelta y no N. Un cd
+// cierra la serie (lo que sigue depende de él) y si falla se detiene el
+// script: las rutas relativas posteriores apuntarían a otro sitio. Las
+// transferencias (get, reget, put, ls, mget, mput, mirror) y "mode z|s" van
+// de una en una sobre la misma sesión.
+
+#define PIPELINE_DEPTH 32
+
+typedef struct {
+    int line;
+    char op[16];
+    char args[512];
+    char command[600]; // Orden FTP ya formada
+} PipelinedOp;
+
+typedef struct {
+    FTPClient* client;
+    FILE* report;
+    int ops;
+    int failed;
+    long long bytes;
+    double start;
+    int stop;
+    PipelinedOp pending[PIPELINE_DEPTH];
+    int pending_count;
+} BatchScript;
+
+// Nombre o IPv4 del servidor a IPv4 en texto (connect_ftp usa inet_addr)
+int resolve_host(const char* host, char* ip, size_t size) {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    int ok;
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return 0;
+#endif
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    ok = getaddrinfo(host, NULL, &hints, &result) == 0;
+    if (ok) {
+        snprintf(ip, size, "%s", inet_ntoa(((struct sockaddr_in*)result->ai_addr)->sin_addr));
+        freeaddrinfo(result);
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return ok;
+}
+
+static void json_string(FILE* out, const char* text) {
+    fputc('"', out);
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(out, "\\%c", *p);
+        else if (*p == '\n') fputs("\\n", out);
+        else if (*p == '\r') fputs("\\r", out);
+        else if (*p < 0x20) fprintf(out, "\\u%04x", *p);
+        else fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// Una línea del informe. 'reply' puede ser NULL (transferencias)
+static void batch_report_op(BatchScript* run, int line, const char* op, const char* args, int ok, int code,
+                            long long bytes, double seconds, const char* reply) {
+    FILE* out = run->report;
+    run->ops++;
+    if (!ok) run->failed++;
+    run->bytes += bytes;
+    fprintf(out, "{\"line\":%d,\"op\":", line);
+    json_string(out, op);
+    fputs(",\"args\":", out);
+    json_string(out, args);
+    fprintf(out, ",\"ok\":%s,\"code\":%d,\"bytes\":%lld,\"seconds\":%.6f,\"mb_s\":%.2f",
+            ok ? "true" : "false", code, bytes, seconds, seconds > 0 ? bytes / 1048576.0 / seconds : 0.0);
+    if (reply) {
+        char text[BUFFER_SIZE];
+        snprintf(text, sizeof(text), "%s", reply);
+        text[strcspn(text, "\r\n")] = '\0'; // Sólo la primera línea
+        fputs(",\"reply\":", out);
+        json_string(out, text);
+    }
+    fputs("}\n", out);
+    fflush(out); // Quien siga el informe lo ve al momento
+}
+
+// Envía todas las órdenes simples pendientes de una vez y lee sus respuestas
+static void batch_flush(BatchScript* run) {
+    char buffer[PIPELINE_DEPTH * 602];
+    char response[BUFFER_SIZE];
+    size_t len = 0;
+    if (run->pending_count == 0) return;
+    
+    for (int i = 0; i < run->pending_count; i++) {
+        len += snprintf(buffer + len, sizeof(buffer) - len, "%s\r\n", run->pending[i].command);
+    }
+    double sent = now_seconds();
+    int lost = send_all_data(run->client->ctrl_sock, buffer, (int)len) != 0;
+    
+    for (int i = 0; i < run->pending_count; i++) {
+        PipelinedOp* op = &run->pending[i];
+        int code = lost ? 0 : recv_response(run->client, response, sizeof(response));
+        if (code == 0) {
+            lost = 1;
+            response[0] = '\0';
+        }
+        int ok = code >= 200 && code < 400;
+        batch_report_op(run, op->line, op->op, op->args, ok, code, 0, now_seconds() - sent, response);
+        if (lost || (!ok && strcmp(op->op, "cd") == 0)) run->stop = 1;
+    }
+    run->pending_count = 0;
+}
+
+// Separa una línea del script en palabras; "entre comillas" admite espacios
+static int split_words(char* line, char* words[], int max) {
+    int count = 0;
+    char* p = line;
+    while (count < max) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (!*p) break;
+        if (*p == '"') {
+            words[count++] = ++p;
+            while (*p && *p != '"') p++;
+        } else {
+            words[count++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        }
+        if (*p) *p++ = '\0';
+    }
+    return count;
+}
+
+static const char* path_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* backslash = strrchr(path, '\\');
+    if (backslash > slash) slash = backslash;
+    return slash ? slash + 1 : path;
+}
+
+// Órdenes simples: se encolan para enviarlas juntas. Devuelve 0 si 'op' no lo es.
+static int batch_queue_simple(BatchScript* run, int line, char* words[], int count, const char* raw, const char* args) {
+    static const struct { const char* op; const char* verb; int needs_arg; } simple[] = {
+        {"cd", "CWD", 1}, {"pwd", "PWD", 0}, {"delete", "DELE", 1}, {"size", "SIZE", 1},
+        {"mdtm", "MDTM", 1}, {"hash", "HASH", 1}, {"noop", "NOOP", 0}, {"quote", NULL, 1},
+    };
+    for (size_t i = 0; i < sizeof(simple) / sizeof(simple[0]); i++) {
+        if (strcmp(words[0], simple[i].op) != 0) continue;
+        PipelinedOp* op = &run->pending[run->pending_count];
+        if (simple[i].needs_arg && count < 2) {
+            batch_flush(run);
+            batch_report_op(run, line, words[0], args, 0, 0, 0, 0, "Falta el argumento");
+            return 1;
+        }
+        op->line = line;
+        snprintf(op->op, sizeof(op->op), "%s", simple[i].op);
+        snprintf(op->args, sizeof(op->args), "%s", args);
+        if (!simple[i].verb) {
+            snprintf(op->command, sizeof(op->command), "%s", raw); // quote: el resto de la línea tal cual
+        } else if (simple[i].needs_arg) {
+            snprintf(op->command, sizeof(op->command), "%s %s", simple[i].verb, words[1]);
+        } else {
+            snprintf(op->command, sizeof(op->command), "%s", simple[i].verb);
+        }
+        run->pending_count++;
+        if (run->pending_count == PIPELINE_DEPTH || strcmp(op->op, "cd") == 0) batch_flush(run);
+        return 1;
+    }
+    return 0;
+}
+
+// Transferencias y cambios de modo: de una en una
+static void batch_run_op(BatchScript* run, int line, char* words[], int count, const char* args) {
+    FTPClient* client = run->client;
+    const char* op = words[0];
+    int ok = 0;
+    int known = 1;
+    client->last_bytes = 0;
+    double start = now_seconds();
+    
+    if ((strcmp(op, "get") == 0 || strcmp(op, "reget") == 0) && count >= 2) {
+        ok = download_file(client, words[1], count > 2 ? words[2] : path_basename(words[1]), op[0] == 'r');
+    } else if (strcmp(op, "put") == 0 && count >= 2) {
+        ok = upload_file(client, words[1], count > 2 ? words[2] : path_basename(words[1]));
+    } else if (strcmp(op, "ls") == 0) {
+        ok = list_directory(client); // El listado sale por stderr
+    } else if ((strcmp(op, "mget") == 0 || strcmp(op, "mput") == 0) && count >= 2) {
+        ok = transfer_batch(client, op[1] == 'p', words[1], count > 2 ? words[2] : ".",
+                            count > 3 && atoi(words[3]) > 0 ? atoi(words[3]) : 4);
+    } else if (strcmp(op, "mirror") == 0 && count >= 3) {
+        ok = mirror_sync(client, words[1], words[2], count > 3 && atoi(words[3]) > 0 ? atoi(words[3]) : 4);
+    } else if (strcmp(op, "mode") == 0 && count >= 2 && (words[1][0] == 'z' || words[1][0] == 'Z')) {
+        ok = set_mode_z(client, 1, count > 2 ? atoi(words[2]) : 0);
+    } else if (strcmp(op, "mode") == 0 && count >= 2 && (words[1][0] == 's' || words[1][0] == 'S')) {
+        ok = set_mode_z(client, 0, 0);
+    } else {
+        known = 0;
+    }
+    
+    if (!known) {
+        batch_report_op(run, line, op, args, 0, 0, 0, 0, "Orden desconocida o faltan argumentos");
+        return;
+    }
+    batch_report_op(run, line, op, args, ok, client->last_code, client->last_bytes, now_seconds() - start, NULL);
+    if (client->last_code == 0) run->stop = 1; // Conexión de control perdida
+}
+
+int run_batch_command(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    const char* username = "test";
+    const char* password = "test123";
+    const char* report_path = NULL;
+    const char* script_path = NULL;
+    int port = FTP_PORT;
+    
+    for (int i = 2; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc) {
+            switch (argv[i][1]) {
+                case 'h': host = argv[++i]; continue;
+                case 'p': port = atoi(argv[++i]); continue;
+                case 'u': username = argv[++i]; continue;
+                case 'w': password = argv[++i]; continue;
+                case 'o': report_path = argv[++i]; continue;
+            }
+        }
+        if (script_path || (argv[i][0] == '-' && argv[i][1])) {
+            fprintf(stderr, "Uso: %s batch [-h host] [-p puerto] [-u usuario] [-w clave] [-o informe.jsonl] [script]\n", argv[0]);
+            return 2;
+        }
+        script_path = argv[i];
+    }
+    
+    FILE* script = script_path && strcmp(script_path, "-") != 0 ? fopen(script_path, "r") : stdin;
+    if (!script) {
+        fprintf(stderr, "No se pudo abrir el script %s\n", script_path);
+        return 2;
+    }
+    // El informe va a stdout salvo -o; los mensajes del cliente pasan a stderr
+    // para que stdout quede sólo con JSON
+    FILE* report;
+    if (report_path) {
+        report = fopen(report_path, "w");
+    } else {
+        fflush(stdout);
+#ifdef _WIN32
+        report = _fdopen(_dup(1), "w");
+        _dup2(2, 1);
+#else
+        report = fdopen(dup(1), "w");
+        dup2(2, 1);
+#endif
+    }
+    if (!report) {
+        fprintf(stderr, "No se pudo abrir el informe %s\n", report_path ? report_path : "(stdout)");
+        return 2;
+    }
+    
+    FTPClient client;
+    BatchScript run;
+    char server[64];
+    memset(&client, 0, sizeof(client));
+    memset(&run, 0, sizeof(run));
+    client.quiet = 1;
+    run.client = &client;
+    run.report = report;
+    run.start = now_seconds();
+    
+    if (!resolve_host(host, server, sizeof(server)) || !connect_ftp(&client, server, port) ||
+        !login_ftp(&client, username, password)) {
+        batch_report_op(&run, 0, "login", host, 0, client.last_code, 0, now_seconds() - run.start, NULL);
+        if (client.ctrl_sock != INVALID_SOCKET && client.last_code != 0) disconnect_ftp(&client);
+        fclose(report);
+        return 1;
+    }
+    batch_report_op(&run, 0, "login", host, 1, client.last_code, 0, now_seconds() - run.start, NULL);
+    
+    char line[1024];
+    int line_no = 0;
+    while (!run.stop && fgets(line, sizeof(line), script)) {
+        char raw[1024];
+        char args[512];
+        char* words[8];
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        snprintf(raw, sizeof(raw), "%s", line);
+        int count = split_words(line, words, 8);
+        if (count == 0 || words[0][0] == '#') continue;
+        
+        // Argumentos tal cual (para el informe y para quote)
+        const char* rest = raw + strspn(raw, " \t");
+        rest += strcspn(rest, " \t");
+        rest += strspn(rest, " \t");
+        snprintf(args, sizeof(args), "%s", rest);
+        
+        if (batch_queue_simple(&run, line_no, words, count, rest, args)) continue;
+        batch_flush(&run);
+        if (run.stop) break;
+        batch_run_op(&run, line_no, words, count, args);
+    }
+    batch_flush(&run);
+    
+    double duration = now_seconds() - run.start;
+    fprintf(report, "{\"op\":\"summary\",\"ops\":%d,\"failed\":%d,\"bytes\":%lld,\"seconds\":%.6f,\"mb_s\":%.2f,\"aborted\":%s}\n",
+            run.ops, run.failed, run.bytes, duration, duration > 0 ? run.bytes / 1048576.0 / duration : 0.0,
+            run.stop ? "true" : "false");
+    fclose(report);
+    if (script != stdin) fclose(script);
+    if (client.last_code != 0) disconnect_ftp(&client);
+    return run.failed == 0 && !run.stop ? 0 : 1;
+}
+
+void print_menu() {
+    printf("\n=== Cliente FTP ===\n");
+    printf("1. Listar archivos (LIST)\n");
+    printf("2. Descargar archivo (RETR)\n");
+    printf("3. Subir archivo (STOR)\n");
+    printf("4. Cambiar directorio (CWD)\n");
+    printf("5. Mostrar directorio actual (PWD)\n");
+    printf("6. Información del sistema (SYST)\n");
+    printf("7. Reanudar descarga (REST)\n");
+    printf("8. Descarga en paralelo por segmentos\n");
+    printf("9. Compresión MODE Z (activar/desactivar)\n");
+    printf("10. Descarga múltiple (mget)\n");
+    printf("11. Subida múltiple (mput)\n");
+    printf("12. Sincronizar directorio remoto (mirror)\n");
+    printf("0. Salir (QUIT)\n");
+    printf("Opción: ");
+}
+
+void get_input(const char* prompt, char* buffer, size_t size) {
+    printf("%s", prompt);
+    fgets(buffer, size, stdin);
+    buffer[strcspn(buffer, "\n")] = 0;
+}
+
+// ftp_client mirror <dir_remoto> <dir_local> [usuario] [clave] [conexiones]
+int run_mirror_command(int argc, char* argv[]) {
     FTPClient client;
+    memset(&client, 0, sizeof(client));
+    client.quiet = 1;
+    const char* username = argc > 4 ? argv[4] : "test";
+    const char* password = argc > 5 ? argv[5] : "test123";
+    int connections = argc > 6 && atoi(argv[6]) > 0 ? atoi(argv[6]) : 4;
+    
+    if (!connect_ftp(&client, "127.0.0.1", FTP_PORT)) {
+        printf("Error conectando al servidor\n");
+        return 1;
+    }
+    if (!login_ftp(&client, username, password)) {
+        printf("Error de autenticación\n");
+        disconnect_ftp(&client);
+        return 1;
+    }
+    int ok = mirror_sync(&client, argv[2], argv[3], connections);
+    disconnect_ftp(&client);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
+    // Configurar consola para UTF-8 (acentos)
+    SetConsoleOutputCP(65001);
+#endif
+
+    // Modo no interactivo
+    if (argc >= 4 && strcmp(argv[1], "mirror") == 0) {
+        return run_mirror_command(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "batch") == 0) {
+        return run_batch_command(argc, argv);
+    }
+
+    FTPClient client;
+    memset(&client, 0, sizeof(client));
     char server[64];
     char username[64];
     char password[64];
@@ -436,7 +2266,7 @@ int main() {
                 }
                 
                 printf("\nEjecutando RETR...\n");
-                if (download_file(&client, remote_file, local_file)) {
+                if (download_file(&client, remote_file, local_file, 0)) {
                     printf("RETR ejecutado correctamente\n");
                 } else {
                     printf("Error en RETR\n");
@@ -483,7 +2313,107 @@ int main() {
                 recv_response(&client, response, sizeof(response));
                 break;
                 
-            case 7: // QUIT
+            case 7: // REST + RETR
+                get_input("Archivo remoto a reanudar: ", remote_file, sizeof(remote_file));
+                get_input("Archivo local parcial: ", local_file, sizeof(local_file));
+                
+                if (strlen(remote_file) == 0 || strlen(local_file) == 0) {
+                    printf("Error: nombres de archivo vacíos\n");
+                    break;
+                }
+                
+                printf("\nEjecutando REST + RETR...\n");
+                if (download_file(&client, remote_file, local_file, 1)) {
+                    printf("RETR ejecutado correctamente\n");
+                } else {
+                    printf("Error en RETR\n");
+                }
+                break;
+                
+            case 8: { // Descarga segmentada
+                char segments_text[16];
+                get_input("Archivo remoto a descargar: ", remote_file, sizeof(remote_file));
+                get_input("Guardar como (local): ", local_file, sizeof(local_file));
+                get_input("Conexiones paralelas (por defecto 4): ", segments_text, sizeof(segments_text));
+                
+                if (strlen(remote_file) == 0 || strlen(local_file) == 0) {
+                    printf("Error: nombres de archivo vacíos\n");
+                    break;
+                }
+                
+                int segments = atoi(segments_text) > 0 ? atoi(segments_text) : 4;
+                printf("\nEjecutando descarga segmentada...\n");
+                if (download_file_segmented(&client, remote_file, local_file, segments)) {
+                    printf("Descarga segmentada completada correctamente\n");
+                } else {
+                    printf("Error en descarga segmentada\n");
+                }
+                break;
+            }
+                
+            case 9: { // MODE Z
+                if (client.mode_z) {
+                    if (set_mode_z(&client, 0, 0)) printf("MODE Z desactivado\n");
+                    break;
+                }
+                char level_text[16];
+                get_input("Nivel de compresión 1-9 (por defecto el del servidor): ", level_text, sizeof(level_text));
+                if (set_mode_z(&client, 1, atoi(level_text))) {
+                    printf("MODE Z activado: LIST, RETR y STOR van comprimidos\n");
+                } else {
+                    printf("El servidor no admite MODE Z\n");
+                }
+                break;
+            }
+                
+            case 10: // mget
+            case 11: { // mput
+                char pattern[256];
+                char connections_text[16];
+                get_input(option == 10 ? "Patrón remoto (p. ej. *.txt): " : "Patrón local (p. ej. *.txt): ",
+                          pattern, sizeof(pattern));
+                get_input(option == 10 ? "Directorio local de destino (por defecto .): "
+                                       : "Directorio local de origen (por defecto .): ",
+                          dir_path, sizeof(dir_path));
+                get_input("Conexiones simultáneas (por defecto 4): ", connections_text, sizeof(connections_text));
+                
+                if (strlen(pattern) == 0) {
+                    printf("Error: patrón vacío\n");
+                    break;
+                }
+                
+                int connections = atoi(connections_text) > 0 ? atoi(connections_text) : 4;
+                printf("\nEjecutando %s...\n", option == 10 ? "mget" : "mput");
+                if (transfer_batch(&client, option == 11, pattern, dir_path, connections)) {
+                    printf("%s completado correctamente\n", option == 10 ? "mget" : "mput");
+                } else {
+                    printf("Error en %s\n", option == 10 ? "mget" : "mput");
+                }
+                break;
+            }
+                
+            case 12: { // mirror
+                char connections_text[16];
+                get_input("Directorio remoto (por defecto el actual): ", remote_file, sizeof(remote_file));
+                get_input("Directorio local: ", local_file, sizeof(local_file));
+                get_input("Conexiones simultáneas (por defecto 4): ", connections_text, sizeof(connections_text));
+                
+                if (strlen(local_file) == 0) {
+                    printf("Error: directorio local vacío\n");
+                    break;
+                }
+                
+                int connections = atoi(connections_text) > 0 ? atoi(connections_text) : 4;
+                printf("\nEjecutando mirror...\n");
+                if (mirror_sync(&client, remote_file, local_file, connections)) {
+                    printf("mirror completado correctamente\n");
+                } else {
+                    printf("Error en mirror\n");
+                }
+                break;
+            }
+                
+            case 0: // QUIT
                 printf("\nCerrando conexión...\n");
                 disconnect_ftp(&client);
                 printf("Desconectado.\n");
@@ -0,0 +1,106 @@
+// ftp_logconv.c - Convierte el log binario del servidor FTP a texto
+// Compilar (Windows): gcc ftp_logconv.c -o ftp_logconv.exe
+// Compilar (Linux):   gcc ftp_logconv.c -o ftp_logconv
+// Uso: ftp_logconv [logs/ftp_server.bin] [salida.log]   (sin salida = consola)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_BINARY_FILE "logs/ftp_server.bin"
+#define LOG_MAGIC "FTPLOG1"
+
+// Debe coincidir con LogRecord de ftp_server.c
+typedef struct {
+    long long time_us;     // Hora de pared en µs
+    long long duration_us;
+    long long size;
+    char ip[16];
+    unsigned short port;
+    unsigned char transfer; // 1 = incluye RATE (RETR/STOR/APPE)
+    unsigned char reserved;
+    char cmd[8];
+    char status[4];
+    long long wire_size;    // MODE Z: bytes comprimidos en el canal (0 = sin comprimir)
+    long long cpu_us;
+} LogRecord;
+
+// Registros de versiones anteriores: mismo inicio, sin los campos de MODE Z
+#define LOG_RECORD_V1_SIZE 56
+
+int main(int argc, char* argv[]) {
+    const char* input_path = argc > 1 ? argv[1] : LOG_BINARY_FILE;
+    FILE* in = fopen(input_path, "rb");
+    if (!in) {
+        printf("No se pudo abrir %s\n", input_path);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (argc > 2 && !(out = fopen(argv[2], "w"))) {
+        printf("No se pudo crear %s\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    char magic[8];
+    unsigned int record_size = 0;
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, LOG_MAGIC, 8) != 0 ||
+        fread(&record_size, sizeof(record_size), 1, in) != 1) {
+        printf("%s no es un log binario del servidor FTP\n", input_path);
+        fclose(in);
+        if (out != stdout) fclose(out);
+        return 1;
+    }
+    if (record_size != sizeof(LogRecord) && record_size != LOG_RECORD_V1_SIZE) {
+        printf("Tamaño de registro %u no soportado (se esperaba %u)\n",
+               record_size, (unsigned int)sizeof(LogRecord));
+        fclose(in);
+        if (out != stdout) fclose(out);
+        return 1;
+    }
+
+    LogRecord rec;
+    time_t ts_sec = (time_t)-1;
+    char ts[32] = "";
+    long count = 0;
+
+    memset(&rec, 0, sizeof(rec));
+    while (fread(&rec, record_size, 1, in) == 1) {
+        rec.ip[sizeof(rec.ip) - 1] = '\0';
+        rec.cmd[sizeof(rec.cmd) - 1] = '\0';
+        rec.status[sizeof(rec.status) - 1] = '\0';
+
+        time_t sec = (time_t)(rec.time_us / 1000000LL);
+        if (sec != ts_sec) {
+            strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+            ts_sec = sec;
+        }
+
+        if (rec.wire_size > 0) {
+            double seconds = rec.duration_us > 0 ? rec.duration_us / 1000000.0 : 0.000001;
+            fprintf(out, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%lldms SIZE=%lld RATE=%.2fMB/s "
+                    "MODE=Z WIRE=%lld RATIO=%.2f CPU=%.1fms\n",
+                    ts, rec.ip, rec.port, rec.cmd, rec.status, rec.duration_us / 1000, rec.size,
+                    rec.size / seconds / (1024.0 * 1024.0), rec.wire_size,
+                    (double)rec.size / rec.wire_size, rec.cpu_us / 1000.0);
+        } else if (rec.transfer) {
+            double seconds = rec.duration_us > 0 ? rec.duration_us / 1000000.0 : 0.000001;
+            fprintf(out, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%lldms SIZE=%lld RATE=%.2fMB/s\n",
+                    ts, rec.ip, rec.port, rec.cmd, rec.status, rec.duration_us / 1000, rec.size,
+                    rec.size / seconds / (1024.0 * 1024.0));
+        } else {
+            fprintf(out, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%lldms SIZE=%lld\n",
+                    ts, rec.ip, rec.port, rec.cmd, rec.status, rec.duration_us / 1000, rec.size);
+        }
+        count++;
+    }
+
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+        printf("%ld registros convertidos en %s\n", count, argv[2]);
+    }
+    return 0;
+}
@@ -0,0 +1,325 @@
+// ftp_pack.c - Empaqueta un directorio en un archivo de solo lectura para el servidor FTP
+// Compilar (Windows): gcc ftp_pack.c -o ftp_pack.exe
+// Compilar (Linux):   gcc ftp_pack.c -o ftp_pack
+// Uso: ftp_pack <directorio> <salida.pack>
+//
+// El paquete se monta poniendo su ruta como home del usuario en
+// config/users.txt (usuario:clave:ftp/archivo.pack): el servidor lo mapea en
+// memoria y sirve todo el árbol sin abrir un archivo por cada descarga.
+// Se escribe en <salida.pack>.tmp y se renombra al terminar, así que se puede
+// regenerar con el servidor en marcha: los logins siguientes ven el nuevo.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#define PACK_MAGIC "FTPPACK1"
+#define MAX_PATH_LEN 512
+#define MAX_NAME_LEN 255
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// Debe coincidir con PackHeader/PackEntry de ftp_server.c
+typedef struct {
+    char magic[8];
+    unsigned int entry_count;
+    unsigned int names_size;
+    long long names_offset;
+    long long data_offset;
+    long long total_size;
+} PackHeader;
+
+typedef struct {
+    long long offset;         // Datos del archivo (desde el inicio del paquete)
+    long long size;
+    long long mtime;
+    unsigned int name;        // Desplazamiento en la tabla de nombres
+    unsigned int first_child; // Directorios: primer hijo y cantidad de hijos
+    unsigned int child_count;
+    unsigned short name_len;
+    unsigned short is_dir;
+} PackEntry;
+
+// Nodo del árbol mientras se construye el índice. Los nodos quedan en orden
+// por niveles: los hijos de cada directorio se añaden juntos y ordenados.
+typedef struct {
+    char* name;
+    char* path; // Ruta real, para leer los datos
+    int is_dir;
+    long long size;
+    long long mtime;
+    unsigned int first_child;
+    unsigned int child_count;
+} Node;
+
+Node* nodes = NULL;
+size_t node_count = 0;
+size_t node_capacity = 0;
+
+static int add_node(const char* name, const char* path, int is_dir, long long size, long long mtime) {
+    if (node_count == node_capacity) {
+        size_t capacity = node_capacity ? node_capacity * 2 : 1024;
+        Node* grown = (Node*)realloc(nodes, capacity * sizeof(Node));
+        if (!grown) return -1;
+        nodes = grown;
+        node_capacity = capacity;
+    }
+    Node* node = &nodes[node_count];
+    memset(node, 0, sizeof(*node));
+    node->name = strdup(name);
+    node->path = strdup(path);
+    if (!node->name || !node->path) return -1;
+    node->is_dir = is_dir;
+    node->size = size;
+    node->mtime = mtime;
+    node_count++;
+    return 0;
+}
+
+static int compare_nodes(const void* a, const void* b) {
+    return strcmp(((const Node*)a)->name, ((const Node*)b)->name);
+}
+
+// Archivos internos del servidor: sidecars de checksums y temporales de subida
+static int is_internal_file(const char* name) {
+    size_t len = strlen(name);
+    return name[0] == '.' && ((len > 4 && strcmp(name + len - 4, ".sum") == 0) ||
+                              (len > 5 && strcmp(name + len - 5, ".part") == 0));
+}
+
+// Entrada de un directorio: se omiten ".", "..", los internos y los nombres largos
+static int add_child(const char* dir_path, const char* name, int is_dir, long long size, long long mtime) {
+    char path[MAX_PATH_LEN * 2];
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || is_internal_file(name)) return 0;
+    if (strlen(name) > MAX_NAME_LEN ||
+        snprintf(path, sizeof(path), "%s/%s", dir_path, name) >= (int)sizeof(path)) {
+        printf("Omitido (nombre demasiado largo): %s/%s\n", dir_path, name);
+        return 0;
+    }
+    return add_node(name, path, is_dir, size, mtime);
+}
+
+// Añade al final los hijos de nodes[index], ordenados por nombre
+static int read_children(size_t index) {
+    char dir_path[MAX_PATH_LEN * 2];
+    size_t first = node_count;
+    snprintf(dir_path, sizeof(dir_path), "%s", nodes[index].path);
+
+#ifdef _WIN32
+    char search_path[MAX_PATH_LEN * 2 + 4];
+    snprintf(search_path, sizeof(search_path), "%s\\*", dir_path);
+    WIN32_FIND_DATAA find_data;
+    HANDLE hFind = FindFirstFileA(search_path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        printf("No se pudo leer %s\n", dir_path);
+        return -1;
+    }
+    do {
+        // Los enlaces simbólicos y puntos de montaje se omiten (evita ciclos)
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+        ULARGE_INTEGER t;
+        t.LowPart = find_data.ftLastWriteTime.dwLowDateTime;
+        t.HighPart = find_data.ftLastWriteTime.dwHighDateTime;
+        int is_dir = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        long long size = ((long long)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+        if (add_child(dir_path, find_data.cFileName, is_dir, is_dir ? 0 : size,
+                      (long long)((t.QuadPart - 116444736000000000ULL) / 10000000ULL)) != 0) {
+            FindClose(hFind);
+            return -1;
+        }
+    } while (FindNextFileA(hFind, &find_data));
+    FindClose(hFind);
+#else
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        printf("No se pudo leer %s\n", dir_path);
+        return -1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[MAX_PATH_LEN * 2];
+        struct stat st;
+        // lstat: los enlaces simbólicos se omiten (evita ciclos y salir del árbol)
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(path) ||
+            lstat(path, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) continue;
+        if (add_child(dir_path, entry->d_name, S_ISDIR(st.st_mode), S_ISDIR(st.st_mode) ? 0 : (long long)st.st_size,
+                      (long long)st.st_mtime) != 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+#endif
+
+    qsort(nodes + first, node_count - first, sizeof(Node), compare_nodes);
+    nodes[index].first_child = (unsigned int)first;
+    nodes[index].child_count = (unsigned int)(node_count - first);
+    return 0;
+}
+
+// Copia exactamente 'size' bytes de 'path' al paquete
+static int copy_file(FILE* out, const char* path, long long size, char* buffer) {
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        printf("No se pudo abrir %s\n", path);
+        return -1;
+    }
+    long long copied = 0;
+    size_t n;
+    while (copied < size &&
+           (n = fread(buffer, 1, size - copied < COPY_BUFFER_SIZE ? (size_t)(size - copied) : COPY_BUFFER_SIZE, in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            fclose(in);
+            printf("Error al escribir el paquete\n");
+            return -1;
+        }
+        copied += n;
+    }
+    int changed = copied != size || fgetc(in) != EOF;
+    fclose(in);
+    if (changed) {
+        printf("%s cambió mientras se empaquetaba\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int replace_file(const char* from, const char* to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+// Reloj de pared en segundos: la copia espera al disco, clock() no lo contaría
+static double now_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Uso: %s <directorio> <salida.pack>\n", argv[0]);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(argv[1], &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("%s no es un directorio\n", argv[1]);
+        return 1;
+    }
+    if (add_node("", argv[1], 1, 0, (long long)st.st_mtime) != 0) {
+        printf("Memoria insuficiente\n");
+        return 1;
+    }
+
+    // Recorrido por niveles: cada directorio añade sus hijos al final
+    unsigned int files = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        if (!nodes[i].is_dir) {
+            files++;
+            continue;
+        }
+        if (read_children(i) != 0) return 1;
+        if (node_count >= 0xFFFFFFFFu) {
+            printf("Demasiadas entradas para un paquete\n");
+            return 1;
+        }
+    }
+
+    // Tabla de nombres (cada uno terminado en '\0') y posición de los datos
+    long long names_size = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        names_size += (long long)strlen(nodes[i].name) + 1;
+    }
+    if (names_size >= 0xFFFFFFFFLL) {
+        printf("Demasiados nombres para un paquete\n");
+        return 1;
+    }
+
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.entry_count = (unsigned int)node_count;
+    header.names_size = (unsigned int)names_size;
+    header.names_offset = (long long)sizeof(PackHeader) + (long long)node_count * (long long)sizeof(PackEntry);
+    header.data_offset = header.names_offset + names_size;
+
+    PackEntry* entries = (PackEntry*)calloc(node_count, sizeof(PackEntry));
+    if (!entries) {
+        printf("Memoria insuficiente\n");
+        return 1;
+    }
+    long long data_end = header.data_offset;
+    unsigned int name_offset = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        PackEntry* e = &entries[i];
+        e->name = name_offset;
+        e->name_len = (unsigned short)strlen(nodes[i].name);
+        e->is_dir = (unsigned short)nodes[i].is_dir;
+        e->mtime = nodes[i].mtime;
+        name_offset += e->name_len + 1;
+        if (nodes[i].is_dir) {
+            e->first_child = nodes[i].first_child;
+            e->child_count = nodes[i].child_count;
+        } else {
+            e->offset = data_end;
+            e->size = nodes[i].size;
+            data_end += nodes[i].size;
+        }
+    }
+    header.total_size = data_end;
+
+    char tmp_path[MAX_PATH_LEN + 8];
+    int tmp_len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", argv[2]);
+    if (tmp_len < 0 || tmp_len >= (int)sizeof(tmp_path)) {
+        printf("Ruta de salida demasiado larga: %s\n", argv[2]);
+        return 1;
+    }
+    FILE* out = fopen(tmp_path, "wb");
+    char* buffer = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!out || !buffer) {
+        printf("No se pudo crear %s\n", tmp_path);
+        if (out) fclose(out);
+        return 1;
+    }
+
+    double start = now_seconds();
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                 fwrite(entries, sizeof(PackEntry), node_count, out) != node_count;
+    for (size_t i = 0; !failed && i < node_count; i++) {
+        failed = fwrite(nodes[i].name, 1, strlen(nodes[i].name) + 1, out) != strlen(nodes[i].name) + 1;
+    }
+    for (size_t i = 0; !failed && i < node_count; i++) {
+        if (!nodes[i].is_dir) failed = copy_file(out, nodes[i].path, nodes[i].size, buffer) != 0;
+    }
+    if (fclose(out) != 0) failed = 1;
+    free(buffer);
+
+    if (failed || replace_file(tmp_path, argv[2]) != 0) {
+        printf("No se pudo generar %s\n", argv[2]);
+        remove(tmp_path);
+        return 1;
+    }
+
+    printf("%s: %u archivos, %u directorios, %lld bytes (%.2f s)\n", argv[2], files,
+           (unsigned int)node_count - files, header.total_size, now_seconds() - start);
+    return 0;
+}
@@ -1,611 +1,5501 @@
 // ftp_server_improved.c - Servidor FTP
-// Compilar: gcc ftp_server.c -o ftp_server.exe -lws2_32
+// Compilar (Windows): gcc ftp_server.c -o ftp_server.exe -lws2_32 -lz
+// Compilar (Linux):   gcc ftp_server.c -o ftp_server -lpthread -lz
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h> // CRC32C por hardware (SSE4.2)
+#define HAVE_SSE42_CRC 1
+#endif
+
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
-#include <time.h>
 #include <windows.h>
 #include <direct.h>
+#include <io.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
+#define strtok_r strtok_s
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+#define fseeko _fseeki64
+#define PATH_SEP '\\'
+#else
+// Capa de compatibilidad POSIX: se conservan los nombres de Winsock/Win32
+// para que los handlers sean los mismos en ambas plataformas.
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
+typedef int SOCKET;
+typedef unsigned long DWORD;
+typedef void* LPVOID;
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE;
+
+#define WINAPI
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket(s) close(s)
+#define WSAGetLastError() errno
+#define InitializeCriticalSection(cs) pthread_mutex_init(cs, NULL)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define InitializeConditionVariable(cv) pthread_cond_init(cv, NULL)
+#define SleepConditionVariableCS(cv, cs, ms) pthread_cond_wait(cv, cs) // Sólo se usa con INFINITE
+#define WakeConditionVariable(cv) pthread_cond_signal(cv)
+#define WakeAllConditionVariable(cv) pthread_cond_broadcast(cv)
+#define INFINITE 0xFFFFFFFF
+
+#define PATH_SEP '/'
+#endif
+
+#include "../common/net_listener.h"
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #define FTP_PORT 21 // Puerto estándar FTP
 #define BUFFER_SIZE 8192
+#define CTRL_BUFFER_SIZE 1024 // Buffer de comandos por sesión (canal de control)
 #define MAX_PATH_LEN 512
+#define MAX_EVENTS 64
+#define DATA_ACCEPT_TIMEOUT_MS 30000 // Espera máxima por la conexión de datos
+#define SESSION_DEFERRED 2 // session_process_input: comando pendiente para el pool de transferencias
+#define UPLOAD_QUEUE_DEPTH 8 // Buffers de subida en vuelo entre la red y el disco
+#define ZBUF_SIZE 65536 // Buffer de zlib por transferencia en MODE Z
 #define LOG_FILE "logs/ftp_server.log"
+#define LOG_BINARY_FILE "logs/ftp_server.bin" // Registro binario (ver ftp_logconv.c)
+#define LOG_RING_SIZE 4096    // Registros por anillo de hilo (potencia de 2)
+#define LOG_BATCH_BYTES 65536 // Tamaño de lote que fuerza una escritura
 #define USERS_FILE "config/users.txt"
+#define CONFIG_FILE "config/ftp_server.conf"
+#define USERS_POLL_MS 2000 // Intervalo de revisión de users.txt sin inotify
+#define METRICS_FILE "logs/ftp_metrics.txt"
+#define FILE_CACHE_SHARDS 16 // Particiones (con lock propio) de la caché de archivos
+#define HIST_SUB_BITS 3 // Precisión del histograma: 2^3 sub-cubetas por potencia de 2 (~12%)
+#define HIST_BUCKETS (38 << HIST_SUB_BITS)
+#define RATE_QUANTUM (16 * 1024) // Bytes que reserva de una vez una transferencia de peso 1
+#define RATE_USER_SLOTS 1024     // Usuarios distintos con límite propio (potencia de 2)
+
+// Verbo FTP empaquetado en 32 bits: VERB('R', 'E', 'T', 'R')
+#define VERB(a, b, c, d) ((unsigned int)(a) | (unsigned int)(b) << 8 | \
+                          (unsigned int)(c) << 16 | (unsigned int)(d) << 24)
 
 typedef struct {
     char username[64];
     char password[64];
     char home_dir[MAX_PATH_LEN];
+    int rate_kb; // Límite de transferencia en KB/s (-1 = bandwidth_user_kb, 0 = sin límite)
+    int weight;  // Peso en el reparto del ancho de banda (1 = normal)
 } User;
 
+// Tabla de usuarios de solo lectura compartida por todas las sesiones.
+// Se construye completa y se publica con un intercambio atómico del puntero;
+// nunca se modifica después de publicada.
+typedef struct {
+    User* users;
+    int count;
+    int* buckets;     // Índice del primer usuario de cada cubeta (-1 = vacía)
+    int* next;        // Encadenamiento dentro de la cubeta
+    unsigned mask;    // Número de cubetas - 1 (potencia de 2)
+} UserTable;
+
 typedef struct {
+    int port;    // Puerto del canal de control
+    int workers; // Hilos del motor de eventos y sockets de escucha (0 = uno por núcleo)
+    int transfer_threads; // Máximo de hilos del pool de transferencias del motor de eventos
+    int max_connections; // Sesiones simultáneas (0 = sin límite); el resto recibe 421
+    int max_per_ip;      // Sesiones simultáneas por IP (0 = sin límite)
+    int zero_copy;          // RETR con sendfile() cuando la plataforma lo permite
+    int transfer_buffer_kb; // Buffer del camino de copia (sin sendfile) y de cada buffer de subida
+    int upload_pool_buffers; // Buffers de subida reutilizables compartidos por todas las sesiones
+    int file_cache_mb;       // Memoria para archivos pequeños servidos desde RAM (0 = sin caché)
+    int file_cache_max_kb;   // Tamaño máximo de un archivo cacheable
+    int checksum_cache_entries; // Checksums (CRC32C/SHA-256) recordados en memoria (0 = sólo sidecar)
+    int pasv_port_min;      // Rango del pool de puertos pasivos (0 = puerto efímero por transferencia)
+    int pasv_port_max;
+    char pasv_address[64];  // IP anunciada en PASV (vacía = la del canal de control)
+    int listing_cache_entries; // Directorios en la caché de listados (0 = sin caché)
+    int listing_cache_ttl;     // Segundos que un listado se considera vigente
+    int log_binary;            // Registro en formato binario compacto en vez de texto
+    int log_flush_ms;          // Máximo tiempo que un registro espera antes de llegar a disco
+    int metrics_interval;      // Segundos entre exportaciones de METRICS_FILE (0 = no exportar)
+    int bandwidth_global_kb;   // Límite total de las transferencias en KB/s (0 = sin límite)
+    int bandwidth_user_kb;     // Límite por usuario si users.txt no indica otro (0 = sin límite)
+    int bandwidth_burst_kb;    // Ráfaga que acumula una cubeta inactiva
+    int deflate_level;         // Nivel de compresión por defecto en MODE Z (1-9)
+    int dedup;                 // STOR completos como enlaces a un almacén por contenido (SHA-256)
+    char dedup_store[192];     // Carpeta del almacén (mismo sistema de archivos que los homes)
+    char deflate_skip_ext[192]; // Extensiones ya comprimidas: en MODE Z se envían sin recomprimir
+    int tree_index_max_entries; // Entradas por home en el índice de SITE FIND / LIST -R (0 = sin índice)
+} ServerConfig;
+
+typedef struct ClientSession {
     SOCKET ctrl_sock;
     SOCKET data_sock;
-    SOCKET pasv_sock;
-    char current_dir[MAX_PATH_LEN]; // Ruta estilo Unix (ej: /test)
+    SOCKET pasv_sock;  // Socket de escucha pasivo (propio o prestado del pool)
+    int pasv_slot;     // Índice en el pool de puertos pasivos (-1 = socket propio)
+    char current_dir[MAX_PATH_LEN]; // Ruta virtual estilo Unix relativa al home (ej: /docs)
+    char home_path[MAX_PATH_LEN];   // Ruta real absoluta del home del usuario
+#ifndef _WIN32
+    int root_fd; // Directorio home abierto: todas las rutas se resuelven desde aquí
+    int cwd_fd;  // Directorio actual abierto
+#endif
     char username[64];
     int logged_in;
+    long long rest_offset; // Desplazamiento pedido con REST para el próximo RETR/STOR
+    long long allo_size;   // Tamaño anunciado con ALLO para el próximo STOR (0 = desconocido)
+    int hash_sha256;       // Algoritmo de HASH elegido con OPTS HASH (1 = SHA-256, 0 = CRC32C)
+    int mode_z;            // MODE Z: canal de datos comprimido con deflate
+    int deflate_level;     // Nivel elegido con OPTS MODE Z LEVEL
     struct sockaddr_in client_addr;
-    FILE* log_file;
+    char client_ip[16];
+    int client_port;
+    // Lector del canal de control: bytes recibidos aún sin '\n'
+    char inbuf[CTRL_BUFFER_SIZE];
+    int inlen;
+    int discarding; // Descartando el resto de una línea demasiado larga
+    struct RateBucket* rate_bucket; // Límite del usuario (NULL = sin límite)
+    int rate_weight;
+    struct Pack* pack; // Home montado desde un paquete de solo lectura (NULL = directorio)
+    void* engine;      // Motor de eventos que atiende la sesión (NULL = hilo propio)
+    int in_transfer;   // Ejecutándose en el pool de transferencias
+    struct ClientSession* next_job; // Cola del pool de transferencias
 } ClientSession;
 
-// Funciones mejoradas
-void log_message(FILE* log, const char* ip, int port, const char* cmd, const char* status, long duration, long size) {
-    time_t now;
-    struct tm* timeinfo;
-    char timestamp[64];
-    
-    time(&now);
-    timeinfo = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-    
-    fprintf(log, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%ldms SIZE=%ld\n",
-            timestamp, ip, port, cmd, status, duration, size);
-    fflush(log);
-}
-
-int load_users(User users[], int max_users) {
-    FILE* f = fopen(USERS_FILE, "r");
-    if (!f) {
-        printf("Error: No se puede abrir %s\n", USERS_FILE);
+Listener listener; // Sockets de escucha y control de admisión (common/net_listener.h)
+
+ServerConfig config = {
+    .port = FTP_PORT,
+    .workers = 0,
+    .transfer_threads = 256,
+    .max_connections = 1024,
+    .max_per_ip = 32,
+    .zero_copy = 1,
+    .transfer_buffer_kb = 256,
+    .upload_pool_buffers = 64,
+    .file_cache_mb = 64,
+    .file_cache_max_kb = 1024,
+    .checksum_cache_entries = 4096,
+    .pasv_port_min = 50000,
+    .pasv_port_max = 50099,
+    .pasv_address = "",
+    .listing_cache_entries = 256,
+    .listing_cache_ttl = 10,
+    .log_binary = 0,
+    .log_flush_ms = 200,
+    .metrics_interval = 10,
+    .bandwidth_global_kb = 0,
+    .bandwidth_user_kb = 0,
+    .bandwidth_burst_kb = 1024,
+    .deflate_level = 6,
+    .dedup = 0,
+    .dedup_store = "ftp/.store",
+    .deflate_skip_ext = "gz,tgz,zip,bz2,xz,zst,7z,rar,jpg,jpeg,png,gif,webp,mp3,mp4,mkv,avi,pdf",
+    .tree_index_max_entries = 1000000,
+};
+
+// Lectura estilo RCU de la tabla de usuarios: los lectores sólo incrementan
+// el contador de la época vigente (y comprueban que sigue siéndolo); el
+// escritor cambia de época y espera a que la anterior quede en cero antes de
+// liberar la tabla vieja.
+_Atomic(UserTable*) user_table = NULL;
+atomic_int user_epoch = 0;
+atomic_int user_readers[2];
+CRITICAL_SECTION user_reload_cs;
+
+// --- Utilidades de plataforma ---
+
+int make_dir(const char* path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) ? 0 : -1;
+#else
+    return mkdir(path, 0755);
+#endif
+}
+
+// Convierte separadores de ruta al formato de la plataforma (ftp\user <-> ftp/user)
+void to_native_path(char* path) {
+    for (char* p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') *p = PATH_SEP;
+    }
+}
+
+void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// Renombra 'from' sobre 'to' reemplazándolo si existe
+int replace_file(const char* from, const char* to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+// Reloj monotónico de pared en microsegundos (clock() mide CPU, no tiempo real)
+long long now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (long long)(counter.QuadPart / freq.QuadPart) * 1000000LL +
+           (long long)(counter.QuadPart % freq.QuadPart) * 1000000LL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+// Hora de pared (desde 1970) en microsegundos
+long long wall_us(void) {
+#ifdef _WIN32
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    return (long long)(t.QuadPart - 116444736000000000ULL) / 10;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+// localtime/gmtime reentrantes (las versiones estándar comparten un buffer estático)
+void local_tm(time_t t, struct tm* out) {
+#ifdef _WIN32
+    localtime_s(out, &t);
+#else
+    localtime_r(&t, out);
+#endif
+}
+
+void utc_tm(time_t t, struct tm* out) {
+#ifdef _WIN32
+    gmtime_s(out, &t);
+#else
+    gmtime_r(&t, out);
+#endif
+}
+
+int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#ifdef _WIN32
+int spawn_thread(DWORD (WINAPI *fn)(LPVOID), LPVOID arg) {
+    HANDLE h = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    if (!h) return 0;
+    CloseHandle(h);
+    return 1;
+}
+#else
+typedef struct {
+    DWORD (*fn)(LPVOID);
+    LPVOID arg;
+} ThreadStart;
+
+static void* thread_trampoline(void* param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return NULL;
+}
+
+int spawn_thread(DWORD (*fn)(LPVOID), LPVOID arg) {
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    pthread_t tid;
+    if (!start) return 0;
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(&tid, NULL, thread_trampoline, start) != 0) {
+        free(start);
         return 0;
     }
-    
-    int count = 0;
-    char line[256];
-    while (fgets(line, sizeof(line), f) && count < max_users) {
-        // Formato: usuario:password:directorio_base (ej: ftp\test)
-        char* username = strtok(line, ":");
-        char* password = strtok(NULL, ":");
-        char* homedir = strtok(NULL, "\n\r");
-        
-        if (username && password) {
-            strncpy(users[count].username, username, sizeof(users[count].username) - 1);
-            strncpy(users[count].password, password, sizeof(users[count].password) - 1);
-            
-            if (homedir && strlen(homedir) > 0) {
-                strncpy(users[count].home_dir, homedir, sizeof(users[count].home_dir) - 1);
-            } else {
-                // Directorio por defecto
-                snprintf(users[count].home_dir, sizeof(users[count].home_dir), "ftp\\%s", username);
-            }
-            count++;
+    pthread_detach(tid);
+    return 1;
+}
+#endif
+
+int set_socket_blocking(SOCKET sock, int blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return -1;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(sock, F_SETFL, flags);
+#endif
+}
+
+// Espera hasta que el socket tenga datos (o una conexión) por leer. 1 = listo.
+int wait_readable(SOCKET sock, int timeout_ms) {
+#ifdef _WIN32
+    fd_set set;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    FD_ZERO(&set);
+    FD_SET(sock, &set);
+    return select(0, &set, NULL, NULL, &tv) > 0;
+#else
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    int n;
+    do {
+        n = poll(&pfd, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    return n > 0;
+#endif
+}
+
+// IP en texto sin inet_ntoa (que usa un buffer estático compartido entre hilos)
+void format_ip(const struct sockaddr_in* addr, char* out, size_t size) {
+    const unsigned char* b = (const unsigned char*)&addr->sin_addr;
+    snprintf(out, size, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+}
+
+// Envía todo el buffer aunque send() acepte menos bytes o el socket sea no bloqueante
+int send_all(SOCKET sock, const char* data, int len) {
+    int sent = 0;
+    while (sent < len) {
+        int n = send(sock, data + sent, len - sent, 0);
+        if (n > 0) {
+            sent += n;
+            continue;
         }
+#ifndef _WIN32
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { sock, POLLOUT, 0 };
+            if (poll(&pfd, 1, 30000) > 0) continue;
+        }
+#endif
+        return -1;
     }
-    
-    fclose(f);
-    printf("Usuarios cargados: %d\n", count);
-    return count;
+    return sent;
 }
 
-void send_response(SOCKET sock, const char* code, const char* message) {
-    char buffer[BUFFER_SIZE];
-    snprintf(buffer, sizeof(buffer), "%s %s\r\n", code, message);
-    send(sock, buffer, strlen(buffer), 0);
-    printf(">> %s", buffer);
+unsigned hash_string(const char* str) {
+    // FNV-1a
+    unsigned h = 2166136261u;
+    while (*str) {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
-void handle_user(ClientSession* session, const char* username, User users[], int user_count) {
-    strncpy(session->username, username, sizeof(session->username) - 1);
-    send_response(session->ctrl_sock, "331", "Username OK, need password.");
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "USER", "331", 0, 0);
-}
-
-void handle_pass(ClientSession* session, const char* password, User users[], int user_count) {
-    int authenticated = 0;
-    User* user = NULL;
-    
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, session->username) == 0 && 
-            strcmp(users[i].password, password) == 0) {
-            authenticated = 1;
-            user = &users[i];
-            break;
-        }
+// Buffer de texto que crece según se le añade contenido
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} TextBuffer;
+
+int text_append(TextBuffer* buf, const char* text, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + len) cap *= 2;
+        char* grown = (char*)realloc(buf->data, cap);
+        if (!grown) return -1;
+        buf->data = grown;
+        buf->cap = cap;
     }
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    
-    if (authenticated && user) {
-        session->logged_in = 1;
-        
-        // Guardar ruta base estilo Unix (ej: /test)
-        char unix_style_path[MAX_PATH_LEN];
-        snprintf(unix_style_path, sizeof(unix_style_path), "/%s", user->username);
-        strncpy(session->current_dir, unix_style_path, sizeof(session->current_dir) - 1);
-        
-        // Crear directorio si no existe
-        CreateDirectoryA(user->home_dir, NULL);
-        // Cambiar directorio de trabajo del HILO a la carpeta del usuario
-        if (_chdir(user->home_dir) != 0) {
-             send_response(session->ctrl_sock, "530", "Login failed. Cannot access home directory.");
-             log_message(session->log_file, client_ip, client_port, "PASS", "530", 0, 0);
-             session->logged_in = 0;
-             return;
-        }
-        
-        send_response(session->ctrl_sock, "230", "User logged in.");
-        log_message(session->log_file, client_ip, client_port, "PASS", "230", 0, 0);
-    } else {
-        send_response(session->ctrl_sock, "530", "Login incorrect.");
-        log_message(session->log_file, client_ip, client_port, "PASS", "530", 0, 0);
+    memcpy(buf->data + buf->len, text, len);
+    buf->len += len;
+    return 0;
+}
+
+// ==================== LOGGER ASÍNCRONO ====================
+// Los hilos de sesión no escriben en disco: cada uno deja registros de
+// tamaño fijo en su propio anillo (un productor, un consumidor, sin locks) y
+// un único hilo escritor los recoge, los formatea en lotes y los vuelca al
+// archivo por tamaño (LOG_BATCH_BYTES) o por tiempo (log_flush_ms).
+// La marca de tiempo se formatea una vez por segundo, no por registro.
+// Con log_binary=1 el lote son los LogRecord tal cual, precedidos por una
+// cabecera; ftp_logconv los convierte al formato de texto habitual.
+
+#define LOG_MAGIC "FTPLOG1" // Cabecera del log binario: 8 bytes + tamaño de registro
+
+// Registro binario: debe coincidir con el de ftp_logconv.c
+typedef struct {
+    long long time_us;     // Hora de pared en µs
+    long long duration_us;
+    long long size;
+    char ip[16];
+    unsigned short port;
+    unsigned char transfer; // 1 = incluye RATE (RETR/STOR/APPE)
+    unsigned char reserved;
+    char cmd[8];
+    char status[4];
+    long long wire_size;    // MODE Z: bytes comprimidos en el canal (0 = sin comprimir)
+    long long cpu_us;       // MODE Z: CPU del hilo durante la transferencia
+} LogRecord;
+
+typedef struct LogRing {
+    LogRecord records[LOG_RING_SIZE];
+    atomic_size_t head;     // Sólo lo avanza el hilo productor
+    atomic_size_t tail;     // Sólo lo avanza el escritor
+    atomic_int in_use;      // Anillo asignado a un hilo vivo
+    struct LogRing* next;
+} LogRing;
+
+LogRing* _Atomic log_rings = NULL; // Lista de anillos (sólo crece; se reutilizan)
+THREAD_LOCAL LogRing* thread_ring = NULL;
+atomic_llong log_dropped = 0;
+atomic_int logger_running = 0;
+atomic_int logger_stopped = 0;
+FILE* log_output = NULL;
+
+LogRing* logger_acquire_ring(void) {
+    for (LogRing* ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, 1)) return ring;
+    }
+
+    LogRing* ring = (LogRing*)calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+    atomic_init(&ring->in_use, 1);
+    ring->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
     }
+    return ring;
 }
 
-void handle_pwd(ClientSession* session) {
-    if (!session->logged_in) {
-        send_response(session->ctrl_sock, "530", "Not logged in.");
-        return;
+// Devuelve el anillo del hilo actual para que lo use otro hilo (modo un hilo por cliente)
+void logger_release_ring(void) {
+    if (thread_ring) {
+        atomic_store(&thread_ring->in_use, 0);
+        thread_ring = NULL;
     }
-    
-    char buffer[BUFFER_SIZE];
-    // La ruta ya está guardada en formato Unix
-    snprintf(buffer, sizeof(buffer), "\"%s\" is current directory.", session->current_dir);
-    send_response(session->ctrl_sock, "257", buffer);
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "PWD", "257", 0, 0);
 }
 
-void handle_cwd(ClientSession* session, const char* path) {
-    if (!session->logged_in) {
-        send_response(session->ctrl_sock, "530", "Not logged in.");
+void log_record(const char* ip, int port, const char* cmd, const char* status,
+                long long duration_us, long long size, int transfer, long long wire_size, long long cpu_us) {
+    if (!thread_ring && !(thread_ring = logger_acquire_ring())) return;
+
+    LogRing* ring = thread_ring;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add(&log_dropped, 1); // Anillo lleno: no se bloquea la sesión
         return;
     }
 
-    // El servidor maneja el CWD real usando _chdir.
-    // Esta función es compleja de implementar de forma segura (para evitar salir del home_dir).
-    // Por ahora, solo implementamos ".." para subir un nivel (si no es la raíz)
-    
-    if (strcmp(path, "..") == 0) {
-        // Obtener el directorio de trabajo actual del HILO
-        char temp_path[MAX_PATH_LEN];
-        _getcwd(temp_path, sizeof(temp_path));
-        
-        // (Simplificación) - No permitimos subir más allá del home_dir
-        // Una implementación real necesitaría comparar contra la ruta base.
-        // Por ahora, si _chdir("..") funciona, actualizamos la ruta interna.
-        if (_chdir("..") == 0) {
-            // Actualizar la ruta interna (session->current_dir)
-            char* last_slash = strrchr(session->current_dir, '/');
-            if (last_slash != NULL && last_slash != session->current_dir) { // No es la raíz
-                *last_slash = '\0';
-            } else if (last_slash == session->current_dir) { // Es la raíz
-                session->current_dir[1] = '\0'; // Queda solo "/"
-            }
-            send_response(session->ctrl_sock, "250", "Directory changed.");
-        } else {
-            send_response(session->ctrl_sock, "550", "Cannot change directory (permission denied).");
+    LogRecord* rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->time_us = wall_us();
+    rec->duration_us = duration_us;
+    rec->size = size;
+    strncpy(rec->ip, ip, sizeof(rec->ip) - 1);
+    rec->ip[sizeof(rec->ip) - 1] = '\0';
+    rec->port = (unsigned short)port;
+    rec->transfer = (unsigned char)transfer;
+    rec->wire_size = wire_size;
+    rec->cpu_us = cpu_us;
+    strncpy(rec->cmd, cmd, sizeof(rec->cmd) - 1);
+    rec->cmd[sizeof(rec->cmd) - 1] = '\0';
+    strncpy(rec->status, status, sizeof(rec->status) - 1);
+    rec->status[sizeof(rec->status) - 1] = '\0';
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void log_message(const char* ip, int port, const char* cmd, const char* status, long duration, long size) {
+    log_record(ip, port, cmd, status, duration * 1000LL, size, 0, 0, 0);
+}
+
+// Igual que log_message pero con duración en µs y la tasa real de transferencia
+void log_transfer(const char* ip, int port, const char* cmd, const char* status,
+                  long long duration_us, long long size) {
+    log_record(ip, port, cmd, status, duration_us, size, 1, 0, 0);
+}
+
+// Transferencia en MODE Z: agrega los bytes en el canal y el costo de CPU
+void log_compressed(const char* ip, int port, const char* cmd, const char* status,
+                    long long duration_us, long long size, long long wire_size, long long cpu_us) {
+    log_record(ip, port, cmd, status, duration_us, size, 1, wire_size > 0 ? wire_size : 1, cpu_us);
+}
+
+// Formatea un registro en la línea de texto de siempre; 'ts' se recalcula sólo al cambiar el segundo
+int format_log_record(const LogRecord* rec, char* out, size_t size, time_t* ts_sec, char* ts) {
+    time_t sec = (time_t)(rec->time_us / 1000000LL);
+    if (sec != *ts_sec) {
+        struct tm tm;
+        local_tm(sec, &tm);
+        strftime(ts, 32, "%Y-%m-%d %H:%M:%S", &tm);
+        *ts_sec = sec;
+    }
+
+    if (rec->wire_size > 0) {
+        double seconds = rec->duration_us > 0 ? rec->duration_us / 1000000.0 : 0.000001;
+        return snprintf(out, size, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%lldms SIZE=%lld RATE=%.2fMB/s "
+                        "MODE=Z WIRE=%lld RATIO=%.2f CPU=%.1fms\n",
+                        ts, rec->ip, rec->port, rec->cmd, rec->status, rec->duration_us / 1000, rec->size,
+                        rec->size / seconds / (1024.0 * 1024.0), rec->wire_size,
+                        (double)rec->size / rec->wire_size, rec->cpu_us / 1000.0);
+    }
+    if (rec->transfer) {
+        double seconds = rec->duration_us > 0 ? rec->duration_us / 1000000.0 : 0.000001;
+        return snprintf(out, size, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%lldms SIZE=%lld RATE=%.2fMB/s\n",
+                        ts, rec->ip, rec->port, rec->cmd, rec->status, rec->duration_us / 1000, rec->size,
+                        rec->size / seconds / (1024.0 * 1024.0));
+    }
+    return snprintf(out, size, "[%s] IP=%s:%d CMD=%s STATUS=%s DURATION=%lldms SIZE=%lld\n",
+                    ts, rec->ip, rec->port, rec->cmd, rec->status, rec->duration_us / 1000, rec->size);
+}
+
+DWORD WINAPI logger_thread(LPVOID param) {
+    (void)param;
+    char* batch = (char*)malloc(LOG_BATCH_BYTES + 512);
+    size_t batch_len = 0;
+    time_t ts_sec = (time_t)-1;
+    char ts[32] = "";
+    long long last_flush = now_us();
+    long long reported_drops = 0;
+    int dirty = 0;
+
+    if (!batch) {
+        atomic_store(&logger_stopped, 1);
+        return 1;
+    }
+
+    while (1) {
+        int running = atomic_load(&logger_running);
+        int drained = 0;
+
+        for (LogRing* ring = atomic_load(&log_rings); ring; ring = ring->next) {
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            for (; tail != head; tail++, drained++) {
+                const LogRecord* rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+                if (config.log_binary) {
+                    memcpy(batch + batch_len, rec, sizeof(LogRecord));
+                    batch_len += sizeof(LogRecord);
+                } else {
+                    batch_len += format_log_record(rec, batch + batch_len, 512, &ts_sec, ts);
+                }
+                if (batch_len >= LOG_BATCH_BYTES) {
+                    fwrite(batch, 1, batch_len, log_output);
+                    batch_len = 0;
+                    dirty = 1;
+                }
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        if (batch_len > 0) {
+            fwrite(batch, 1, batch_len, log_output);
+            batch_len = 0;
+            dirty = 1;
+        }
+
+        long long now = now_us();
+        if (dirty && (!running || now - last_flush >= config.log_flush_ms * 1000LL)) {
+            fflush(log_output);
+            last_flush = now;
+            dirty = 0;
+        }
+
+        long long drops = atomic_load(&log_dropped);
+        if (drops != reported_drops) {
+            printf("Logger: %lld registros descartados (anillos llenos)\n", drops - reported_drops);
+            reported_drops = drops;
+        }
+
+        if (!running && drained == 0) break;
+        if (drained == 0) sleep_ms(1);
+    }
+
+    free(batch);
+    atomic_store(&logger_stopped, 1);
+    return 0;
+}
+
+// 1 si el log binario existente usa el tamaño de registro actual
+static int log_header_matches(void) {
+    FILE* f = fopen(LOG_BINARY_FILE, "rb");
+    char magic[8];
+    unsigned int record_size = 0;
+    int ok = f && fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, LOG_MAGIC, 8) == 0 &&
+             fread(&record_size, sizeof(record_size), 1, f) == 1 && record_size == sizeof(LogRecord);
+    if (f) fclose(f);
+    return ok;
+}
+
+int logger_start(void) {
+    if (config.log_binary) {
+        log_output = fopen(LOG_BINARY_FILE, "ab");
+        if (log_output && ftell(log_output) > 0 && !log_header_matches()) {
+            // Registro de otra versión: se aparta para no mezclar formatos
+            fclose(log_output);
+            replace_file(LOG_BINARY_FILE, LOG_BINARY_FILE ".old");
+            log_output = fopen(LOG_BINARY_FILE, "ab");
+        }
+        if (log_output && ftell(log_output) == 0) {
+            unsigned int record_size = sizeof(LogRecord);
+            fwrite(LOG_MAGIC, 1, 8, log_output);
+            fwrite(&record_size, sizeof(record_size), 1, log_output);
         }
-    } else if (path[0] == '/') {
-        // Rutas absolutas (no seguras) - las rechazamos por ahora
-         send_response(session->ctrl_sock, "550", "Absolute paths not supported.");
     } else {
-        // Ruta relativa
-        if (_chdir(path) == 0) {
-            // Actualizar ruta interna
-            if (strcmp(session->current_dir, "/") == 0) {
-                snprintf(session->current_dir + 1, sizeof(session->current_dir) - 1, "%s", path);
-            } else {
-                strncat(session->current_dir, "/", sizeof(session->current_dir) - strlen(session->current_dir) - 1);
-                strncat(session->current_dir, path, sizeof(session->current_dir) - strlen(session->current_dir) - 1);
+        log_output = fopen(LOG_FILE, "a");
+    }
+    if (!log_output) return 0;
+
+    atomic_store(&logger_running, 1);
+    if (!spawn_thread(logger_thread, NULL)) {
+        atomic_store(&logger_running, 0);
+        return 0;
+    }
+    return 1;
+}
+
+// Vacía los anillos pendientes y cierra el archivo de log
+void logger_stop(void) {
+    if (!atomic_exchange(&logger_running, 0)) return;
+    while (!atomic_load(&logger_stopped)) sleep_ms(1);
+    fclose(log_output);
+    log_output = NULL;
+}
+
+// ==================== CACHÉ DE ARCHIVOS (RETR) ====================
+// Los archivos pequeños que se descargan a menudo se sirven desde memoria.
+// La caché está repartida en FILE_CACHE_SHARDS particiones, cada una con su
+// lock, su tabla hash y su lista LRU, para que sesiones que piden archivos
+// distintos no compitan por el mismo lock. Una entrada se identifica por la
+// ruta real y sólo vale si la fecha (ns) y el tamaño actuales coinciden.
+// Las entradas tienen contador de referencias: una expulsada mientras se
+// está enviando se libera al terminar el envío.
+
+typedef struct CachedFile {
+    char path[MAX_PATH_LEN * 2];
+    unsigned hash;
+    long long mtime_ns;
+    long long size;
+    char* data;
+    atomic_int refs;
+    struct CachedFile* hash_next;
+    struct CachedFile* lru_prev; // Hacia la más reciente
+    struct CachedFile* lru_next; // Hacia la más antigua
+} CachedFile;
+
+typedef struct {
+    CRITICAL_SECTION lock;
+    CachedFile* buckets[256];
+    CachedFile* lru_head; // Más reciente
+    CachedFile* lru_tail; // Candidata a expulsión
+    long long bytes;
+    long long capacity;
+    long long entries;
+    long long hits;
+    long long misses;
+    long long evictions;
+} FileCacheShard;
+
+FileCacheShard* file_cache = NULL;
+
+void file_cache_init(void) {
+    if (config.file_cache_mb <= 0 || config.file_cache_max_kb <= 0) return;
+    file_cache = (FileCacheShard*)calloc(FILE_CACHE_SHARDS, sizeof(FileCacheShard));
+    if (!file_cache) return;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        InitializeCriticalSection(&file_cache[i].lock);
+        file_cache[i].capacity = (long long)config.file_cache_mb * 1024 * 1024 / FILE_CACHE_SHARDS;
+    }
+}
+
+int file_cache_accepts(long long size) {
+    return file_cache && size <= (long long)config.file_cache_max_kb * 1024 &&
+           size <= file_cache[0].capacity;
+}
+
+void file_cache_release(CachedFile* entry) {
+    if (entry && atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// Saca la entrada de la tabla y de la LRU (con el lock de la partición tomado)
+static void file_cache_unlink(FileCacheShard* shard, CachedFile* entry) {
+    CachedFile** link = &shard->buckets[entry->hash % 256];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+
+    shard->bytes -= entry->size;
+    shard->entries--;
+}
+
+static void file_cache_push_front(FileCacheShard* shard, CachedFile* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+// Busca una copia vigente; devuelve la entrada con una referencia para quien llama
+CachedFile* file_cache_lookup(const char* path, long long mtime_ns, long long size) {
+    unsigned hash = hash_string(path);
+    FileCacheShard* shard = &file_cache[hash % FILE_CACHE_SHARDS];
+    CachedFile* found = NULL;
+
+    EnterCriticalSection(&shard->lock);
+    for (CachedFile* entry = shard->buckets[hash % 256]; entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            if (entry->mtime_ns == mtime_ns && entry->size == size) {
+                found = entry;
+                // Pasa al frente de la LRU
+                if (shard->lru_head != entry) {
+                    file_cache_unlink(shard, entry);
+                    entry->hash_next = shard->buckets[hash % 256];
+                    shard->buckets[hash % 256] = entry;
+                    file_cache_push_front(shard, entry);
+                    shard->bytes += entry->size;
+                    shard->entries++;
+                }
+                atomic_fetch_add(&entry->refs, 1);
             }
-            send_response(session->ctrl_sock, "250", "Directory changed.");
-        } else {
-            send_response(session->ctrl_sock, "550", "Directory not found or access denied.");
+            break;
+        }
+    }
+    if (found) shard->hits++;
+    else shard->misses++;
+    LeaveCriticalSection(&shard->lock);
+    return found;
+}
+
+// Guarda 'data' (pasa a ser de la caché) y devuelve la entrada con una referencia
+CachedFile* file_cache_insert(const char* path, long long mtime_ns, char* data, long long size) {
+    CachedFile* entry = (CachedFile*)calloc(1, sizeof(CachedFile));
+    if (!entry) {
+        free(data);
+        return NULL;
+    }
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->hash = hash_string(path);
+    entry->mtime_ns = mtime_ns;
+    entry->size = size;
+    entry->data = data;
+    atomic_init(&entry->refs, 2); // La caché y quien llama
+
+    FileCacheShard* shard = &file_cache[entry->hash % FILE_CACHE_SHARDS];
+    CachedFile* evicted = NULL;
+
+    EnterCriticalSection(&shard->lock);
+    // Versión anterior del mismo archivo
+    for (CachedFile* old = shard->buckets[entry->hash % 256]; old; old = old->hash_next) {
+        if (old->hash == entry->hash && strcmp(old->path, path) == 0) {
+            file_cache_unlink(shard, old);
+            old->hash_next = evicted;
+            evicted = old;
+            break;
         }
     }
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "CWD", "250", 0, 0);
+    while (shard->lru_tail && shard->bytes + size > shard->capacity) {
+        CachedFile* victim = shard->lru_tail;
+        file_cache_unlink(shard, victim);
+        victim->hash_next = evicted;
+        evicted = victim;
+        shard->evictions++;
+    }
+    entry->hash_next = shard->buckets[entry->hash % 256];
+    shard->buckets[entry->hash % 256] = entry;
+    file_cache_push_front(shard, entry);
+    shard->bytes += size;
+    shard->entries++;
+    LeaveCriticalSection(&shard->lock);
+
+    while (evicted) {
+        CachedFile* next = evicted->hash_next;
+        file_cache_release(evicted);
+        evicted = next;
+    }
+    return entry;
+}
+
+typedef struct {
+    long long bytes;
+    long long entries;
+    long long hits;
+    long long misses;
+    long long evictions;
+} FileCacheStats;
+
+void file_cache_stats(FileCacheStats* out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; file_cache && i < FILE_CACHE_SHARDS; i++) {
+        EnterCriticalSection(&file_cache[i].lock);
+        out->bytes += file_cache[i].bytes;
+        out->entries += file_cache[i].entries;
+        out->hits += file_cache[i].hits;
+        out->misses += file_cache[i].misses;
+        out->evictions += file_cache[i].evictions;
+        LeaveCriticalSection(&file_cache[i].lock);
+    }
+}
+
+// ==================== CHECKSUMS (CRC32C / SHA-256) ====================
+// CRC32C usa la instrucción crc32 de SSE4.2 cuando la CPU la tiene (8 bytes
+// por instrucción) y una tabla en software en caso contrario. Ambos
+// algoritmos son incrementales para poder calcularse mientras llega un STOR.
+
+typedef struct {
+    unsigned int state[8];
+    unsigned long long length;
+    unsigned char block[64];
+    unsigned int used;
+} Sha256;
+
+typedef struct {
+    unsigned int crc;     // CRC32C sin la inversión final
+    Sha256 sha;
+} ChecksumState;
+
+typedef struct {
+    unsigned int crc32c;
+    unsigned char sha256[32];
+} FileChecksums;
+
+unsigned int crc32c_table[256];
+int crc32c_hardware = 0;
+
+void checksums_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+        crc32c_table[i] = c;
+    }
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char* data, size_t len) {
+#ifdef __x86_64__
+    unsigned long long c = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (unsigned int)c;
+#endif
+    for (; len > 0; data++, len--) crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#endif
+
+unsigned int crc32c_update(unsigned int crc, const unsigned char* data, size_t len) {
+#ifdef HAVE_SSE42_CRC
+    if (crc32c_hardware) return crc32c_sse42(crc, data, len);
+#endif
+    while (len--) crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256* ctx, const unsigned char* block) {
+    unsigned int w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (unsigned int)block[i * 4] << 24 | (unsigned int)block[i * 4 + 1] << 16 |
+               (unsigned int)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        unsigned int s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    unsigned int a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    unsigned int e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        unsigned int t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                          sha256_k[i] + w[i];
+        unsigned int t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(Sha256* ctx) {
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(Sha256* ctx, const unsigned char* data, size_t len) {
+    ctx->length += len;
+    if (ctx->used > 0) {
+        size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += (unsigned int)take;
+        data += take;
+        len -= take;
+        if (ctx->used < 64) return;
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) sha256_block(ctx, data);
+    memcpy(ctx->block, data, len);
+    ctx->used = (unsigned int)len;
+}
+
+void sha256_final(Sha256* ctx, unsigned char out[32]) {
+    unsigned long long bits = ctx->length * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (ctx->used < 56 ? 56 : 120) - ctx->used;
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(ctx, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+void checksum_begin(ChecksumState* state) {
+    state->crc = 0xFFFFFFFFu;
+    sha256_init(&state->sha);
+}
+
+void checksum_update(ChecksumState* state, const void* data, size_t len) {
+    state->crc = crc32c_update(state->crc, (const unsigned char*)data, len);
+    sha256_update(&state->sha, (const unsigned char*)data, len);
+}
+
+void checksum_end(ChecksumState* state, FileChecksums* out) {
+    out->crc32c = state->crc ^ 0xFFFFFFFFu;
+    sha256_final(&state->sha, out->sha256);
+}
+
+void sha256_hex(const unsigned char sha[32], char out[65]) {
+    for (int i = 0; i < 32; i++) sprintf(out + i * 2, "%02x", sha[i]);
+}
+
+// Caché de checksums: mapeo directo por ruta real, válida mientras fecha y
+// tamaño del archivo no cambien (igual que el sidecar .sum en disco)
+typedef struct {
+    char path[MAX_PATH_LEN * 2];
+    long long mtime_ns;
+    long long size;
+    FileChecksums sums;
+} ChecksumEntry;
+
+ChecksumEntry* checksum_cache = NULL;
+CRITICAL_SECTION checksum_cs;
+
+void checksum_cache_init(void) {
+    InitializeCriticalSection(&checksum_cs);
+    if (config.checksum_cache_entries > 0) {
+        checksum_cache = (ChecksumEntry*)calloc(config.checksum_cache_entries, sizeof(ChecksumEntry));
+    }
+}
+
+int checksum_cache_get(const char* path, long long mtime_ns, long long size, FileChecksums* out) {
+    if (!checksum_cache) return 0;
+    ChecksumEntry* slot = &checksum_cache[hash_string(path) % (unsigned)config.checksum_cache_entries];
+    int found = 0;
+    EnterCriticalSection(&checksum_cs);
+    if (strcmp(slot->path, path) == 0 && slot->mtime_ns == mtime_ns && slot->size == size) {
+        *out = slot->sums;
+        found = 1;
+    }
+    LeaveCriticalSection(&checksum_cs);
+    return found;
+}
+
+void checksum_cache_put(const char* path, long long mtime_ns, long long size, const FileChecksums* sums) {
+    if (!checksum_cache) return;
+    ChecksumEntry* slot = &checksum_cache[hash_string(path) % (unsigned)config.checksum_cache_entries];
+    EnterCriticalSection(&checksum_cs);
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->mtime_ns = mtime_ns;
+    slot->size = size;
+    slot->sums = *sums;
+    LeaveCriticalSection(&checksum_cs);
+}
+
+// ==================== ANCHO DE BANDA ====================
+// Cubetas de tokens (1 token = 1 byte) global y por usuario, sin locks en
+// el camino de envío: cada transferencia reserva bloques de bytes con un
+// fetch_sub sobre la cubeta y los va gastando desde su propia caché local.
+// Si la cubeta queda en negativo la reserva es deuda: la transferencia
+// duerme lo que tarda la cubeta en generar esos bytes, así las que esperan
+// avanzan en orden de llegada. El tamaño del bloque es RATE_QUANTUM * peso
+// del usuario, por lo que con la cubeta saturada cada transferencia recibe
+// un ancho de banda proporcional a su peso. Una cubeta inactiva acumula
+// hasta 'burst' bytes que se pueden enviar de golpe.
+// La espera bloquea al hilo que transfiere: con el motor epoll ese es un
+// hilo del pool de transferencias, nunca uno de los que atienden eventos.
+
+typedef struct RateBucket {
+    atomic_llong tokens;   // Bytes disponibles (negativo = deuda ya reservada)
+    atomic_llong stamp_us; // Última recarga
+    atomic_llong rate;     // Bytes por segundo (0 = sin límite)
+    atomic_llong burst;    // Máximo acumulable
+} RateBucket;
+
+typedef struct {
+    char username[64];
+    RateBucket bucket;
+} UserRate;
+
+// Límite aplicado a una transferencia; vive en la pila del hilo que la hace
+typedef struct {
+    RateBucket* buckets[2]; // Global y del usuario (NULL = sin límite)
+    long long quantum;      // Bytes reservados de una vez
+    long long cached;       // Bytes reservados aún sin gastar
+} RateLimiter;
+
+RateBucket global_rate;
+UserRate* user_rates = NULL; // Tabla abierta de RATE_USER_SLOTS cubetas (nunca se liberan)
+CRITICAL_SECTION user_rates_cs;
+atomic_llong rate_throttled_us = 0; // Tiempo total que las transferencias esperaron tokens
+atomic_llong rate_throttled_total = 0;
+
+void rate_bucket_set(RateBucket* bucket, long long rate, long long burst) {
+    if (burst < RATE_QUANTUM) burst = RATE_QUANTUM;
+    atomic_store(&bucket->burst, burst);
+    if (atomic_exchange(&bucket->rate, rate) == 0 && rate > 0) {
+        // Pasa a tener límite: arranca con la ráfaga completa
+        atomic_store(&bucket->stamp_us, now_us());
+        atomic_store(&bucket->tokens, burst);
+    }
+}
+
+// Suma los tokens generados desde la última recarga; sólo el hilo que gana
+// el CAS sobre la marca de tiempo los suma
+static void rate_refill(RateBucket* bucket, long long rate, long long now) {
+    long long stamp = atomic_load(&bucket->stamp_us);
+    long long elapsed = now - stamp;
+    if (elapsed < 1000 || !atomic_compare_exchange_strong(&bucket->stamp_us, &stamp, now)) return;
+    if (elapsed > 10000000) elapsed = 10000000; // Evita desbordes tras mucho tiempo inactiva
+
+    long long add = elapsed * rate / 1000000;
+    long long burst = atomic_load(&bucket->burst);
+    long long tokens = atomic_load(&bucket->tokens);
+    long long next;
+    do {
+        next = tokens + add < burst ? tokens + add : burst;
+    } while (next > tokens && !atomic_compare_exchange_weak(&bucket->tokens, &tokens, next));
+}
+
+// Reserva 'bytes' y devuelve los µs que faltan para que estén generados
+static long long rate_reserve(RateBucket* bucket, long long bytes, long long now) {
+    long long rate = atomic_load(&bucket->rate);
+    if (rate <= 0) return 0;
+    rate_refill(bucket, rate, now);
+    long long left = atomic_fetch_sub(&bucket->tokens, bytes) - bytes;
+    return left >= 0 ? 0 : -left * 1000000 / rate;
+}
+
+void rate_init(void) {
+    InitializeCriticalSection(&user_rates_cs);
+    user_rates = (UserRate*)calloc(RATE_USER_SLOTS, sizeof(UserRate));
+    rate_bucket_set(&global_rate, (long long)config.bandwidth_global_kb * 1024,
+                    (long long)config.bandwidth_burst_kb * 1024);
+}
+
+// Cubeta compartida por todas las sesiones del usuario (NULL = sin límite).
+// Sólo se llama al iniciar sesión; el camino de envío no toma el lock.
+RateBucket* user_rate_bucket(const char* username, int rate_kb) {
+    if (rate_kb < 0) rate_kb = config.bandwidth_user_kb;
+    if (!user_rates) return NULL;
+
+    RateBucket* bucket = NULL;
+    EnterCriticalSection(&user_rates_cs);
+    unsigned start = hash_string(username) & (RATE_USER_SLOTS - 1);
+    for (unsigned i = 0; i < RATE_USER_SLOTS; i++) {
+        UserRate* slot = &user_rates[(start + i) & (RATE_USER_SLOTS - 1)];
+        if (slot->username[0] == '\0') {
+            if (rate_kb == 0) break; // Sin límite: no hace falta ocupar una entrada
+            strncpy(slot->username, username, sizeof(slot->username) - 1);
+        } else if (strcmp(slot->username, username) != 0) {
+            continue;
+        }
+        // Un cambio en users.txt se aplica al próximo login del usuario
+        rate_bucket_set(&slot->bucket, (long long)rate_kb * 1024, (long long)config.bandwidth_burst_kb * 1024);
+        if (rate_kb > 0) bucket = &slot->bucket;
+        break;
+    }
+    LeaveCriticalSection(&user_rates_cs);
+    return bucket;
+}
+
+// Prepara el límite de una transferencia de la sesión. Devuelve 1 si hay alguno.
+int rate_begin(RateLimiter* limiter, ClientSession* session) {
+    limiter->buckets[0] = atomic_load(&global_rate.rate) > 0 ? &global_rate : NULL;
+    limiter->buckets[1] = session->rate_bucket;
+    limiter->quantum = (long long)RATE_QUANTUM * (session->rate_weight > 0 ? session->rate_weight : 1);
+    limiter->cached = 0;
+    return limiter->buckets[0] || limiter->buckets[1];
+}
+
+// Bytes a mover por iteración: con límite, bloques del tamaño del cuanto
+long long rate_chunk(RateLimiter* limiter, long long wanted) {
+    if (!limiter || (!limiter->buckets[0] && !limiter->buckets[1])) return wanted;
+    return wanted < limiter->quantum ? wanted : limiter->quantum;
+}
+
+// Descuenta 'bytes' ya enviados/recibidos; duerme si el ritmo supera el límite
+void rate_consume(RateLimiter* limiter, long long bytes) {
+    if (!limiter || (!limiter->buckets[0] && !limiter->buckets[1])) return;
+
+    limiter->cached -= bytes;
+    while (limiter->cached < 0) {
+        long long now = now_us();
+        long long wait = 0;
+        for (int i = 0; i < 2; i++) {
+            if (!limiter->buckets[i]) continue;
+            long long w = rate_reserve(limiter->buckets[i], limiter->quantum, now);
+            if (w > wait) wait = w;
+        }
+        limiter->cached += limiter->quantum;
+        // Esperas menores a 1 ms se acumulan como deuda hasta la próxima reserva
+        if (wait >= 1000) {
+            atomic_fetch_add(&rate_throttled_us, wait);
+            atomic_fetch_add(&rate_throttled_total, 1);
+            sleep_ms((int)((wait + 999) / 1000));
+        }
+    }
+}
+
+// Devuelve a las cubetas lo reservado y no usado
+void rate_end(RateLimiter* limiter) {
+    if (limiter->cached <= 0) return;
+    for (int i = 0; i < 2; i++) {
+        if (limiter->buckets[i]) atomic_fetch_add(&limiter->buckets[i]->tokens, limiter->cached);
+    }
+    limiter->cached = 0;
+}
+
+// ==================== MÉTRICAS ====================
+// Cada hilo acumula en su propio bloque de contadores (sin locks ni
+// instrucciones atómicas read-modify-write: sólo el dueño escribe, con
+// stores relajados) y STAT / SITE METRICS / METRICS_FILE suman todos los
+// bloques al leer. Las latencias se guardan en histogramas log-lineales
+// estilo HDR: cubetas exactas hasta 8 µs y luego 8 sub-cubetas por potencia
+// de 2, lo que da percentiles con ~12% de error en cualquier escala.
+
+// Verbos con histograma propio; el resto cuenta como "OTHER"
+static const unsigned int metric_verbs[] = {
+    VERB('U', 'S', 'E', 'R'), VERB('P', 'A', 'S', 'S'), VERB('P', 'W', 'D', 0),
+    VERB('C', 'W', 'D', 0), VERB('P', 'A', 'S', 'V'), VERB('E', 'P', 'S', 'V'),
+    VERB('L', 'I', 'S', 'T'), VERB('M', 'L', 'S', 'D'), VERB('R', 'E', 'T', 'R'),
+    VERB('S', 'T', 'O', 'R'), VERB('A', 'P', 'P', 'E'), VERB('D', 'E', 'L', 'E'),
+    VERB('R', 'E', 'S', 'T'), VERB('S', 'I', 'Z', 'E'), VERB('S', 'I', 'T', 'E'),
+    VERB('S', 'T', 'A', 'T'), VERB('N', 'O', 'O', 'P'), VERB('Q', 'U', 'I', 'T'),
+    VERB('M', 'D', 'T', 'M'), VERB('H', 'A', 'S', 'H'), VERB('X', 'C', 'R', 'C'),
+};
+#define METRIC_VERBS ((int)(sizeof(metric_verbs) / sizeof(metric_verbs[0])))
+
+typedef struct MetricsShard {
+    atomic_llong hist[METRIC_VERBS + 1][HIST_BUCKETS]; // Última fila: OTHER
+    atomic_llong bytes_sent;
+    atomic_llong bytes_received;
+    atomic_llong transfers;
+    atomic_llong transfer_us;
+    atomic_int in_use;
+    struct MetricsShard* next;
+} MetricsShard;
+
+MetricsShard* _Atomic metrics_shards = NULL;
+THREAD_LOCAL MetricsShard* thread_metrics = NULL;
+atomic_int active_sessions = 0;
+atomic_int active_transfers = 0;
+atomic_llong dedup_hits = 0;        // STOR resueltos con un blob ya existente
+atomic_llong dedup_saved_bytes = 0; // Bytes que esos STOR no ocuparon en disco
+atomic_int pack_mapped = 0;          // Paquetes de solo lectura mapeados en memoria
+atomic_llong pack_mapped_bytes = 0;
+atomic_llong tree_index_entries = 0; // Entradas en los índices recursivos de todos los homes
+atomic_llong tree_index_builds = 0;
+time_t metrics_started;
+
+// Suma sobre un contador del propio hilo: load + store, sin bus lock
+#define SHARD_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+
+MetricsShard* metrics_shard(void) {
+    if (thread_metrics) return thread_metrics;
+
+    for (MetricsShard* shard = atomic_load(&metrics_shards); shard; shard = shard->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&shard->in_use, &expected, 1)) return thread_metrics = shard;
+    }
+
+    MetricsShard* shard = (MetricsShard*)calloc(1, sizeof(MetricsShard));
+    if (!shard) return NULL;
+    atomic_init(&shard->in_use, 1);
+    shard->next = atomic_load(&metrics_shards);
+    while (!atomic_compare_exchange_weak(&metrics_shards, &shard->next, shard)) {
+    }
+    return thread_metrics = shard;
+}
+
+// Devuelve el bloque del hilo actual para que lo use otro hilo (sus cuentas se conservan)
+void metrics_release_shard(void) {
+    if (thread_metrics) {
+        atomic_store(&thread_metrics->in_use, 0);
+        thread_metrics = NULL;
+    }
+}
+
+int hist_bucket(long long value) {
+    if (value < (1 << HIST_SUB_BITS)) return value < 0 ? 0 : (int)value;
+
+    int exp = HIST_SUB_BITS;
+    while ((value >> (exp + 1)) != 0) exp++;
+    int sub = (int)((value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    int bucket = ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Mayor valor (µs) que cae en la cubeta
+long long hist_bucket_max(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) return bucket;
+    int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    long long sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    long long low = ((1LL << HIST_SUB_BITS) + sub) << (exp - HIST_SUB_BITS);
+    return low + (1LL << (exp - HIST_SUB_BITS)) - 1;
+}
+
+void metrics_command(unsigned int verb, long long latency_us) {
+    MetricsShard* shard = metrics_shard();
+    if (!shard) return;
+
+    int index = METRIC_VERBS;
+    for (int i = 0; i < METRIC_VERBS; i++) {
+        if (metric_verbs[i] == verb) {
+            index = i;
+            break;
+        }
+    }
+    SHARD_ADD(shard->hist[index][hist_bucket(latency_us)], 1);
+}
+
+void metrics_transfer_begin(void) {
+    atomic_fetch_add(&active_transfers, 1);
+}
+
+void metrics_transfer_end(long long sent, long long received, long long duration_us) {
+    atomic_fetch_sub(&active_transfers, 1);
+    MetricsShard* shard = metrics_shard();
+    if (!shard) return;
+    SHARD_ADD(shard->bytes_sent, sent > 0 ? sent : 0);
+    SHARD_ADD(shard->bytes_received, received > 0 ? received : 0);
+    SHARD_ADD(shard->transfers, 1);
+    SHARD_ADD(shard->transfer_us, duration_us);
+}
+
+void verb_name(unsigned int verb, char* out) {
+    for (int i = 0; i < 4; i++) out[i] = (char)((verb >> (8 * i)) & 0xFF);
+    out[4] = '\0';
+}
+
+// Formato "nombre valor" por línea; 'prefix' y 'eol' permiten usarlo tanto en
+// el archivo exportado como en una respuesta multilínea del canal de control
+void render_metrics(TextBuffer* out, const char* prefix, const char* eol) {
+    static long long hist[HIST_BUCKETS];
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    static const char* quantile_names[] = { "p50", "p99", "p999" };
+    long long sent = 0, received = 0, transfers = 0, transfer_us = 0;
+    char line[512];
+    int len;
+
+    for (MetricsShard* shard = atomic_load(&metrics_shards); shard; shard = shard->next) {
+        sent += atomic_load_explicit(&shard->bytes_sent, memory_order_relaxed);
+        received += atomic_load_explicit(&shard->bytes_received, memory_order_relaxed);
+        transfers += atomic_load_explicit(&shard->transfers, memory_order_relaxed);
+        transfer_us += atomic_load_explicit(&shard->transfer_us, memory_order_relaxed);
+    }
+
+    len = snprintf(line, sizeof(line),
+                   "%sftp_uptime_seconds %lld%s%sftp_active_sessions %d%s%sftp_active_transfers %d%s"
+                   "%sftp_transfers_total %lld%s%sftp_bytes_sent_total %lld%s%sftp_bytes_received_total %lld%s"
+                   "%sftp_transfer_rate_mbps %.2f%s",
+                   prefix, (long long)(time(NULL) - metrics_started), eol,
+                   prefix, atomic_load(&active_sessions), eol,
+                   prefix, atomic_load(&active_transfers), eol,
+                   prefix, transfers, eol, prefix, sent, eol, prefix, received, eol,
+                   prefix, transfer_us > 0 ? (sent + received) / (transfer_us / 1000000.0) / (1024.0 * 1024.0) : 0.0, eol);
+    text_append(out, line, len);
+
+    len = snprintf(line, sizeof(line),
+                   "%sftp_listen_sockets %d%s%sftp_connections_accepted_total %lld%s"
+                   "%sftp_connections_rejected_total{reason=\"busy\"} %lld%s"
+                   "%sftp_connections_rejected_total{reason=\"per_ip\"} %lld%s%sftp_accept_queue_depth %d%s",
+                   prefix, listener.socket_count, eol,
+                   prefix, (long long)listener_read(&listener.accepted), eol,
+                   prefix, (long long)listener_read(&listener.rejected_busy), eol,
+                   prefix, (long long)listener_read(&listener.rejected_per_ip), eol,
+                   prefix, listener_queue_depth(&listener), eol);
+    text_append(out, line, len);
+
+    len = snprintf(line, sizeof(line),
+                   "%sftp_bandwidth_limit_bytes %lld%s%sftp_bandwidth_throttled_total %lld%s"
+                   "%sftp_bandwidth_throttled_seconds %.3f%s",
+                   prefix, (long long)atomic_load(&global_rate.rate), eol,
+                   prefix, (long long)atomic_load(&rate_throttled_total), eol,
+                   prefix, atomic_load(&rate_throttled_us) / 1000000.0, eol);
+    text_append(out, line, len);
+
+    len = snprintf(line, sizeof(line), "%sftp_dedup_hits_total %lld%s%sftp_dedup_saved_bytes_total %lld%s",
+                   prefix, (long long)atomic_load(&dedup_hits), eol,
+                   prefix, (long long)atomic_load(&dedup_saved_bytes), eol);
+    text_append(out, line, len);
+
+    len = snprintf(line, sizeof(line), "%sftp_packs_mapped %d%s%sftp_pack_mapped_bytes %lld%s",
+                   prefix, atomic_load(&pack_mapped), eol,
+                   prefix, (long long)atomic_load(&pack_mapped_bytes), eol);
+    text_append(out, line, len);
+
+    len = snprintf(line, sizeof(line), "%sftp_tree_index_entries %lld%s%sftp_tree_index_builds_total %lld%s",
+                   prefix, (long long)atomic_load(&tree_index_entries), eol,
+                   prefix, (long long)atomic_load(&tree_index_builds), eol);
+    text_append(out, line, len);
+
+    FileCacheStats cache;
+    file_cache_stats(&cache);
+    len = snprintf(line, sizeof(line),
+                   "%sftp_file_cache_entries %lld%s%sftp_file_cache_resident_bytes %lld%s"
+                   "%sftp_file_cache_hits_total %lld%s%sftp_file_cache_misses_total %lld%s"
+                   "%sftp_file_cache_evictions_total %lld%s%sftp_file_cache_hit_ratio %.4f%s",
+                   prefix, cache.entries, eol, prefix, cache.bytes, eol,
+                   prefix, cache.hits, eol, prefix, cache.misses, eol, prefix, cache.evictions, eol,
+                   prefix, cache.hits + cache.misses > 0 ? (double)cache.hits / (cache.hits + cache.misses) : 0.0, eol);
+    text_append(out, line, len);
+
+    for (int v = 0; v <= METRIC_VERBS; v++) {
+        long long count = 0;
+        char name[8];
+        if (v < METRIC_VERBS) verb_name(metric_verbs[v], name);
+        else strcpy(name, "OTHER");
+
+        memset(hist, 0, sizeof(hist));
+        for (MetricsShard* shard = atomic_load(&metrics_shards); shard; shard = shard->next) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                long long n = atomic_load_explicit(&shard->hist[v][b], memory_order_relaxed);
+                hist[b] += n;
+                count += n;
+            }
+        }
+        if (count == 0) continue;
+
+        len = snprintf(line, sizeof(line), "%sftp_command_total{cmd=\"%s\"} %lld%s", prefix, name, count, eol);
+        text_append(out, line, len);
+
+        for (int q = 0; q < 3; q++) {
+            long long rank = (long long)(quantiles[q] * count + 0.999999);
+            long long seen = 0;
+            int b = 0;
+            for (; b < HIST_BUCKETS - 1; b++) {
+                seen += hist[b];
+                if (seen >= rank) break;
+            }
+            len = snprintf(line, sizeof(line), "%sftp_command_latency_us{cmd=\"%s\",quantile=\"%s\"} %lld%s",
+                           prefix, name, quantile_names[q], hist_bucket_max(b), eol);
+            text_append(out, line, len);
+        }
+    }
+}
+
+CRITICAL_SECTION metrics_render_cs; // render_metrics usa un histograma estático
+
+// Exporta METRICS_FILE periódicamente (escritura a temporal + rename atómico)
+DWORD WINAPI metrics_exporter(LPVOID param) {
+    (void)param;
+    char tmp_path[] = METRICS_FILE ".tmp";
+
+    while (1) {
+        sleep_ms(config.metrics_interval * 1000);
+
+        TextBuffer text = { NULL, 0, 0 };
+        EnterCriticalSection(&metrics_render_cs);
+        render_metrics(&text, "", "\n");
+        LeaveCriticalSection(&metrics_render_cs);
+
+        FILE* f = fopen(tmp_path, "wb");
+        if (f) {
+            int ok = fwrite(text.data, 1, text.len, f) == text.len;
+            if (fclose(f) == 0 && ok) replace_file(tmp_path, METRICS_FILE);
+        }
+        free(text.data);
+    }
+    return 0;
+}
+
+void metrics_init(void) {
+    metrics_started = time(NULL);
+    InitializeCriticalSection(&metrics_render_cs);
+    if (config.metrics_interval > 0) {
+        spawn_thread(metrics_exporter, NULL);
+    }
+}
+
+void load_config(ServerConfig* cfg) {
+    FILE* f = fopen(CONFIG_FILE, "r");
+    if (!f) {
+        f = fopen(CONFIG_FILE, "w");
+        if (f) {
+            fprintf(f, "# Configuracion del servidor FTP (clave=valor)\n");
+            fprintf(f, "port=%d\n", cfg->port);
+            fprintf(f, "# Hilos del motor de eventos (0 = uno por nucleo)\n");
+            fprintf(f, "workers=%d\n", cfg->workers);
+            fprintf(f, "# Hilos (bajo demanda) para transferencias y comandos que bloquean\n");
+            fprintf(f, "transfer_threads=%d\n", cfg->transfer_threads);
+            fprintf(f, "# Limites de admision: sesiones totales y por IP (0 = sin limite)\n");
+            fprintf(f, "max_connections=%d\n", cfg->max_connections);
+            fprintf(f, "max_per_ip=%d\n", cfg->max_per_ip);
+            fprintf(f, "# RETR sin copias con sendfile (1/0) y buffer del modo con copia\n");
+            fprintf(f, "zero_copy=%d\n", cfg->zero_copy);
+            fprintf(f, "transfer_buffer_kb=%d\n", cfg->transfer_buffer_kb);
+            fprintf(f, "# Buffers de subida (STOR) reutilizables entre sesiones\n");
+            fprintf(f, "upload_pool_buffers=%d\n", cfg->upload_pool_buffers);
+            fprintf(f, "# Cache en memoria de archivos pequenos para RETR (0 = desactivada)\n");
+            fprintf(f, "file_cache_mb=%d\n", cfg->file_cache_mb);
+            fprintf(f, "file_cache_max_kb=%d\n", cfg->file_cache_max_kb);
+            fprintf(f, "# Checksums HASH/XCRC recordados en memoria (ademas del archivo .sum)\n");
+            fprintf(f, "checksum_cache_entries=%d\n", cfg->checksum_cache_entries);
+            fprintf(f, "# Puertos pasivos pre-abiertos (pasv_port_min=0 desactiva el pool)\n");
+            fprintf(f, "pasv_port_min=%d\n", cfg->pasv_port_min);
+            fprintf(f, "pasv_port_max=%d\n", cfg->pasv_port_max);
+            fprintf(f, "# IP anunciada en PASV (vacio = la del canal de control)\n");
+            fprintf(f, "pasv_address=\n");
+            fprintf(f, "# Cache de listados LIST/MLSD (0 = desactivada) y vigencia en segundos\n");
+            fprintf(f, "listing_cache_entries=%d\n", cfg->listing_cache_entries);
+            fprintf(f, "listing_cache_ttl=%d\n", cfg->listing_cache_ttl);
+            fprintf(f, "# Log binario (1 = logs/ftp_server.bin, convertir con ftp_logconv) y vaciado en ms\n");
+            fprintf(f, "log_binary=%d\n", cfg->log_binary);
+            fprintf(f, "log_flush_ms=%d\n", cfg->log_flush_ms);
+            fprintf(f, "# Segundos entre exportaciones de logs/ftp_metrics.txt (0 = no exportar)\n");
+            fprintf(f, "metrics_interval=%d\n", cfg->metrics_interval);
+            fprintf(f, "# Ancho de banda en KB/s: total, por usuario (users.txt puede fijar otro) y rafaga (0 = sin limite)\n");
+            fprintf(f, "bandwidth_global_kb=%d\n", cfg->bandwidth_global_kb);
+            fprintf(f, "bandwidth_user_kb=%d\n", cfg->bandwidth_user_kb);
+            fprintf(f, "bandwidth_burst_kb=%d\n", cfg->bandwidth_burst_kb);
+            fprintf(f, "# MODE Z: nivel de deflate y extensiones que se envian sin recomprimir\n");
+            fprintf(f, "deflate_level=%d\n", cfg->deflate_level);
+            fprintf(f, "deflate_skip_ext=%s\n", cfg->deflate_skip_ext);
+            fprintf(f, "# Deduplicacion: subidas identicas comparten un blob (enlaces duros)\n");
+            fprintf(f, "dedup=%d\n", cfg->dedup);
+            fprintf(f, "dedup_store=%s\n", cfg->dedup_store);
+            fprintf(f, "# Indice recursivo en memoria para SITE FIND y LIST -R (entradas por home, 0 = desactivado)\n");
+            fprintf(f, "tree_index_max_entries=%d\n", cfg->tree_index_max_entries);
+            fclose(f);
+            printf("Archivo de configuración creado: %s\n", CONFIG_FILE);
+        }
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char key[64];
+        char value[192];
+        if (line[0] == '#' || sscanf(line, " %63[^= ] = %191[^\r\n]", key, value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "port") == 0) {
+            cfg->port = atoi(value);
+        } else if (strcmp(key, "workers") == 0) {
+            cfg->workers = atoi(value);
+        } else if (strcmp(key, "transfer_threads") == 0) {
+            cfg->transfer_threads = atoi(value) > 0 ? atoi(value) : 256;
+        } else if (strcmp(key, "max_connections") == 0) {
+            cfg->max_connections = atoi(value);
+        } else if (strcmp(key, "max_per_ip") == 0) {
+            cfg->max_per_ip = atoi(value);
+        } else if (strcmp(key, "zero_copy") == 0) {
+            cfg->zero_copy = atoi(value);
+        } else if (strcmp(key, "transfer_buffer_kb") == 0) {
+            cfg->transfer_buffer_kb = atoi(value) > 0 ? atoi(value) : 256;
+        } else if (strcmp(key, "upload_pool_buffers") == 0) {
+            cfg->upload_pool_buffers = atoi(value) > 0 ? atoi(value) : 64;
+        } else if (strcmp(key, "file_cache_mb") == 0) {
+            cfg->file_cache_mb = atoi(value);
+        } else if (strcmp(key, "file_cache_max_kb") == 0) {
+            cfg->file_cache_max_kb = atoi(value);
+        } else if (strcmp(key, "checksum_cache_entries") == 0) {
+            cfg->checksum_cache_entries = atoi(value);
+        } else if (strcmp(key, "pasv_port_min") == 0) {
+            cfg->pasv_port_min = atoi(value);
+        } else if (strcmp(key, "pasv_port_max") == 0) {
+            cfg->pasv_port_max = atoi(value);
+        } else if (strcmp(key, "pasv_address") == 0) {
+            size_t len = strlen(value);
+            if (len < sizeof(cfg->pasv_address)) {
+                memcpy(cfg->pasv_address, value, len + 1);
+            } else {
+                printf("pasv_address demasiado larga, se ignora: %s\n", value);
+            }
+        } else if (strcmp(key, "listing_cache_entries") == 0) {
+            cfg->listing_cache_entries = atoi(value);
+        } else if (strcmp(key, "listing_cache_ttl") == 0) {
+            cfg->listing_cache_ttl = atoi(value);
+        } else if (strcmp(key, "log_binary") == 0) {
+            cfg->log_binary = atoi(value);
+        } else if (strcmp(key, "log_flush_ms") == 0) {
+            cfg->log_flush_ms = atoi(value);
+        } else if (strcmp(key, "metrics_interval") == 0) {
+            cfg->metrics_interval = atoi(value);
+        } else if (strcmp(key, "bandwidth_global_kb") == 0) {
+            cfg->bandwidth_global_kb = atoi(value);
+        } else if (strcmp(key, "bandwidth_user_kb") == 0) {
+            cfg->bandwidth_user_kb = atoi(value);
+        } else if (strcmp(key, "bandwidth_burst_kb") == 0) {
+            cfg->bandwidth_burst_kb = atoi(value);
+        } else if (strcmp(key, "deflate_level") == 0) {
+            cfg->deflate_level = atoi(value) >= 1 && atoi(value) <= 9 ? atoi(value) : 6;
+        } else if (strcmp(key, "deflate_skip_ext") == 0) {
+            snprintf(cfg->deflate_skip_ext, sizeof(cfg->deflate_skip_ext), "%s", value);
+        } else if (strcmp(key, "dedup") == 0) {
+            cfg->dedup = atoi(value);
+        } else if (strcmp(key, "dedup_store") == 0) {
+            snprintf(cfg->dedup_store, sizeof(cfg->dedup_store), "%s", value);
+        } else if (strcmp(key, "tree_index_max_entries") == 0) {
+            cfg->tree_index_max_entries = atoi(value);
+        }
+    }
+    fclose(f);
+}
+
+void free_user_table(UserTable* table) {
+    if (!table) return;
+    free(table->users);
+    free(table->buckets);
+    free(table->next);
+    free(table);
+}
+
+// Separa los campos numéricos opcionales ":KB/s[:peso]" del final del
+// directorio (se leen desde la derecha: el directorio puede contener ':')
+static void parse_user_limits(char* homedir, User* user) {
+    long values[2];
+    int count = 0;
+    char* colon;
+    while (count < 2 && (colon = strrchr(homedir, ':')) != NULL) {
+        char* end;
+        long value = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || value < 0) break;
+        values[count++] = value;
+        *colon = '\0';
+    }
+    // values[] quedó en orden inverso: con dos campos el último es el peso
+    if (count == 2) {
+        user->rate_kb = (int)values[1];
+        user->weight = values[0] > 0 ? (int)values[0] : 1;
+    } else if (count == 1) {
+        user->rate_kb = (int)values[0];
+    }
+}
+
+// Lee users.txt completo y construye una tabla indexada por nombre de usuario
+UserTable* build_user_table(void) {
+    FILE* f = fopen(USERS_FILE, "r");
+    if (!f) {
+        printf("Error: No se puede abrir %s\n", USERS_FILE);
+        return NULL;
+    }
+
+    UserTable* table = (UserTable*)calloc(1, sizeof(UserTable));
+    int capacity = 0;
+    char line[1024];
+    while (table && fgets(line, sizeof(line), f)) {
+        // Formato: usuario:password:directorio_base[:KB/s[:peso]] (ej: ftp\test:512:2)
+        char* save = NULL;
+        char* username = strtok_r(line, ":", &save);
+        char* password = strtok_r(NULL, ":", &save);
+        char* homedir = strtok_r(NULL, "\n\r", &save);
+
+        if (!username || !password) {
+            continue;
+        }
+
+        if (table->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            User* grown = (User*)realloc(table->users, capacity * sizeof(User));
+            if (!grown) {
+                break;
+            }
+            table->users = grown;
+        }
+
+        User* user = &table->users[table->count];
+        memset(user, 0, sizeof(User));
+        strncpy(user->username, username, sizeof(user->username) - 1);
+        strncpy(user->password, password, sizeof(user->password) - 1);
+        user->password[strcspn(user->password, "\r\n")] = '\0';
+        user->rate_kb = -1;
+        user->weight = 1;
+        if (homedir) parse_user_limits(homedir, user);
+
+        if (homedir && strlen(homedir) > 0) {
+            strncpy(user->home_dir, homedir, sizeof(user->home_dir) - 1);
+        } else {
+            // Directorio por defecto
+            snprintf(user->home_dir, sizeof(user->home_dir), "ftp\\%s", username);
+        }
+        to_native_path(user->home_dir);
+        table->count++;
+    }
+    fclose(f);
+
+    if (!table) return NULL;
+
+    // Cubetas: siguiente potencia de 2 >= 2 * usuarios
+    unsigned buckets = 16;
+    while (buckets < (unsigned)table->count * 2) buckets <<= 1;
+    table->mask = buckets - 1;
+    table->buckets = (int*)malloc(buckets * sizeof(int));
+    table->next = (int*)malloc((table->count + 1) * sizeof(int));
+    if (!table->buckets || !table->next) {
+        free_user_table(table);
+        return NULL;
+    }
+    memset(table->buckets, -1, buckets * sizeof(int));
+
+    // Se inserta en orden inverso para que, ante duplicados, gane la primera línea
+    for (int i = table->count - 1; i >= 0; i--) {
+        unsigned b = hash_string(table->users[i].username) & table->mask;
+        table->next[i] = table->buckets[b];
+        table->buckets[b] = i;
+    }
+    return table;
+}
+
+// Construye la tabla nueva y la publica; la vieja se libera cuando ya no tiene lectores
+int reload_users(void) {
+    UserTable* fresh = build_user_table();
+    if (!fresh) return 0;
+
+    EnterCriticalSection(&user_reload_cs);
+    UserTable* old = atomic_exchange(&user_table, fresh);
+    int epoch = atomic_fetch_add(&user_epoch, 1);
+    while (atomic_load(&user_readers[epoch & 1]) != 0) {
+        sleep_ms(1);
+    }
+    LeaveCriticalSection(&user_reload_cs);
+
+    free_user_table(old);
+    printf("Usuarios cargados: %d\n", fresh->count);
+    return fresh->count;
+}
+
+// Busca un usuario sin bloqueo y copia sus datos. Devuelve 1 si existe.
+int find_user(const char* username, User* out) {
+    int found = 0;
+    int epoch;
+    // Si la época cambió entre leerla y registrarse, el escritor pudo no
+    // ver este lector: se reintenta en la nueva época
+    for (;;) {
+        epoch = atomic_load(&user_epoch);
+        atomic_fetch_add(&user_readers[epoch & 1], 1);
+        if (atomic_load(&user_epoch) == epoch) break;
+        atomic_fetch_sub(&user_readers[epoch & 1], 1);
+    }
+
+    UserTable* table = atomic_load(&user_table);
+    if (table) {
+        int i = table->buckets[hash_string(username) & table->mask];
+        for (; i >= 0; i = table->next[i]) {
+            if (strcmp(table->users[i].username, username) == 0) {
+                *out = table->users[i];
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    atomic_fetch_sub(&user_readers[epoch & 1], 1);
+    return found;
+}
+
+// Vigila users.txt y recarga la tabla cuando cambia
+DWORD WINAPI users_watcher(LPVOID param) {
+    (void)param;
+#ifdef __linux__
+    int fd = inotify_init();
+    // Se vigila el directorio: los editores suelen reemplazar el archivo con rename()
+    if (fd >= 0 && inotify_add_watch(fd, "config", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0) {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const char* name = strrchr(USERS_FILE, '/') + 1;
+        for (;;) {
+            int len = read(fd, events, sizeof(events));
+            if (len <= 0) {
+                if (len < 0 && errno == EINTR) continue;
+                break;
+            }
+            int changed = 0;
+            for (char* p = events; p < events + len; ) {
+                struct inotify_event* ev = (struct inotify_event*)p;
+                if (ev->len > 0 && strcmp(ev->name, name) == 0) changed = 1;
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+            if (changed) {
+                printf("Cambio detectado en %s, recargando usuarios...\n", USERS_FILE);
+                reload_users();
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    printf("inotify no disponible, revisando %s cada %d ms\n", USERS_FILE, USERS_POLL_MS);
+#endif
+    // Respaldo portable: revisar la fecha de modificación periódicamente
+    struct stat st;
+    time_t last_mtime = stat(USERS_FILE, &st) == 0 ? st.st_mtime : 0;
+    for (;;) {
+        sleep_ms(USERS_POLL_MS);
+        if (stat(USERS_FILE, &st) == 0 && st.st_mtime != last_mtime) {
+            last_mtime = st.st_mtime;
+            printf("Cambio detectado en %s, recargando usuarios...\n", USERS_FILE);
+            reload_users();
+        }
+    }
+    return 0;
+}
+
+void send_response(SOCKET sock, const char* code, const char* message) {
+    char buffer[BUFFER_SIZE];
+    int len = snprintf(buffer, sizeof(buffer), "%s %s\r\n", code, message);
+    if (len >= (int)sizeof(buffer)) len = sizeof(buffer) - 1;
+    send_all(sock, buffer, len);
+    printf(">> %s", buffer);
+}
+
+// ==================== PAQUETES DE SOLO LECTURA ====================
+// Un home puede ser un único archivo generado con ftp_pack en vez de un
+// directorio: cabecera, índice de entradas, tabla de nombres y los datos de
+// todos los archivos contiguos. Se mapea en memoria una vez y lo comparten
+// todas las sesiones, así que servir millones de archivos pequeños no cuesta
+// un open()/stat() por archivo: CWD/SIZE/MDTM/LIST se resuelven en el índice
+// y RETR envía el rango del archivo directamente desde el paquete.
+// Las entradas están en orden por niveles (la raíz es la 0): los hijos de un
+// directorio forman un bloque contiguo ordenado por nombre, de modo que cada
+// componente de la ruta se busca con una búsqueda binaria.
+// El paquete nunca se modifica en su sitio: ftp_pack escribe uno nuevo y lo
+// renombra encima; los logins siguientes mapean el nuevo y las sesiones que
+// ya lo tenían montado siguen con el anterior hasta salir.
+
+#define PACK_MAGIC "FTPPACK1"
+
+// Debe coincidir con ftp_pack.c
+typedef struct {
+    char magic[8];
+    unsigned int entry_count;
+    unsigned int names_size;
+    long long names_offset;
+    long long data_offset;
+    long long total_size;
+} PackHeader;
+
+typedef struct {
+    long long offset;         // Datos del archivo (desde el inicio del paquete)
+    long long size;
+    long long mtime;
+    unsigned int name;        // Desplazamiento en la tabla de nombres
+    unsigned int first_child; // Directorios: primer hijo y cantidad de hijos
+    unsigned int child_count;
+    unsigned short name_len;
+    unsigned short is_dir;
+} PackEntry;
+
+typedef struct Pack {
+    char path[MAX_PATH_LEN];
+    long long mtime_ns;       // Fecha del archivo al mapearlo
+    long long file_size;
+    const char* base;
+    const PackEntry* entries;
+    unsigned int count;
+    const char* names;
+    atomic_int refs;          // El registro tiene una referencia; cada sesión que lo monta, otra
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;                   // Abierto para sendfile()
+#endif
+    struct Pack* next;
+} Pack;
+
+Pack* pack_registry = NULL; // Último mapeo de cada ruta
+CRITICAL_SECTION pack_cs;
+
+void pack_init(void) {
+    InitializeCriticalSection(&pack_cs);
+}
+
+// 0 si 'path' es un archivo (no un directorio); tamaño y fecha opcionales
+int pack_file_info(const char* path, long long* size, long long* mtime_ns) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data) ||
+        (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return -1;
+    }
+    ULARGE_INTEGER t;
+    t.LowPart = data.ftLastWriteTime.dwLowDateTime;
+    t.HighPart = data.ftLastWriteTime.dwHighDateTime;
+    if (size) *size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    if (mtime_ns) *mtime_ns = (long long)(t.QuadPart - 116444736000000000ULL) * 100;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    if (size) *size = st.st_size;
+    if (mtime_ns) *mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return 0;
+}
+
+// Comprueba que todo el índice apunte dentro del archivo; después de esto
+// las búsquedas y los envíos ya no necesitan validar nada
+static int pack_validate(const Pack* pack) {
+    const PackHeader* header = (const PackHeader*)pack->base;
+    if (memcmp(header->magic, PACK_MAGIC, 8) != 0 || header->total_size != pack->file_size ||
+        header->entry_count == 0) {
+        return -1;
+    }
+    long long index_end = (long long)sizeof(PackHeader) + (long long)header->entry_count * (long long)sizeof(PackEntry);
+    if (header->names_offset < index_end || header->data_offset < header->names_offset ||
+        header->data_offset - header->names_offset < header->names_size || header->data_offset > header->total_size) {
+        return -1;
+    }
+
+    const PackEntry* entries = (const PackEntry*)(pack->base + sizeof(PackHeader));
+    if (!entries[0].is_dir) return -1;
+    for (unsigned int i = 0; i < header->entry_count; i++) {
+        const PackEntry* e = &entries[i];
+        if ((long long)e->name + e->name_len > header->names_size) return -1;
+        if (e->is_dir) {
+            // Los hijos van siempre después del padre (orden por niveles): sin ciclos
+            if (e->first_child > header->entry_count || e->child_count > header->entry_count - e->first_child ||
+                (e->child_count > 0 && e->first_child <= i)) {
+                return -1;
+            }
+        } else if (e->offset < header->data_offset || e->size < 0 || e->size > header->total_size - e->offset) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void pack_unmap(Pack* pack) {
+#ifdef _WIN32
+    UnmapViewOfFile((LPCVOID)pack->base);
+    CloseHandle(pack->mapping);
+    CloseHandle(pack->file);
+#else
+    munmap((void*)pack->base, (size_t)pack->file_size);
+    close(pack->fd);
+#endif
+    atomic_fetch_sub(&pack_mapped, 1);
+    atomic_fetch_sub(&pack_mapped_bytes, pack->file_size);
+    free(pack);
+}
+
+// Mapea y valida el paquete 'path' (NULL si no existe o no es válido)
+static Pack* pack_map(const char* path, long long mtime_ns) {
+    Pack* pack = (Pack*)calloc(1, sizeof(Pack));
+    if (!pack) return NULL;
+    snprintf(pack->path, sizeof(pack->path), "%s", path);
+    pack->mtime_ns = mtime_ns;
+
+    // El tamaño se toma del archivo ya abierto: si lo reemplazaron entre el
+    // stat() y el open(), se mapea el nuevo completo
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    pack->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                             FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (pack->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(pack->file, &size) ||
+        size.QuadPart < (long long)sizeof(PackHeader) || (unsigned long long)size.QuadPart > (size_t)-1 ||
+        !(pack->mapping = CreateFileMappingA(pack->file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+        if (pack->file != INVALID_HANDLE_VALUE) CloseHandle(pack->file);
+        free(pack);
+        return NULL;
+    }
+    pack->file_size = size.QuadPart;
+    pack->base = (const char*)MapViewOfFile(pack->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!pack->base) {
+        CloseHandle(pack->mapping);
+        CloseHandle(pack->file);
+        free(pack);
+        return NULL;
+    }
+#else
+    struct stat st;
+    pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pack->fd < 0 || fstat(pack->fd, &st) != 0 || st.st_size < (off_t)sizeof(PackHeader) ||
+        (unsigned long long)st.st_size > (size_t)-1) {
+        if (pack->fd >= 0) close(pack->fd);
+        free(pack);
+        return NULL;
+    }
+    pack->file_size = st.st_size;
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (base == MAP_FAILED) {
+        close(pack->fd);
+        free(pack);
+        return NULL;
+    }
+    pack->base = (const char*)base;
+#endif
+    atomic_fetch_add(&pack_mapped, 1);
+    atomic_fetch_add(&pack_mapped_bytes, pack->file_size);
+
+    if (pack_validate(pack) != 0) {
+        pack_unmap(pack);
+        return NULL;
+    }
+    const PackHeader* header = (const PackHeader*)pack->base;
+    pack->entries = (const PackEntry*)(pack->base + sizeof(PackHeader));
+    pack->count = header->entry_count;
+    pack->names = pack->base + header->names_offset;
+    return pack;
+}
+
+void pack_release(Pack* pack) {
+    if (pack && atomic_fetch_sub(&pack->refs, 1) == 1) {
+        pack_unmap(pack);
+    }
+}
+
+// Enlace del registro que apunta al paquete de 'path' (o al final). Con pack_cs tomado.
+static Pack** pack_link(const char* path) {
+    Pack** link = &pack_registry;
+    while (*link && strcmp((*link)->path, path) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Paquete de 'path' (ruta absoluta) con una referencia para quien llama.
+// Se reutiliza el mapeo vigente salvo que el archivo haya cambiado. Mapear y
+// validar recorre todo el índice: se hace sin pack_cs, que sólo se toma para
+// buscar y publicar, así un paquete grande no frena los logins de los demás.
+Pack* pack_acquire(const char* path) {
+    long long mtime_ns;
+    if (pack_file_info(path, NULL, &mtime_ns) != 0) return NULL;
+
+    EnterCriticalSection(&pack_cs);
+    Pack* current = *pack_link(path);
+    if (current && current->mtime_ns == mtime_ns) {
+        atomic_fetch_add(&current->refs, 1);
+        LeaveCriticalSection(&pack_cs);
+        return current;
+    }
+    LeaveCriticalSection(&pack_cs);
+
+    Pack* pack = pack_map(path, mtime_ns);
+    if (!pack) return NULL;
+    atomic_init(&pack->refs, 2);
+
+    EnterCriticalSection(&pack_cs);
+    Pack** link = pack_link(path);
+    Pack* old = *link;
+    if (old && old->mtime_ns == mtime_ns) {
+        // Otra sesión publicó el mismo mapeo mientras tanto: se usa el suyo
+        atomic_fetch_add(&old->refs, 1);
+        LeaveCriticalSection(&pack_cs);
+        pack_unmap(pack);
+        return old;
+    }
+    if (old) {
+        pack->next = old->next;
+    }
+    *link = pack;
+    LeaveCriticalSection(&pack_cs);
+    if (old) pack_release(old);
+    return pack;
+}
+
+// Entrada de una ruta virtual ya resuelta ("/", "/a/b") o NULL
+const PackEntry* pack_lookup(const Pack* pack, const char* vpath) {
+    const PackEntry* entry = &pack->entries[0];
+    const char* part = vpath;
+    while (*part) {
+        if (*part == '/') {
+            part++;
+            continue;
+        }
+        const char* end = strchr(part, '/');
+        size_t len = end ? (size_t)(end - part) : strlen(part);
+        if (!entry->is_dir) return NULL;
+
+        unsigned int lo = entry->first_child;
+        unsigned int hi = lo + entry->child_count;
+        entry = NULL;
+        while (lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+            const PackEntry* e = &pack->entries[mid];
+            int cmp = memcmp(pack->names + e->name, part, e->name_len < len ? e->name_len : len);
+            if (cmp == 0) cmp = e->name_len < len ? -1 : e->name_len > len;
+            if (cmp == 0) {
+                entry = e;
+                break;
+            }
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        if (!entry) return NULL;
+        part += len;
+    }
+    return entry;
+}
+
+// ==================== SISTEMA DE ARCHIVOS VIRTUAL POR SESIÓN ====================
+typedef struct {
+    long long size;
+    time_t mtime;
+    long long mtime_ns; // Misma fecha con resolución de nanosegundos
+    int is_dir;
+} VfsStat;
+
+// Cada sesión resuelve sus rutas contra su propio home, sin tocar el
+// directorio de trabajo del proceso (compartido por todos los hilos).
+// Las rutas virtuales siempre empiezan con '/' y nunca salen del home.
+
+// Combina el directorio actual con la ruta del cliente y la normaliza
+// (".", ".." y separadores repetidos). ".." en la raíz se queda en la raíz.
+int vfs_resolve(ClientSession* session, const char* path, char* out, size_t size) {
+    char joined[MAX_PATH_LEN * 2];
+    if (path[0] == '/' || path[0] == '\\') {
+        snprintf(joined, sizeof(joined), "%s", path);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", session->current_dir, path);
+    }
+
+    size_t len = 0;
+    char* save = NULL;
+    out[0] = '\0';
+    for (char* part = strtok_r(joined, "/\\", &save); part; part = strtok_r(NULL, "/\\", &save)) {
+        if (strcmp(part, ".") == 0) {
+            continue;
+        }
+        if (strcmp(part, "..") == 0) {
+            char* slash = strrchr(out, '/');
+            len = slash ? (size_t)(slash - out) : 0;
+            out[len] = '\0';
+            continue;
+        }
+        size_t part_len = strlen(part);
+        if (len + part_len + 2 > size) {
+            return -1;
+        }
+        out[len++] = '/';
+        memcpy(out + len, part, part_len + 1);
+        len += part_len;
+    }
+    if (len == 0) {
+        snprintf(out, size, "/");
+    }
+    return 0;
+}
+
+// Ruta real (home + ruta virtual) con separadores de la plataforma
+void vfs_native_path(ClientSession* session, const char* vpath, char* out, size_t size) {
+    snprintf(out, size, "%s%s", session->home_path, strcmp(vpath, "/") == 0 ? "" : vpath);
+    to_native_path(out);
+}
+
+#ifndef _WIN32
+// openat() confinado al home: con openat2 + RESOLVE_BENEATH ni los enlaces
+// simbólicos pueden escapar. Sin openat2 la ruta ya viene normalizada.
+static int vfs_openat(ClientSession* session, const char* vpath, int flags, mode_t mode) {
+    const char* rel = strcmp(vpath, "/") == 0 ? "." : vpath + 1;
+#ifdef SYS_openat2
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd = (int)syscall(SYS_openat2, session->root_fd, rel, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) return fd;
+#endif
+    return openat(session->root_fd, rel, flags | O_CLOEXEC, mode);
+}
+#endif
+
+void vfs_logout(ClientSession* session) {
+#ifndef _WIN32
+    if (session->root_fd >= 0) close(session->root_fd);
+    if (session->cwd_fd >= 0) close(session->cwd_fd);
+    session->root_fd = -1;
+    session->cwd_fd = -1;
+#endif
+    pack_release(session->pack);
+    session->pack = NULL;
+    session->home_path[0] = '\0';
+}
+
+// Abre el home del usuario como raíz de la sesión. Un home que es un
+// archivo se monta como paquete de solo lectura.
+int vfs_login(ClientSession* session, const char* home_dir) {
+    vfs_logout(session);
+    strcpy(session->current_dir, "/");
+    if (pack_file_info(home_dir, NULL, NULL) == 0) {
+#ifdef _WIN32
+        if (!_fullpath(session->home_path, home_dir, sizeof(session->home_path))) return -1;
+#else
+        if (!realpath(home_dir, session->home_path)) return -1;
+#endif
+        session->pack = pack_acquire(session->home_path);
+        return session->pack ? 0 : -1;
+    }
+
+    make_dir(home_dir);
+#ifdef _WIN32
+    if (!_fullpath(session->home_path, home_dir, sizeof(session->home_path))) return -1;
+    DWORD attrs = GetFileAttributesA(session->home_path);
+    if (attrs == INVALID_FILE_ATTRIBUTES || !(attrs & FILE_ATTRIBUTE_DIRECTORY)) return -1;
+#else
+    if (!realpath(home_dir, session->home_path)) return -1;
+    session->root_fd = open(session->home_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (session->root_fd < 0) return -1;
+    session->cwd_fd = dup(session->root_fd);
+#endif
+    return 0;
+}
+
+// Cambia el directorio actual de la sesión a una ruta virtual ya resuelta
+int vfs_chdir(ClientSession* session, const char* vpath) {
+    if (session->pack) {
+        const PackEntry* entry = pack_lookup(session->pack, vpath);
+        if (!entry || !entry->is_dir) return -1;
+        snprintf(session->current_dir, sizeof(session->current_dir), "%s", vpath);
+        return 0;
+    }
+#ifdef _WIN32
+    char native[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, native, sizeof(native));
+    DWORD attrs = GetFileAttributesA(native);
+    if (attrs == INVALID_FILE_ATTRIBUTES || !(attrs & FILE_ATTRIBUTE_DIRECTORY)) return -1;
+#else
+    int fd = vfs_openat(session, vpath, O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0) return -1;
+    close(session->cwd_fd);
+    session->cwd_fd = fd;
+#endif
+    snprintf(session->current_dir, sizeof(session->current_dir), "%s", vpath);
+    return 0;
+}
+
+// fopen() de una ruta virtual ya resuelta ("rb", "wb", "ab" o "r+b")
+// Los paquetes no se abren como archivos: se leen desde el mapeo
+FILE* vfs_fopen(ClientSession* session, const char* vpath, const char* mode) {
+    if (session->pack) return NULL;
+#ifdef _WIN32
+    char native[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, native, sizeof(native));
+    return fopen(native, mode);
+#else
+    int flags = O_RDONLY;
+    if (mode[0] == 'w') flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (mode[0] == 'a') flags = O_WRONLY | O_CREAT | O_APPEND;
+    else if (strchr(mode, '+')) flags = O_RDWR | O_CREAT;
+    int fd = vfs_openat(session, vpath, flags, 0644);
+    if (fd < 0) return NULL;
+    FILE* file = fdopen(fd, mode);
+    if (!file) close(fd);
+    return file;
+#endif
+}
+
+// Tamaño, fecha y tipo de una ruta virtual ya resuelta
+int vfs_stat(ClientSession* session, const char* vpath, VfsStat* out) {
+    if (session->pack) {
+        const PackEntry* entry = pack_lookup(session->pack, vpath);
+        if (!entry) return -1;
+        out->size = entry->is_dir ? 0 : entry->size;
+        out->mtime = (time_t)entry->mtime;
+        out->mtime_ns = entry->mtime * 1000000000LL;
+        out->is_dir = entry->is_dir;
+        return 0;
+    }
+#ifdef _WIN32
+    char native[MAX_PATH_LEN * 2];
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    vfs_native_path(session, vpath, native, sizeof(native));
+    if (!GetFileAttributesExA(native, GetFileExInfoStandard, &data)) return -1;
+    ULARGE_INTEGER t;
+    t.LowPart = data.ftLastWriteTime.dwLowDateTime;
+    t.HighPart = data.ftLastWriteTime.dwHighDateTime;
+    out->size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    out->mtime = (time_t)((t.QuadPart - 116444736000000000ULL) / 10000000ULL); // FILETIME -> Unix
+    out->mtime_ns = (long long)(t.QuadPart - 116444736000000000ULL) * 100;
+    out->is_dir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+#ifdef O_PATH
+    int fd = vfs_openat(session, vpath, O_PATH, 0);
+#else
+    int fd = vfs_openat(session, vpath, O_RDONLY | O_NONBLOCK, 0);
+#endif
+    if (fd < 0) return -1;
+    int result = fstat(fd, &st);
+    close(fd);
+    if (result != 0) return -1;
+    out->size = st.st_size;
+    out->mtime = st.st_mtime;
+    out->mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    out->is_dir = S_ISDIR(st.st_mode);
+#endif
+    return 0;
+}
+
+#ifndef _WIN32
+// Abre (confinado) el directorio que contiene 'vpath'; 'name' apunta al último componente
+static int vfs_open_parent(ClientSession* session, const char* vpath, const char** name) {
+    char parent[MAX_PATH_LEN];
+    snprintf(parent, sizeof(parent), "%s", vpath);
+    char* slash = strrchr(parent, '/');
+    *name = vpath + (slash - parent) + 1;
+    if (slash == parent) slash[1] = '\0'; else *slash = '\0';
+    return vfs_openat(session, parent, O_RDONLY | O_DIRECTORY, 0);
+}
+#endif
+
+int vfs_unlink(ClientSession* session, const char* vpath) {
+    if (strcmp(vpath, "/") == 0 || session->pack) return -1;
+#ifdef _WIN32
+    char native[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, native, sizeof(native));
+    return DeleteFileA(native) ? 0 : -1;
+#else
+    // Se abre el directorio padre confinado y se borra la entrada desde ahí
+    const char* name;
+    int dir_fd = vfs_open_parent(session, vpath, &name);
+    if (dir_fd < 0) return -1;
+    int result = unlinkat(dir_fd, name, 0);
+    close(dir_fd);
+    return result;
+#endif
+}
+
+// Renombra 'from' a 'to' (rutas virtuales ya resueltas), reemplazando el destino
+int vfs_rename(ClientSession* session, const char* from, const char* to) {
+    if (strcmp(from, "/") == 0 || strcmp(to, "/") == 0 || session->pack) return -1;
+#ifdef _WIN32
+    char native_from[MAX_PATH_LEN * 2];
+    char native_to[MAX_PATH_LEN * 2];
+    vfs_native_path(session, from, native_from, sizeof(native_from));
+    vfs_native_path(session, to, native_to, sizeof(native_to));
+    return replace_file(native_from, native_to);
+#else
+    const char* from_name;
+    const char* to_name;
+    int from_fd = vfs_open_parent(session, from, &from_name);
+    if (from_fd < 0) return -1;
+    int to_fd = vfs_open_parent(session, to, &to_name);
+    if (to_fd < 0) {
+        close(from_fd);
+        return -1;
+    }
+    int result = renameat(from_fd, from_name, to_fd, to_name);
+    close(from_fd);
+    close(to_fd);
+    return result;
+#endif
+}
+
+// Número de enlaces duros de un archivo fuera de los homes (-1 si no existe)
+int native_links(const char* path, long long* size) {
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                           OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h == INVALID_HANDLE_VALUE) return -1;
+    BY_HANDLE_FILE_INFORMATION info;
+    int ok = GetFileInformationByHandle(h, &info);
+    CloseHandle(h);
+    if (!ok) return -1;
+    if (size) *size = ((long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    return (int)info.nNumberOfLinks;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    if (size) *size = st.st_size;
+    return (int)st.st_nlink;
+#endif
+}
+
+// Enlaces duros de 'vpath' (-1 si no existe)
+int vfs_link_count(ClientSession* session, const char* vpath) {
+#ifdef _WIN32
+    char native[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, native, sizeof(native));
+    return native_links(native, NULL);
+#else
+    struct stat st;
+#ifdef O_PATH
+    int fd = vfs_openat(session, vpath, O_PATH, 0);
+#else
+    int fd = vfs_openat(session, vpath, O_RDONLY | O_NONBLOCK, 0);
+#endif
+    if (fd < 0) return -1;
+    int result = fstat(fd, &st);
+    close(fd);
+    return result == 0 ? (int)st.st_nlink : -1;
+#endif
+}
+
+// Crea 'vpath' como enlace duro a 'native' (archivo fuera de los homes)
+int vfs_link_in(ClientSession* session, const char* native, const char* vpath) {
+    if (strcmp(vpath, "/") == 0) return -1;
+#ifdef _WIN32
+    char target[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, target, sizeof(target));
+    return CreateHardLinkA(target, native, NULL) ? 0 : -1;
+#else
+    const char* name;
+    int dir_fd = vfs_open_parent(session, vpath, &name);
+    if (dir_fd < 0) return -1;
+    int result = linkat(AT_FDCWD, native, dir_fd, name, 0);
+    close(dir_fd);
+    return result;
+#endif
+}
+
+// Crea 'native' como enlace duro a 'vpath'
+int vfs_link_out(ClientSession* session, const char* vpath, const char* native) {
+#ifdef _WIN32
+    char source[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, source, sizeof(source));
+    return CreateHardLinkA(native, source, NULL) ? 0 : -1;
+#else
+    const char* name;
+    int dir_fd = vfs_open_parent(session, vpath, &name);
+    if (dir_fd < 0) return -1;
+    int result = linkat(dir_fd, name, AT_FDCWD, native, 0);
+    close(dir_fd);
+    return result;
+#endif
+}
+
+// Ruta virtual del directorio que contiene a 'vpath'
+void vfs_parent(const char* vpath, char* out, size_t size) {
+    snprintf(out, size, "%s", vpath);
+    char* slash = strrchr(out, '/');
+    if (slash == out || !slash) snprintf(out, size, "/");
+    else *slash = '\0';
+}
+
+void handle_user(ClientSession* session, const char* username) {
+    strncpy(session->username, username, sizeof(session->username) - 1);
+    send_response(session->ctrl_sock, "331", "Username OK, need password.");
+    log_message(session->client_ip, session->client_port, "USER", "331", 0, 0);
+}
+
+void handle_pass(ClientSession* session, const char* password) {
+    User found;
+    User* user = &found;
+    int authenticated = find_user(session->username, user) &&
+                        strcmp(user->password, password) == 0;
+
+    if (authenticated) {
+        // El home del usuario pasa a ser la raíz "/" de la sesión
+        if (vfs_login(session, user->home_dir) != 0) {
+             send_response(session->ctrl_sock, "530", "Login failed. Cannot access home directory.");
+             log_message(session->client_ip, session->client_port, "PASS", "530", 0, 0);
+             session->logged_in = 0;
+             return;
+        }
+        session->logged_in = 1;
+        session->rate_bucket = user_rate_bucket(user->username, user->rate_kb);
+        session->rate_weight = user->weight;
+
+        send_response(session->ctrl_sock, "230", "User logged in.");
+        log_message(session->client_ip, session->client_port, "PASS", "230", 0, 0);
+    } else {
+        send_response(session->ctrl_sock, "530", "Login incorrect.");
+        log_message(session->client_ip, session->client_port, "PASS", "530", 0, 0);
+    }
+}
+
+void handle_pwd(ClientSession* session) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    char buffer[BUFFER_SIZE];
+    // La ruta ya está guardada en formato Unix
+    snprintf(buffer, sizeof(buffer), "\"%s\" is current directory.", session->current_dir);
+    send_response(session->ctrl_sock, "257", buffer);
+    log_message(session->client_ip, session->client_port, "PWD", "257", 0, 0);
+}
+
+void handle_cwd(ClientSession* session, const char* path) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    // Las rutas relativas, absolutas y ".." se resuelven dentro del home
+    char vpath[MAX_PATH_LEN];
+    const char* status = "250";
+    if (vfs_resolve(session, path, vpath, sizeof(vpath)) == 0 && vfs_chdir(session, vpath) == 0) {
+        send_response(session->ctrl_sock, "250", "Directory changed.");
+    } else {
+        send_response(session->ctrl_sock, "550", "Directory not found or access denied.");
+        status = "550";
+    }
+
+    log_message(session->client_ip, session->client_port, "CWD", status, 0, 0);
+}
+
+
+// ==================== POOL DE PUERTOS PASIVOS ====================
+// Los puertos del rango configurado se abren y quedan escuchando al arrancar.
+// PASV/EPSV toma uno libre del pool y lo devuelve al terminar la transferencia,
+// así preparar el canal de datos sólo cuesta un accept().
+
+typedef struct {
+    SOCKET sock;
+    int port;
+    atomic_int in_use;
+} PasvSlot;
+
+PasvSlot* pasv_pool = NULL;
+int pasv_pool_size = 0;
+atomic_uint pasv_next = 0;
+atomic_int pasv_in_use = 0;
+atomic_int pasv_peak = 0;
+
+void pasv_pool_init(void) {
+    if (config.pasv_port_min <= 0 || config.pasv_port_max < config.pasv_port_min) {
+        printf("Pool de puertos pasivos desactivado (puerto efímero por transferencia)\n");
+        return;
+    }
+
+    int count = config.pasv_port_max - config.pasv_port_min + 1;
+    pasv_pool = (PasvSlot*)calloc(count, sizeof(PasvSlot));
+    if (!pasv_pool) return;
+
+    for (int port = config.pasv_port_min; port <= config.pasv_port_max; port++) {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) continue;
+
+        int opt = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+
+        // No bloqueante: permite vaciar conexiones viejas y aceptar con tiempo límite
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(sock, 8) == SOCKET_ERROR || set_socket_blocking(sock, 0) != 0) {
+            closesocket(sock);
+            continue;
+        }
+
+        pasv_pool[pasv_pool_size].sock = sock;
+        pasv_pool[pasv_pool_size].port = port;
+        atomic_init(&pasv_pool[pasv_pool_size].in_use, 0);
+        pasv_pool_size++;
+    }
+    printf("Pool de puertos pasivos: %d puertos (%d-%d)\n",
+           pasv_pool_size, config.pasv_port_min, config.pasv_port_max);
+}
+
+// Toma un puerto libre del pool. Devuelve el índice o -1 si está agotado.
+int pasv_acquire(void) {
+    if (pasv_pool_size == 0) return -1;
+
+    unsigned first = atomic_fetch_add(&pasv_next, 1);
+    for (int i = 0; i < pasv_pool_size; i++) {
+        int slot = (int)((first + i) % (unsigned)pasv_pool_size);
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&pasv_pool[slot].in_use, &expected, 1)) {
+            // Descartar conexiones pendientes de una transferencia anterior
+            SOCKET stale;
+            while ((stale = accept(pasv_pool[slot].sock, NULL, NULL)) != INVALID_SOCKET) {
+                closesocket(stale);
+            }
+
+            int used = atomic_fetch_add(&pasv_in_use, 1) + 1;
+            int peak = atomic_load(&pasv_peak);
+            while (used > peak && !atomic_compare_exchange_weak(&pasv_peak, &peak, used)) {
+            }
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Devuelve el puerto pasivo de la sesión al pool (o cierra el socket propio)
+void pasv_release(ClientSession* session) {
+    if (session->pasv_slot >= 0) {
+        atomic_store(&pasv_pool[session->pasv_slot].in_use, 0);
+        atomic_fetch_sub(&pasv_in_use, 1);
+        session->pasv_slot = -1;
+    } else if (session->pasv_sock != INVALID_SOCKET) {
+        closesocket(session->pasv_sock);
+    }
+    session->pasv_sock = INVALID_SOCKET;
+}
+
+// Socket de escucha efímero (pool desactivado)
+SOCKET open_ephemeral_pasv(void) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0; // Puerto aleatorio
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(sock, 1) == SOCKET_ERROR || set_socket_blocking(sock, 0) != 0) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Espera la conexión de datos del cliente. Sólo se acepta desde la IP del
+// canal de control, para que nadie más pueda colarse en un puerto del pool.
+SOCKET accept_data_connection(ClientSession* session) {
+    long long deadline = now_us() + DATA_ACCEPT_TIMEOUT_MS * 1000LL;
+
+    for (;;) {
+        int remaining = (int)((deadline - now_us()) / 1000);
+        if (remaining <= 0 || !wait_readable(session->pasv_sock, remaining)) {
+            return INVALID_SOCKET;
+        }
+
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        SOCKET sock = accept(session->pasv_sock, (struct sockaddr*)&peer, &peer_len);
+        if (sock == INVALID_SOCKET) {
+            continue;
+        }
+        if (peer.sin_addr.s_addr != session->client_addr.sin_addr.s_addr) {
+            closesocket(sock);
+            continue;
+        }
+        set_socket_blocking(sock, 1); // En Windows hereda el modo del socket de escucha
+        return sock;
+    }
+}
+
+// PASV (extended = 0) o EPSV (extended = 1, RFC 2428)
+void handle_pasv(ClientSession* session, int extended) {
+    const char* cmd_name = extended ? "EPSV" : "PASV";
+
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    // Un PASV repetido libera el puerto anterior
+    pasv_release(session);
+
+    int port;
+    if (pasv_pool_size > 0) {
+        session->pasv_slot = pasv_acquire();
+        if (session->pasv_slot < 0) {
+            send_response(session->ctrl_sock, "425", "No passive ports available.");
+            log_message(session->client_ip, session->client_port, cmd_name, "425", 0, 0);
+            return;
+        }
+        session->pasv_sock = pasv_pool[session->pasv_slot].sock;
+        port = pasv_pool[session->pasv_slot].port;
+    } else {
+        session->pasv_sock = open_ephemeral_pasv();
+        if (session->pasv_sock == INVALID_SOCKET) {
+            send_response(session->ctrl_sock, "425", "Cannot open passive connection.");
+            return;
+        }
+        struct sockaddr_in pasv_addr;
+        socklen_t addr_len = sizeof(pasv_addr);
+        getsockname(session->pasv_sock, (struct sockaddr*)&pasv_addr, &addr_len);
+        port = ntohs(pasv_addr.sin_port);
+    }
+
+    char buffer[BUFFER_SIZE];
+    if (extended) {
+        snprintf(buffer, sizeof(buffer), "Entering Extended Passive Mode (|||%d|)", port);
+        send_response(session->ctrl_sock, "229", buffer);
+        log_message(session->client_ip, session->client_port, cmd_name, "229", 0, 0);
+        return;
+    }
+
+    // IP anunciada: la configurada o la local del canal de control
+    struct sockaddr_in local_addr;
+    socklen_t local_len = sizeof(local_addr);
+    memset(&local_addr, 0, sizeof(local_addr));
+    if (config.pasv_address[0]) {
+        local_addr.sin_addr.s_addr = inet_addr(config.pasv_address);
+    } else {
+        getsockname(session->ctrl_sock, (struct sockaddr*)&local_addr, &local_len);
+    }
+    unsigned char* ip_parts = (unsigned char*)&local_addr.sin_addr;
+
+    snprintf(buffer, sizeof(buffer), "Entering Passive Mode (%d,%d,%d,%d,%d,%d).",
+             ip_parts[0], ip_parts[1], ip_parts[2], ip_parts[3], port / 256, port % 256);
+    send_response(session->ctrl_sock, "227", buffer);
+    log_message(session->client_ip, session->client_port, cmd_name, "227", 0, 0);
+}
+
+// ==================== CACHÉ DE LISTADOS ====================
+// Cada directorio listado se guarda ya formateado: primero el texto de LIST
+// y a continuación el de MLSD, en un único buffer contiguo que se envía con
+// un solo send. La entrada se identifica por la ruta real del directorio y
+// vale mientras su fecha de modificación (en ns) no cambie; STOR/APPE/DELE la
+// invalidan explícitamente y el TTL acota cambios externos que no alteran la
+// fecha del directorio (p. ej. reescribir un archivo existente).
+// La caché es de mapeo directo: cada ruta cae en una sola ranura.
+
+typedef struct {
+    char path[MAX_PATH_LEN * 2]; // Ruta real del directorio
+    long long dir_mtime_ns;      // Fecha del directorio al generar el listado
+    time_t created;
+    char* data;                  // LIST seguido de MLSD
+    size_t list_len;
+    size_t mlsd_len;
+    atomic_int refs;             // La caché tiene una referencia; cada envío en curso, otra
+} Listing;
+
+Listing** listing_cache = NULL;
+CRITICAL_SECTION listing_cs;
+
+void listing_cache_init(void) {
+    InitializeCriticalSection(&listing_cs);
+    if (config.listing_cache_entries > 0) {
+        listing_cache = (Listing**)calloc(config.listing_cache_entries, sizeof(Listing*));
+    }
+}
+
+void listing_release(Listing* listing) {
+    if (listing && atomic_fetch_sub(&listing->refs, 1) == 1) {
+        free(listing->data);
+        free(listing);
+    }
+}
+
+// Añade una entrada a los dos formatos (LIST estilo UNIX y MLSD de RFC 3659; sin 'mlsd', sólo LIST)
+void listing_add_entry(TextBuffer* list, TextBuffer* mlsd, const char* name, int is_dir,
+                       long long size, time_t mtime) {
+    char line[MAX_PATH_LEN + 128];
+    struct tm lt;
+    struct tm ut;
+    local_tm(mtime, &lt);
+    utc_tm(mtime, &ut);
+
+    int len = snprintf(line, sizeof(line), "%s%s 1 user group %10lld %04d-%02d-%02d %02d:%02d %s\r\n",
+                       is_dir ? "d" : "-", "rw-rw-rw-", size,
+                       lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday,
+                       lt.tm_hour, lt.tm_min, name);
+    text_append(list, line, len);
+    if (!mlsd) return;
+
+    if (is_dir) {
+        len = snprintf(line, sizeof(line), "type=dir;modify=%04d%02d%02d%02d%02d%02d; %s\r\n",
+                       ut.tm_year + 1900, ut.tm_mon + 1, ut.tm_mday,
+                       ut.tm_hour, ut.tm_min, ut.tm_sec, name);
+    } else {
+        len = snprintf(line, sizeof(line), "type=file;size=%lld;modify=%04d%02d%02d%02d%02d%02d; %s\r\n",
+                       size, ut.tm_year + 1900, ut.tm_mon + 1, ut.tm_mday,
+                       ut.tm_hour, ut.tm_min, ut.tm_sec, name);
+    }
+    text_append(mlsd, line, len);
+}
+
+// Sidecars de checksums (.nombre.sum) y temporales de subida (.nombre.N.part)
+int is_internal_file(const char* name) {
+    size_t len = strlen(name);
+    return name[0] == '.' && ((len > 4 && strcmp(name + len - 4, ".sum") == 0) ||
+                              (len > 5 && strcmp(name + len - 5, ".part") == 0));
+}
+
+// Añade las entradas del directorio real actual de la sesión
+static int list_native_dir(ClientSession* session, const char* native_dir, TextBuffer* list, TextBuffer* mlsd) {
+    int entries = 0;
+
+#ifdef _WIN32
+    char search_path[MAX_PATH_LEN * 2 + 4];
+    snprintf(search_path, sizeof(search_path), "%s\\*", native_dir);
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE hFind = FindFirstFileA(search_path, &find_data);
+
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            // Saltar . y .. y los archivos internos del servidor
+            if (strcmp(find_data.cFileName, ".") == 0 || strcmp(find_data.cFileName, "..") == 0 ||
+                is_internal_file(find_data.cFileName)) {
+                continue;
+            }
+
+            LARGE_INTEGER file_size;
+            file_size.LowPart = find_data.nFileSizeLow;
+            file_size.HighPart = find_data.nFileSizeHigh;
+            ULARGE_INTEGER t;
+            t.LowPart = find_data.ftLastWriteTime.dwLowDateTime;
+            t.HighPart = find_data.ftLastWriteTime.dwHighDateTime;
+
+            listing_add_entry(list, mlsd, find_data.cFileName,
+                              (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+                              file_size.QuadPart,
+                              (time_t)((t.QuadPart - 116444736000000000ULL) / 10000000ULL));
+            entries++;
+        } while (FindNextFileA(hFind, &find_data));
+        FindClose(hFind);
+    }
+#else
+    (void)native_dir;
+    int list_fd = openat(session->cwd_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    struct dirent* entry;
+    if (!dir && list_fd >= 0) close(list_fd);
+
+    while (dir && (entry = readdir(dir)) != NULL) {
+        // Saltar . y .. y los archivos internos del servidor
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            is_internal_file(entry->d_name)) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) {
+            continue;
+        }
+
+        listing_add_entry(list, mlsd, entry->d_name, S_ISDIR(st.st_mode),
+                          (long long)st.st_size, st.st_mtime);
+        entries++;
+    }
+    if (dir) closedir(dir);
+#endif
+    return entries;
+}
+
+// Genera LIST + MLSD del directorio actual de la sesión
+Listing* render_listing(ClientSession* session, const char* native_dir, long long dir_mtime_ns) {
+    TextBuffer list = { NULL, 0, 0 };
+    TextBuffer mlsd = { NULL, 0, 0 };
+    int entries = 0;
+
+    if (session->pack) {
+        // Paquete: los hijos son un bloque contiguo del índice, sin tocar el disco
+        const Pack* pack = session->pack;
+        const PackEntry* dir = pack_lookup(pack, session->current_dir);
+        for (unsigned int i = 0; dir && dir->is_dir && i < dir->child_count; i++) {
+            const PackEntry* e = &pack->entries[dir->first_child + i];
+            char name[MAX_PATH_LEN];
+            snprintf(name, sizeof(name), "%.*s", (int)e->name_len, pack->names + e->name);
+            listing_add_entry(&list, &mlsd, name, e->is_dir, e->is_dir ? 0 : e->size, (time_t)e->mtime);
+            entries++;
+        }
+    } else {
+        entries = list_native_dir(session, native_dir, &list, &mlsd);
+    }
+
+    if (entries == 0) {
+        const char* empty = "No files found\r\n";
+        text_append(&list, empty, strlen(empty));
+    }
+
+    Listing* listing = (Listing*)calloc(1, sizeof(Listing));
+    if (listing && text_append(&list, mlsd.data ? mlsd.data : "", mlsd.len) == 0) {
+        snprintf(listing->path, sizeof(listing->path), "%s", native_dir);
+        listing->dir_mtime_ns = dir_mtime_ns;
+        listing->created = time(NULL);
+        listing->list_len = list.len - mlsd.len;
+        listing->mlsd_len = mlsd.len;
+        listing->data = list.data;
+        atomic_init(&listing->refs, 1);
+        list.data = NULL;
+    } else {
+        free(listing);
+        listing = NULL;
+    }
+    free(list.data);
+    free(mlsd.data);
+    return listing;
+}
+
+// Devuelve el listado del directorio actual (con una referencia para quien llama)
+Listing* get_listing(ClientSession* session) {
+    char native_dir[MAX_PATH_LEN * 2];
+    VfsStat st;
+    vfs_native_path(session, session->current_dir, native_dir, sizeof(native_dir));
+    if (vfs_stat(session, session->current_dir, &st) != 0) {
+        st.mtime_ns = -1;
+    } else if (session->pack) {
+        // Un paquete es inmutable: sus listados valen mientras sea el mismo archivo
+        st.mtime_ns = session->pack->mtime_ns;
+    }
+
+    Listing** slot = NULL;
+    if (listing_cache) {
+        slot = &listing_cache[hash_string(native_dir) % (unsigned)config.listing_cache_entries];
+        EnterCriticalSection(&listing_cs);
+        Listing* cached = *slot;
+        if (cached && strcmp(cached->path, native_dir) == 0 && st.mtime_ns >= 0 &&
+            cached->dir_mtime_ns == st.mtime_ns &&
+            time(NULL) - cached->created < config.listing_cache_ttl) {
+            atomic_fetch_add(&cached->refs, 1);
+            LeaveCriticalSection(&listing_cs);
+            return cached;
+        }
+        LeaveCriticalSection(&listing_cs);
+    }
+
+    Listing* listing = render_listing(session, native_dir, st.mtime_ns);
+    if (listing && slot && st.mtime_ns >= 0) {
+        atomic_fetch_add(&listing->refs, 1);
+        EnterCriticalSection(&listing_cs);
+        Listing* old = *slot;
+        *slot = listing;
+        LeaveCriticalSection(&listing_cs);
+        listing_release(old);
+    }
+    return listing;
+}
+
+// Descarta el listado cacheado del directorio que contiene 'vpath'
+void listing_invalidate(ClientSession* session, const char* vpath) {
+    if (!listing_cache) return;
+
+    char parent[MAX_PATH_LEN];
+    char native_dir[MAX_PATH_LEN * 2];
+    vfs_parent(vpath, parent, sizeof(parent));
+    vfs_native_path(session, parent, native_dir, sizeof(native_dir));
+
+    Listing** slot = &listing_cache[hash_string(native_dir) % (unsigned)config.listing_cache_entries];
+    Listing* old = NULL;
+    EnterCriticalSection(&listing_cs);
+    if (*slot && strcmp((*slot)->path, native_dir) == 0) {
+        old = *slot;
+        *slot = NULL;
+    }
+    LeaveCriticalSection(&listing_cs);
+    listing_release(old);
+}
+
+// ==================== ÍNDICE RECURSIVO (SITE FIND / LIST -R) ====================
+// Índice en memoria del árbol completo de cada home (rutas, tamaños y
+// fechas), compartido por todas las sesiones del mismo home. Se construye la
+// primera vez que se necesita y después se mantiene al día entrada por
+// entrada: STOR/APPE/DELE actualizan la suya al terminar y, en Linux,
+// inotify (un watch por directorio) refleja los cambios hechos fuera del
+// servidor. SITE FIND y LIST -R recorren el índice sin tocar el disco.
+// Sin inotify (o sin watches disponibles) el índice se reconstruye cuando
+// tiene más de TREE_INDEX_REBUILD_S segundos.
+// Los homes empaquetados no lo necesitan: se recorre el propio paquete.
+
+#define TREE_INDEX_REBUILD_S 60
+#define TREE_FIND_MAX_RESULTS 10000 // Coincidencias enviadas por SITE FIND
+
+enum { TREE_EMPTY, TREE_READY, TREE_TOO_LARGE };
+
+typedef struct TreeNode {
+    char* path;                 // Ruta virtual completa ("/docs/a.txt")
+    const char* name;           // Último componente (apunta dentro de path)
+    long long size;
+    time_t mtime;
+    int is_dir;
+    int wd;                     // Watch de inotify del directorio (-1 = ninguno)
+    struct TreeNode* parent;
+    struct TreeNode* children;
+    struct TreeNode* prev;      // Hermanos dentro del mismo directorio
+    struct TreeNode* next;
+    struct TreeNode* hash_next; // Encadenamiento en la tabla por ruta
+} TreeNode;
+
+typedef struct TreeIndex {
+    char home[MAX_PATH_LEN];    // Ruta real del home
+    CRITICAL_SECTION cs;        // Protege todo el árbol
+    TreeNode** buckets;
+    unsigned mask;              // Número de cubetas - 1 (potencia de 2)
+    long long count;
+    TreeNode* root;
+    int state;                  // TREE_EMPTY / TREE_READY / TREE_TOO_LARGE
+    int unwatched;              // Algún directorio sin watch: se reconstruye por antigüedad
+    time_t built;
+    struct TreeIndex* next;
+} TreeIndex;
+
+TreeIndex* tree_indexes = NULL; // Uno por home; viven mientras el servidor
+CRITICAL_SECTION tree_registry_cs;
+
+#ifdef __linux__
+// Watch de inotify -> índice y directorio. El índice se bloquea después de
+// soltar tree_watch_cs, así que se guarda la ruta y no el nodo. El kernel
+// no reutiliza los números de watch, así que se guardan en una tabla hash
+// (y no en un arreglo indexado por wd) para que ocupe sólo lo vigilado.
+typedef struct TreeWatch {
+    int wd;
+    TreeIndex* index;
+    char* vpath;
+    struct TreeWatch* next;
+} TreeWatch;
+
+#define TREE_WATCH_BUCKETS 1024 // Cubetas iniciales (potencia de 2)
+
+int tree_inotify_fd = -1;
+TreeWatch** tree_watch_buckets = NULL;
+unsigned tree_watch_mask = 0;
+unsigned tree_watch_count = 0;
+CRITICAL_SECTION tree_watch_cs;
+#endif
+
+// Visitante de un recorrido: name == NULL marca el comienzo del directorio 'dir'
+typedef void (*TreeVisitor)(void* ctx, const char* dir, const char* name, int is_dir, long long size, time_t mtime);
+
+static TreeNode** tree_slot(TreeIndex* index, const char* path) {
+    TreeNode** slot = &index->buckets[hash_string(path) & index->mask];
+    while (*slot && strcmp((*slot)->path, path) != 0) {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+static void tree_grow(TreeIndex* index) {
+    unsigned buckets = (index->mask + 1) * 2;
+    TreeNode** grown = (TreeNode**)calloc(buckets, sizeof(TreeNode*));
+    if (!grown) return; // Se sigue con cadenas más largas
+    for (unsigned b = 0; b <= index->mask; b++) {
+        TreeNode* node = index->buckets[b];
+        while (node) {
+            TreeNode* next = node->hash_next;
+            unsigned slot = hash_string(node->path) & (buckets - 1);
+            node->hash_next = grown[slot];
+            grown[slot] = node;
+            node = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = grown;
+    index->mask = buckets - 1;
+}
+
+#ifdef __linux__
+// Las tres funciones siguientes se llaman con tree_watch_cs tomado
+static TreeWatch** tree_watch_slot(int wd) {
+    TreeWatch** slot = &tree_watch_buckets[(unsigned)wd & tree_watch_mask];
+    while (*slot && (*slot)->wd != wd) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void tree_watch_grow(void) {
+    unsigned buckets = (tree_watch_mask + 1) * 2;
+    TreeWatch** grown = (TreeWatch**)calloc(buckets, sizeof(TreeWatch*));
+    if (!grown) return; // Se sigue con cadenas más largas
+    for (unsigned b = 0; b <= tree_watch_mask; b++) {
+        TreeWatch* watch = tree_watch_buckets[b];
+        while (watch) {
+            TreeWatch* next = watch->next;
+            unsigned slot = (unsigned)watch->wd & (buckets - 1);
+            watch->next = grown[slot];
+            grown[slot] = watch;
+            watch = next;
+        }
+    }
+    free(tree_watch_buckets);
+    tree_watch_buckets = grown;
+    tree_watch_mask = buckets - 1;
+}
+
+static void tree_watch_forget(int wd) {
+    TreeWatch** slot = tree_watch_slot(wd);
+    TreeWatch* watch = *slot;
+    if (!watch) return;
+    *slot = watch->next;
+    free(watch->vpath);
+    free(watch);
+    tree_watch_count--;
+}
+#endif
+
+static void tree_unwatch(TreeNode* node) {
+#ifdef __linux__
+    if (node->wd < 0) return;
+    inotify_rm_watch(tree_inotify_fd, node->wd);
+    EnterCriticalSection(&tree_watch_cs);
+    tree_watch_forget(node->wd);
+    LeaveCriticalSection(&tree_watch_cs);
+    node->wd = -1;
+#else
+    (void)node;
+#endif
+}
+
+// Vigila el directorio de 'node' (Linux); sin watch el índice queda "unwatched"
+static void tree_watch(TreeIndex* index, TreeNode* node, const char* native) {
+#ifdef __linux__
+    if (tree_inotify_fd >= 0) {
+        int wd = inotify_add_watch(tree_inotify_fd, native,
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+                                   IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW);
+        if (wd >= 0) {
+            char* vpath = strdup(node->path);
+            EnterCriticalSection(&tree_watch_cs);
+            if (tree_watch_count > tree_watch_mask) tree_watch_grow();
+            TreeWatch** slot = tree_watch_slot(wd);
+            TreeWatch* watch = *slot;
+            if (!watch && vpath && (watch = (TreeWatch*)calloc(1, sizeof(TreeWatch)))) {
+                watch->wd = wd;
+                *slot = watch;
+                tree_watch_count++;
+            }
+            if (watch && vpath) {
+                // El mismo directorio vigilado otra vez devuelve el mismo wd
+                free(watch->vpath);
+                watch->index = index;
+                watch->vpath = vpath;
+                node->wd = wd;
+            } else {
+                free(vpath);
+            }
+            LeaveCriticalSection(&tree_watch_cs);
+            if (node->wd >= 0) return;
+            inotify_rm_watch(tree_inotify_fd, wd);
+        }
+    }
+#else
+    (void)node;
+    (void)native;
+#endif
+    index->unwatched = 1;
+}
+
+// Añade (o actualiza) la entrada 'name' dentro del directorio 'parent'
+static TreeNode* tree_put(TreeIndex* index, TreeNode* parent, const char* name, int is_dir, long long size,
+                          time_t mtime) {
+    char path[MAX_PATH_LEN];
+    int len = snprintf(path, sizeof(path), "%s/%s", parent && strcmp(parent->path, "/") != 0 ? parent->path : "",
+                       name);
+    if (!parent) len = snprintf(path, sizeof(path), "/");
+    if (len < 0 || len >= (int)sizeof(path)) return NULL;
+
+    TreeNode** slot = tree_slot(index, path);
+    TreeNode* node = *slot;
+    if (!node) {
+        node = (TreeNode*)calloc(1, sizeof(TreeNode));
+        if (!node || !(node->path = strdup(path))) {
+            free(node);
+            return NULL;
+        }
+        node->name = strrchr(node->path, '/') + 1;
+        node->wd = -1;
+        node->parent = parent;
+        if (parent) {
+            node->next = parent->children;
+            if (parent->children) parent->children->prev = node;
+            parent->children = node;
+        }
+        *slot = node;
+        index->count++;
+        atomic_fetch_add(&tree_index_entries, 1);
+        if (index->count > (long long)index->mask + 1) tree_grow(index);
+    }
+    node->is_dir = is_dir;
+    node->size = is_dir ? 0 : size;
+    node->mtime = mtime;
+    return node;
+}
+
+// Quita 'node' y todo lo que cuelga de él
+static void tree_remove(TreeIndex* index, TreeNode* node) {
+    while (node->children) {
+        tree_remove(index, node->children);
+    }
+    tree_unwatch(node);
+    if (node->prev) node->prev->next = node->next;
+    else if (node->parent) node->parent->children = node->next;
+    if (node->next) node->next->prev = node->prev;
+
+    TreeNode** slot = tree_slot(index, node->path);
+    if (*slot == node) *slot = node->hash_next;
+    index->count--;
+    atomic_fetch_sub(&tree_index_entries, 1);
+    free(node->path);
+    free(node);
+}
+
+static void tree_clear(TreeIndex* index) {
+    if (index->root) tree_remove(index, index->root);
+    index->root = NULL;
+    index->state = TREE_EMPTY;
+    index->unwatched = 0;
+}
+
+// Datos de una ruta real; los enlaces simbólicos se indexan pero no se recorren
+static int tree_stat(const char* native, int* is_dir, long long* size, time_t* mtime, int* follow) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(native, GetFileExInfoStandard, &data)) return -1;
+    ULARGE_INTEGER t;
+    t.LowPart = data.ftLastWriteTime.dwLowDateTime;
+    t.HighPart = data.ftLastWriteTime.dwHighDateTime;
+    *is_dir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    *size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    *mtime = (time_t)((t.QuadPart - 116444736000000000ULL) / 10000000ULL);
+    *follow = *is_dir && !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
+#else
+    struct stat st;
+    if (lstat(native, &st) != 0) return -1;
+    *follow = S_ISDIR(st.st_mode);
+    if (S_ISLNK(st.st_mode) && stat(native, &st) != 0) return -1;
+    *is_dir = S_ISDIR(st.st_mode);
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+#endif
+    return 0;
+}
+
+// Indexa recursivamente el contenido del directorio 'dir'. El watch se pone
+// antes de leerlo para no perder cambios hechos durante el recorrido.
+static int tree_scan(TreeIndex* index, TreeNode* dir) {
+    char native[MAX_PATH_LEN * 2];
+    snprintf(native, sizeof(native), "%s%s", index->home, strcmp(dir->path, "/") == 0 ? "" : dir->path);
+    to_native_path(native);
+    tree_watch(index, dir, native);
+
+#ifdef _WIN32
+    char search_path[MAX_PATH_LEN * 2 + 4];
+    snprintf(search_path, sizeof(search_path), "%s\\*", native);
+    WIN32_FIND_DATAA find_data;
+    HANDLE hFind = FindFirstFileA(search_path, &find_data);
+    if (hFind == INVALID_HANDLE_VALUE) return 0;
+    do {
+        const char* name = find_data.cFileName;
+#else
+    DIR* handle = opendir(native);
+    struct dirent* entry;
+    if (!handle) return 0;
+    while ((entry = readdir(handle)) != NULL) {
+        const char* name = entry->d_name;
+#endif
+        char child_native[MAX_PATH_LEN * 2];
+        int is_dir, follow;
+        long long size;
+        time_t mtime;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || is_internal_file(name) ||
+            snprintf(child_native, sizeof(child_native), "%s%c%s", native, PATH_SEP, name) >= (int)sizeof(child_native) ||
+            tree_stat(child_native, &is_dir, &size, &mtime, &follow) != 0) {
+            continue;
+        }
+        TreeNode* child = tree_put(index, dir, name, is_dir, size, mtime);
+        if (index->count > config.tree_index_max_entries ||
+            (child && follow && tree_scan(index, child) != 0)) {
+#ifdef _WIN32
+            FindClose(hFind);
+#else
+            closedir(handle);
+#endif
+            return -1;
+        }
+#ifdef _WIN32
+    } while (FindNextFileA(hFind, &find_data));
+    FindClose(hFind);
+#else
+    }
+    closedir(handle);
+#endif
+    return 0;
+}
+
+// Reconstruye el índice completo (con index->cs tomado)
+static void tree_build(TreeIndex* index) {
+    long long start = now_us();
+    tree_clear(index);
+    index->built = time(NULL);
+    atomic_fetch_add(&tree_index_builds, 1);
+
+    int is_dir, follow;
+    long long size;
+    time_t mtime;
+    if (tree_stat(index->home, &is_dir, &size, &mtime, &follow) != 0 || !is_dir) return;
+    index->root = tree_put(index, NULL, "", 1, 0, mtime);
+    if (!index->root) return;
+    if (tree_scan(index, index->root) != 0) {
+        tree_clear(index);
+        index->state = TREE_TOO_LARGE;
+        printf("Índice de %s: más de %d entradas, desactivado\n", index->home, config.tree_index_max_entries);
+        return;
+    }
+    index->state = TREE_READY;
+    printf("Índice de %s: %lld entradas en %lld ms\n", index->home, index->count, (now_us() - start) / 1000);
+}
+
+// Índice del home de la sesión (NULL si no existe y 'create' es 0)
+static TreeIndex* tree_index_find(ClientSession* session, int create) {
+    EnterCriticalSection(&tree_registry_cs);
+    TreeIndex* index = tree_indexes;
+    while (index && strcmp(index->home, session->home_path) != 0) {
+        index = index->next;
+    }
+    if (!index && create && (index = (TreeIndex*)calloc(1, sizeof(TreeIndex))) != NULL) {
+        snprintf(index->home, sizeof(index->home), "%s", session->home_path);
+        InitializeCriticalSection(&index->cs);
+        index->mask = 1023;
+        index->buckets = (TreeNode**)calloc(index->mask + 1, sizeof(TreeNode*));
+        if (!index->buckets) {
+            free(index);
+            index = NULL;
+        } else {
+            index->next = tree_indexes;
+            tree_indexes = index;
+        }
+    }
+    LeaveCriticalSection(&tree_registry_cs);
+    return index;
+}
+
+// Índice listo del home de la sesión, devuelto con index->cs tomado
+// (NULL si está desactivado o el árbol supera tree_index_max_entries)
+static TreeIndex* tree_index_acquire(ClientSession* session) {
+    if (config.tree_index_max_entries <= 0) return NULL;
+    TreeIndex* index = tree_index_find(session, 1);
+    if (!index) return NULL;
+
+    EnterCriticalSection(&index->cs);
+    int stale = time(NULL) - index->built >= TREE_INDEX_REBUILD_S;
+    if (index->state == TREE_EMPTY || (stale && (index->state == TREE_TOO_LARGE || index->unwatched))) {
+        tree_build(index);
+    }
+    if (index->state != TREE_READY) {
+        LeaveCriticalSection(&index->cs);
+        return NULL;
+    }
+    return index;
+}
+
+// Vuelve a leer 'vpath' del disco y actualiza (o quita) su entrada; un
+// directorio nuevo se indexa completo
+static void tree_refresh(TreeIndex* index, const char* vpath) {
+    char parent_path[MAX_PATH_LEN];
+    char native[MAX_PATH_LEN * 2];
+    const char* name = strrchr(vpath, '/');
+    if (index->state != TREE_READY || !name || is_internal_file(name + 1) || strcmp(vpath, "/") == 0) return;
+
+    vfs_parent(vpath, parent_path, sizeof(parent_path));
+    TreeNode* parent = *tree_slot(index, parent_path);
+    TreeNode* node = *tree_slot(index, vpath);
+    snprintf(native, sizeof(native), "%s%s", index->home, vpath);
+    to_native_path(native);
+
+    int is_dir, follow;
+    long long size;
+    time_t mtime;
+    if (!parent || tree_stat(native, &is_dir, &size, &mtime, &follow) != 0) {
+        if (node) tree_remove(index, node);
+        return;
+    }
+    if (node && node->is_dir != is_dir) {
+        tree_remove(index, node);
+        node = NULL;
+    }
+    int created = node == NULL;
+    node = tree_put(index, parent, name + 1, is_dir, size, mtime);
+    if (node && created && follow && tree_scan(index, node) != 0) {
+        tree_clear(index);
+        index->state = TREE_TOO_LARGE;
+    }
+}
+
+// Refleja en el índice (si existe) un cambio hecho por la sesión en 'vpath'
+void tree_index_touch(ClientSession* session, const char* vpath) {
+    TreeIndex* index = session->pack ? NULL : tree_index_find(session, 0);
+    if (!index) return;
+    EnterCriticalSection(&index->cs);
+    tree_refresh(index, vpath);
+    LeaveCriticalSection(&index->cs);
+}
+
+#ifdef __linux__
+// Aplica los eventos de inotify a los índices
+DWORD WINAPI tree_watcher(LPVOID param) {
+    (void)param;
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        int len = read(tree_inotify_fd, events, sizeof(events));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            break;
+        }
+        for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Se perdieron eventos: todos los índices se reconstruyen al usarse
+                EnterCriticalSection(&tree_registry_cs);
+                for (TreeIndex* index = tree_indexes; index; index = index->next) {
+                    EnterCriticalSection(&index->cs);
+                    tree_clear(index);
+                    LeaveCriticalSection(&index->cs);
+                }
+                LeaveCriticalSection(&tree_registry_cs);
+                continue;
+            }
+
+            TreeIndex* index = NULL;
+            char vpath[MAX_PATH_LEN] = "";
+            EnterCriticalSection(&tree_watch_cs);
+            TreeWatch* watch = *tree_watch_slot(ev->wd);
+            if (watch && (ev->mask & IN_IGNORED)) {
+                // El kernel ya quitó el watch (directorio borrado)
+                tree_watch_forget(ev->wd);
+            } else if (watch && ev->len > 0) {
+                index = watch->index;
+                const char* dir = watch->vpath;
+                snprintf(vpath, sizeof(vpath), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, ev->name);
+            }
+            LeaveCriticalSection(&tree_watch_cs);
+            if (!index || !vpath[0]) continue;
+
+            EnterCriticalSection(&index->cs);
+            tree_refresh(index, vpath);
+            LeaveCriticalSection(&index->cs);
+        }
+    }
+    return 0;
+}
+#endif
+
+void tree_index_init(void) {
+    InitializeCriticalSection(&tree_registry_cs);
+#ifdef __linux__
+    InitializeCriticalSection(&tree_watch_cs);
+    tree_watch_buckets = (TreeWatch**)calloc(TREE_WATCH_BUCKETS, sizeof(TreeWatch*));
+    tree_watch_mask = TREE_WATCH_BUCKETS - 1;
+    if (tree_watch_buckets && config.tree_index_max_entries > 0 &&
+        (tree_inotify_fd = inotify_init1(IN_CLOEXEC)) >= 0 && !spawn_thread(tree_watcher, NULL)) {
+        close(tree_inotify_fd);
+        tree_inotify_fd = -1;
+    }
+#endif
+}
+
+// Recorre el árbol del paquete desde 'dir' (ruta virtual 'dir_vpath')
+static void tree_walk_pack(const Pack* pack, const PackEntry* dir, const char* dir_vpath, TreeVisitor visit,
+                           void* ctx) {
+    char name[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    visit(ctx, dir_vpath, NULL, 1, 0, (time_t)dir->mtime);
+    for (unsigned int i = 0; i < dir->child_count; i++) {
+        const PackEntry* e = &pack->entries[dir->first_child + i];
+        snprintf(name, sizeof(name), "%.*s", (int)e->name_len, pack->names + e->name);
+        visit(ctx, dir_vpath, name, e->is_dir, e->size, (time_t)e->mtime);
+    }
+    for (unsigned int i = 0; i < dir->child_count; i++) {
+        const PackEntry* e = &pack->entries[dir->first_child + i];
+        if (!e->is_dir) continue;
+        int len = snprintf(path, sizeof(path), "%s/%.*s", strcmp(dir_vpath, "/") == 0 ? "" : dir_vpath,
+                           (int)e->name_len, pack->names + e->name);
+        if (len > 0 && len < (int)sizeof(path)) tree_walk_pack(pack, e, path, visit, ctx);
+    }
+}
+
+static void tree_walk_node(const TreeNode* dir, TreeVisitor visit, void* ctx) {
+    visit(ctx, dir->path, NULL, 1, 0, dir->mtime);
+    for (const TreeNode* child = dir->children; child; child = child->next) {
+        visit(ctx, dir->path, child->name, child->is_dir, child->size, child->mtime);
+    }
+    for (const TreeNode* child = dir->children; child; child = child->next) {
+        if (child->is_dir) tree_walk_node(child, visit, ctx);
+    }
+}
+
+// Recorre el árbol bajo 'vpath': cada directorio se anuncia y luego sus
+// entradas, antes de bajar a sus subdirectorios (el orden de "ls -R").
+// 0 = hecho, -1 = no existe, -2 = sin índice disponible.
+int tree_walk(ClientSession* session, const char* vpath, TreeVisitor visit, void* ctx) {
+    if (session->pack) {
+        const PackEntry* dir = pack_lookup(session->pack, vpath);
+        if (!dir || !dir->is_dir) return -1;
+        tree_walk_pack(session->pack, dir, vpath, visit, ctx);
+        return 0;
+    }
+
+    TreeIndex* index = tree_index_acquire(session);
+    if (!index) return -2;
+    TreeNode* dir = *tree_slot(index, vpath);
+    int result = dir && dir->is_dir ? 0 : -1;
+    if (result == 0) tree_walk_node(dir, visit, ctx);
+    LeaveCriticalSection(&index->cs);
+    return result;
+}
+
+// Comodines estilo shell: '*', '?' y clases [abc], [a-z], [!abc]
+int glob_match(const char* pattern, const char* text) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*text) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+            continue;
+        }
+        if (*pattern == '[') {
+            const char* p = pattern + 1;
+            int negate = *p == '!' || *p == '^';
+            int matched = 0;
+            if (negate) p++;
+            do {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    if ((unsigned char)*text >= (unsigned char)p[0] && (unsigned char)*text <= (unsigned char)p[2]) {
+                        matched = 1;
+                    }
+                    p += 3;
+                } else {
+                    if (*p == *text) matched = 1;
+                    p++;
+                }
+            } while (*p && *p != ']');
+            if (*p == ']' && matched != negate) {
+                pattern = p + 1;
+                text++;
+                continue;
+            }
+        } else if (*pattern && (*pattern == '?' || *pattern == *text)) {
+            pattern++;
+            text++;
+            continue;
+        }
+        if (!star) return 0;
+        pattern = star + 1;
+        text = ++resume;
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+typedef struct {
+    const char* pattern;
+    int by_path;      // El patrón tiene '/': se compara con la ruta completa
+    TextBuffer out;
+    long long matches;
+} FindContext;
+
+static void find_visit(void* ctx, const char* dir, const char* name, int is_dir, long long size, time_t mtime) {
+    FindContext* find = (FindContext*)ctx;
+    char path[MAX_PATH_LEN * 2];
+    if (!name) return;
+    snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    if (!glob_match(find->pattern, find->by_path ? path : name)) return;
+    if (++find->matches > TREE_FIND_MAX_RESULTS) return;
+
+    // Una línea por coincidencia con los hechos de MLSD y la ruta virtual
+    char line[MAX_PATH_LEN * 2 + 96];
+    struct tm ut;
+    utc_tm(mtime, &ut);
+    int len = is_dir
+        ? snprintf(line, sizeof(line), " type=dir;modify=%04d%02d%02d%02d%02d%02d; %s\r\n",
+                   ut.tm_year + 1900, ut.tm_mon + 1, ut.tm_mday, ut.tm_hour, ut.tm_min, ut.tm_sec, path)
+        : snprintf(line, sizeof(line), " type=file;size=%lld;modify=%04d%02d%02d%02d%02d%02d; %s\r\n", size,
+                   ut.tm_year + 1900, ut.tm_mon + 1, ut.tm_mday, ut.tm_hour, ut.tm_min, ut.tm_sec, path);
+    if (len > 0 && len < (int)sizeof(line)) text_append(&find->out, line, len);
+}
+
+// SITE FIND <glob>: busca bajo el directorio actual en el índice
+void handle_site_find(ClientSession* session, const char* pattern) {
+    while (*pattern == ' ') pattern++;
+    if (*pattern == '\0') {
+        send_response(session->ctrl_sock, "501", "Usage: SITE FIND <glob>.");
+        log_message(session->client_ip, session->client_port, "SITE", "501", 0, 0);
+        return;
+    }
+
+    long long start = now_us();
+    FindContext find;
+    memset(&find, 0, sizeof(find));
+    find.pattern = pattern;
+    find.by_path = strchr(pattern, '/') != NULL;
+    char header[MAX_PATH_LEN + 32];
+    int len = snprintf(header, sizeof(header), "200-Matches for %s:\r\n", pattern);
+    text_append(&find.out, header, len);
+
+    int result = tree_walk(session, session->current_dir, find_visit, &find);
+    long duration = (long)((now_us() - start) / 1000);
+    if (result != 0) {
+        free(find.out.data);
+        send_response(session->ctrl_sock, result == -2 ? "450" : "550",
+                      result == -2 ? "Tree index unavailable." : "Directory not found.");
+        log_message(session->client_ip, session->client_port, "SITE", result == -2 ? "450" : "550", duration, 0);
+        return;
+    }
+
+    char footer[128];
+    if (find.matches > TREE_FIND_MAX_RESULTS) {
+        len = snprintf(footer, sizeof(footer), "200 %lld matches in %.3f ms (first %d shown).\r\n", find.matches,
+                       (now_us() - start) / 1000.0, TREE_FIND_MAX_RESULTS);
+    } else {
+        len = snprintf(footer, sizeof(footer), "200 %lld matches in %.3f ms.\r\n", find.matches,
+                       (now_us() - start) / 1000.0);
+    }
+    text_append(&find.out, footer, len);
+    if (find.out.data) send_all(session->ctrl_sock, find.out.data, (int)find.out.len);
+    printf(">> 200 %lld matches for %s\n", find.matches, pattern);
+    free(find.out.data);
+    log_message(session->client_ip, session->client_port, "SITE", "200", duration, (long)find.matches);
+}
+
+typedef struct {
+    const char* base; // Directorio desde el que se lista (se muestra como ".")
+    TextBuffer out;
+    int dirs;
+} ListRContext;
+
+static void list_r_visit(void* ctx, const char* dir, const char* name, int is_dir, long long size, time_t mtime) {
+    ListRContext* list = (ListRContext*)ctx;
+    if (name) {
+        listing_add_entry(&list->out, NULL, name, is_dir, size, mtime);
+        return;
+    }
+    // Cabecera de cada directorio, relativa al de partida como en "ls -R"
+    char line[MAX_PATH_LEN + 16];
+    size_t base_len = strcmp(list->base, "/") == 0 ? 0 : strlen(list->base);
+    int len = snprintf(line, sizeof(line), "%s.%s:\r\n", list->dirs++ ? "\r\n" : "", dir + base_len);
+    if (strcmp(dir, list->base) == 0) len = snprintf(line, sizeof(line), ".:\r\n");
+    if (len > 0 && len < (int)sizeof(line)) text_append(&list->out, line, len);
+}
+
+// STAT sin argumentos y SITE METRICS: métricas en una respuesta multilínea
+void handle_stat(ClientSession* session) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    TextBuffer text = { NULL, 0, 0 };
+    const char* header = "211-Server metrics:\r\n";
+    const char* footer = "211 End\r\n";
+    text_append(&text, header, strlen(header));
+    EnterCriticalSection(&metrics_render_cs);
+    render_metrics(&text, " ", "\r\n");
+    LeaveCriticalSection(&metrics_render_cs);
+    text_append(&text, footer, strlen(footer));
+
+    if (text.data) send_all(session->ctrl_sock, text.data, (int)text.len);
+    printf(">> 211 Server metrics (%d bytes)\n", (int)text.len);
+    free(text.data);
+    log_message(session->client_ip, session->client_port, "STAT", "211", 0, 0);
+}
+
+// SITE <subcomando>: comandos propios del servidor
+void handle_site(ClientSession* session, const char* arg) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    char buffer[BUFFER_SIZE];
+    if (strncasecmp(arg, "POOL", 4) == 0) {
+        // Ocupación del pool de puertos pasivos
+        snprintf(buffer, sizeof(buffer), "PASV pool: %d/%d in use, peak %d.",
+                 atomic_load(&pasv_in_use), pasv_pool_size, atomic_load(&pasv_peak));
+        send_response(session->ctrl_sock, "200", buffer);
+        log_message(session->client_ip, session->client_port, "SITE", "200", 0, 0);
+    } else if (strncasecmp(arg, "METRICS", 7) == 0) {
+        handle_stat(session);
+    } else if (strncasecmp(arg, "FIND", 4) == 0 && (arg[4] == '\0' || arg[4] == ' ')) {
+        handle_site_find(session, arg + 4);
+    } else {
+        send_response(session->ctrl_sock, "501", "Unknown SITE command.");
+        log_message(session->client_ip, session->client_port, "SITE", "501", 0, 0);
+    }
+}
+
+// ==================== MODE Z ====================
+// Compresión deflate (zlib) del canal de datos. Los archivos que ya vienen
+// comprimidos se envían en bloques "stored" (nivel 0): el stream sigue
+// siendo válido para el cliente pero no se gasta CPU en recomprimirlos.
+
+typedef struct {
+    z_stream z;
+    int deflating;   // 1 = comprime (envío), 0 = descomprime (recepción)
+    int ended;       // Recepción: llegó el final del stream zlib
+    int truncated;   // Recepción: el cliente cerró antes del final del stream
+    int corrupt;     // Recepción: zlib rechazó los datos
+    long long wire;  // Bytes comprimidos que pasaron por el socket
+    long long cpu_start;
+    unsigned char buf[ZBUF_SIZE];
+} ZStream;
+
+// Tiempo de CPU consumido por el hilo actual en µs
+long long thread_cpu_us(void) {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (long long)((k.QuadPart + u.QuadPart) / 10);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+// 1 si vale la pena comprimir 'name' (su extensión no está en deflate_skip_ext)
+int deflate_worthwhile(const char* name) {
+    const char* dot = strrchr(name, '.');
+    if (!dot || strchr(dot, '/')) return 1;
+    size_t len = strlen(dot + 1);
+    for (const char* p = config.deflate_skip_ext; *p;) {
+        size_t n = strcspn(p, ", ");
+        if (n == len && strncasecmp(p, dot + 1, n) == 0) return 0;
+        p += n;
+        while (*p == ',' || *p == ' ') p++;
+    }
+    return 1;
+}
+
+int zstream_begin(ZStream* zs, int deflating, int level) {
+    memset(&zs->z, 0, sizeof(zs->z));
+    zs->deflating = deflating;
+    zs->ended = 0;
+    zs->truncated = 0;
+    zs->corrupt = 0;
+    zs->wire = 0;
+    zs->cpu_start = thread_cpu_us();
+    if (deflating) return deflateInit(&zs->z, level) == Z_OK ? 0 : -1;
+    return inflateInit(&zs->z) == Z_OK ? 0 : -1;
+}
+
+// Libera zlib y devuelve el tiempo de CPU del hilo durante la transferencia
+long long zstream_end(ZStream* zs) {
+    if (zs->deflating) deflateEnd(&zs->z);
+    else inflateEnd(&zs->z);
+    return thread_cpu_us() - zs->cpu_start;
+}
+
+// Comprime 'len' bytes y envía lo que zlib produzca; 'finish' cierra el stream
+int zstream_send(ZStream* zs, SOCKET sock, const char* data, size_t len, int finish, RateLimiter* rate) {
+    zs->z.next_in = (Bytef*)data;
+    zs->z.avail_in = (uInt)len;
+    int result;
+    do {
+        zs->z.next_out = zs->buf;
+        zs->z.avail_out = sizeof(zs->buf);
+        result = deflate(&zs->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_ERROR) return -1;
+        int have = (int)(sizeof(zs->buf) - zs->z.avail_out);
+        if (have > 0) {
+            if (send_all(sock, (const char*)zs->buf, have) < 0) return -1;
+            zs->wire += have;
+            rate_consume(rate, have);
+        }
+    } while (zs->z.avail_out == 0 || (finish && result != Z_STREAM_END));
+    return 0;
+}
+
+// Recibe y descomprime hasta 'len' bytes. Devuelve los bytes producidos,
+// 0 al final del stream (o si el cliente cerró) y -1 si los datos son inválidos.
+int zstream_recv(ZStream* zs, SOCKET sock, char* out, int len, RateLimiter* rate) {
+    if (zs->ended) return 0;
+    zs->z.next_out = (Bytef*)out;
+    zs->z.avail_out = (uInt)len;
+    while (zs->z.avail_out == (uInt)len) {
+        if (zs->z.avail_in == 0) {
+            int n = recv(sock, (char*)zs->buf, sizeof(zs->buf), 0);
+            if (n <= 0) {
+                zs->truncated = 1;
+                zs->ended = 1;
+                break;
+            }
+            zs->wire += n;
+            rate_consume(rate, n);
+            zs->z.next_in = zs->buf;
+            zs->z.avail_in = (uInt)n;
+        }
+        int result = inflate(&zs->z, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            zs->ended = 1;
+            break;
+        }
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            zs->corrupt = 1;
+            return -1;
+        }
+    }
+    return len - (int)zs->z.avail_out;
+}
+
+// Lectura del canal de datos de una subida, descomprimiendo si hay MODE Z
+int data_recv(SOCKET sock, ZStream* inflater, char* buf, int len, RateLimiter* rate) {
+    if (inflater) return zstream_recv(inflater, sock, buf, len, rate);
+    int n = recv(sock, buf, len, 0);
+    if (n > 0) rate_consume(rate, n);
+    return n;
+}
+
+// Envía el archivo desde 'offset' comprimido. Devuelve los bytes del archivo enviados o -1.
+long long send_file_deflated(SOCKET sock, ZStream* zs, FILE* file, long long offset, RateLimiter* rate) {
+    size_t buffer_size = (size_t)config.transfer_buffer_kb * 1024;
+    char* buffer = (char*)malloc(buffer_size);
+    if (!buffer) return -1;
+    if (offset > 0 && fseeko(file, offset, SEEK_SET) != 0) {
+        free(buffer);
+        return -1;
+    }
+
+    long long total = 0;
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, buffer_size, file)) > 0) {
+        if (zstream_send(zs, sock, buffer, bytes_read, 0, rate) != 0) {
+            free(buffer);
+            return -1;
+        }
+        total += bytes_read;
+    }
+    free(buffer);
+    return zstream_send(zs, sock, NULL, 0, 1, rate) == 0 ? total : -1;
+}
+
+// --- INICIO DE CORRECCIÓN PARA BUG 550 ---
+// LIST/NLST (mlsd = 0) o MLSD (mlsd = 1). "LIST -R" lista el árbol completo
+// desde el índice recursivo.
+void handle_list(ClientSession* session, int mlsd, const char* arg) {
+    const char* cmd_name = mlsd ? "MLSD" : "LIST";
+
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    if (session->pasv_sock == INVALID_SOCKET) {
+        send_response(session->ctrl_sock, "425", "Use PASV first.");
+        return;
+    }
+
+    send_response(session->ctrl_sock, "150", "Opening ASCII mode data connection for file list");
+
+    // Aceptar conexion de datos
+    session->data_sock = accept_data_connection(session);
+
+    if (session->data_sock == INVALID_SOCKET) {
+        send_response(session->ctrl_sock, "425", "Cannot open data connection.");
+        pasv_release(session);
+        return;
+    }
+
+    // Se lista el directorio actual de la sesión (desde la caché si sigue vigente)
+    long long start = now_us();
+    long total_size = 0;
+    int sent = -1;
+    ZStream zs;
+    zs.wire = 0;
+    long long cpu_us = 0;
+    metrics_transfer_begin();
+    Listing* listing = NULL;
+    const char* data = NULL;
+    ListRContext tree;
+    memset(&tree, 0, sizeof(tree));
+    if (!mlsd && arg[0] == '-' && strchr(arg, 'R')) {
+        // LIST -R: el árbol completo desde el índice (si no hay, el directorio actual)
+        tree.base = session->current_dir;
+        if (tree_walk(session, session->current_dir, list_r_visit, &tree) == 0 && tree.out.data) {
+            data = tree.out.data;
+            total_size = (long)tree.out.len;
+        }
+    }
+    if (!data && (listing = get_listing(session)) != NULL) {
+        data = mlsd ? listing->data + listing->list_len : listing->data;
+        total_size = (long)(mlsd ? listing->mlsd_len : listing->list_len);
+    }
+
+    if (data) {
+        if (session->mode_z) {
+            if (zstream_begin(&zs, 1, session->deflate_level) == 0) {
+                sent = zstream_send(&zs, session->data_sock, data, (size_t)total_size, 1, NULL);
+                cpu_us = zstream_end(&zs);
+            }
+        } else {
+            sent = total_size > 0 ? send_all(session->data_sock, data, (int)total_size) : 0;
+        }
+        listing_release(listing);
+    }
+    free(tree.out.data);
+
+    long long elapsed = now_us() - start;
+    long duration = (long)(elapsed / 1000);
+    metrics_transfer_end(sent < 0 ? 0 : total_size, 0, elapsed);
+
+    closesocket(session->data_sock);
+    session->data_sock = INVALID_SOCKET;
+    pasv_release(session);
+
+    if (sent < 0) {
+        send_response(session->ctrl_sock, "426", "Connection closed; transfer aborted.");
+        log_message(session->client_ip, session->client_port, cmd_name, "426", duration, 0);
+        return;
+    }
+
+    send_response(session->ctrl_sock, "226", "Directory send OK.");
+    if (session->mode_z) {
+        log_compressed(session->client_ip, session->client_port, cmd_name, "226", elapsed, total_size,
+                       zs.wire, cpu_us);
+    } else {
+        log_message(session->client_ip, session->client_port, cmd_name, "226", duration, total_size);
+    }
+}
+
+// Envía el archivo desde 'offset' hasta el final por el socket de datos.
+// Devuelve los bytes enviados o -1 si la conexión se cortó antes de terminar.
+// Con 'rate' el envío se hace en bloques pequeños al ritmo permitido.
+long long send_file_data(SOCKET sock, FILE* file, long long offset, RateLimiter* rate) {
+    long long total = 0;
+
+#ifdef __linux__
+    if (config.zero_copy) {
+        // Camino sin copias: el kernel pasa las páginas del archivo al socket
+        int fd = fileno(file);
+        off_t file_offset = (off_t)offset;
+        for (;;) {
+            ssize_t n = sendfile(sock, fd, &file_offset, (size_t)rate_chunk(rate, 1 << 30));
+            if (n > 0) {
+                total += n;
+                rate_consume(rate, n);
+                continue;
+            }
+            if (n == 0) return total; // Fin de archivo
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { sock, POLLOUT, 0 };
+                if (poll(&pfd, 1, 30000) > 0) continue;
+                return -1;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) && total == 0) {
+                break; // Sistema de archivos sin soporte: usar el camino con copia
+            }
+            return -1;
+        }
+    }
+#endif
+
+    size_t buffer_size = (size_t)config.transfer_buffer_kb * 1024;
+    char* buffer = (char*)malloc(buffer_size);
+    if (!buffer) return -1;
+    if (offset > 0 && fseeko(file, offset, SEEK_SET) != 0) {
+        free(buffer);
+        return -1;
+    }
+
+    size_t bytes_read;
+    size_t chunk = (size_t)rate_chunk(rate, (long long)buffer_size);
+    while ((bytes_read = fread(buffer, 1, chunk, file)) > 0) {
+        if (send_all(sock, buffer, (int)bytes_read) < 0) {
+            free(buffer);
+            return -1;
+        }
+        total += bytes_read;
+        rate_consume(rate, (long long)bytes_read);
+    }
+    free(buffer);
+    return total;
+}
+
+// Envía un bloque en memoria respetando el límite de ancho de banda
+long long send_paced(SOCKET sock, const char* data, long long len, RateLimiter* rate) {
+    long long sent = 0;
+    while (sent < len) {
+        long long chunk = rate_chunk(rate, len - sent);
+        if (chunk > (1 << 30)) chunk = 1 << 30;
+        if (send_all(sock, data + sent, (int)chunk) < 0) return -1;
+        sent += chunk;
+        rate_consume(rate, chunk);
+    }
+    return sent;
+}
+
+// Envía un archivo del paquete desde 'offset': sendfile() desde el propio
+// paquete (sin copias ni un open() por archivo) o, si no, desde el mapeo
+long long pack_send(SOCKET sock, const Pack* pack, const PackEntry* entry, long long offset, RateLimiter* rate) {
+    long long remaining = offset < entry->size ? entry->size - offset : 0;
+
+#ifdef __linux__
+    if (config.zero_copy) {
+        off_t file_offset = (off_t)(entry->offset + offset);
+        long long total = 0;
+        while (total < remaining) {
+            ssize_t n = sendfile(sock, pack->fd, &file_offset, (size_t)rate_chunk(rate, remaining - total));
+            if (n > 0) {
+                total += n;
+                rate_consume(rate, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct pollfd pfd = { sock, POLLOUT, 0 };
+                if (poll(&pfd, 1, 30000) > 0) continue;
+                return -1;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS) && total == 0) {
+                break; // Sin soporte: se envía desde el mapeo
+            }
+            return -1;
+        }
+        if (total == remaining) return total;
+    }
+#endif
+
+    return send_paced(sock, pack->base + entry->offset + offset, remaining, rate);
+}
+
+// --- INICIO DE CORRECCIÓN PARA BUG 550 ---
+// Devuelve el archivo desde la caché, cargándolo si es cacheable y no está
+// (o cambió). NULL si no es cacheable: RETR lo lee del disco como siempre.
+CachedFile* file_cache_load(ClientSession* session, const char* vpath) {
+    VfsStat st;
+    if (!file_cache || vfs_stat(session, vpath, &st) != 0 || st.is_dir || !file_cache_accepts(st.size)) {
+        return NULL;
+    }
+
+    char native[MAX_PATH_LEN * 2];
+    vfs_native_path(session, vpath, native, sizeof(native));
+    CachedFile* entry = file_cache_lookup(native, st.mtime_ns, st.size);
+    if (entry) return entry;
+
+    FILE* file = vfs_fopen(session, vpath, "rb");
+    if (!file) return NULL;
+    char* data = (char*)malloc(st.size > 0 ? (size_t)st.size : 1);
+    size_t read = data ? fread(data, 1, (size_t)st.size, file) : 0;
+    int complete = data && read == (size_t)st.size && fgetc(file) == EOF;
+    fclose(file);
+
+    // Si cambió mientras se leía no se cachea
+    if (!complete) {
+        free(data);
+        return NULL;
+    }
+    return file_cache_insert(native, st.mtime_ns, data, st.size);
+}
+
+void handle_retr(ClientSession* session, const char* filename) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    if (session->pasv_sock == INVALID_SOCKET) {
+        send_response(session->ctrl_sock, "425", "Use PASV first.");
+        return;
+    }
+
+    // Ruta resuelta contra el directorio actual de la sesión (acepta sub/archivo)
+    char vpath[MAX_PATH_LEN];
+    FILE* file = NULL;
+    CachedFile* cached = NULL;
+    const PackEntry* packed = NULL;
+    if (vfs_resolve(session, filename, vpath, sizeof(vpath)) == 0) {
+        if (session->pack) {
+            packed = pack_lookup(session->pack, vpath);
+            if (packed && packed->is_dir) packed = NULL;
+        } else {
+            cached = file_cache_load(session, vpath);
+            if (!cached) file = vfs_fopen(session, vpath, "rb");
+        }
+    }
+    if (!file && !cached && !packed) {
+        send_response(session->ctrl_sock, "550", "File not found.");
+        pasv_release(session);
+        return;
+    }
+
+    send_response(session->ctrl_sock, "150", "Opening BINARY mode data connection");
+
+    session->data_sock = accept_data_connection(session);
+
+    if (session->data_sock == INVALID_SOCKET) {
+        send_response(session->ctrl_sock, "425", "Cannot open data connection.");
+        if (file) fclose(file);
+        file_cache_release(cached);
+        pasv_release(session);
+        return;
+    }
+
+    long long start = now_us();
+    long long offset = session->rest_offset;
+    session->rest_offset = 0;
+    long long total_size;
+    RateLimiter limiter;
+    RateLimiter* rate = rate_begin(&limiter, session) ? &limiter : NULL;
+    ZStream* zs = NULL;
+    long long cpu_us = 0;
+    if (session->mode_z && (zs = (ZStream*)malloc(sizeof(ZStream))) != NULL &&
+        zstream_begin(zs, 1, deflate_worthwhile(vpath) ? session->deflate_level : Z_NO_COMPRESSION) != 0) {
+        free(zs);
+        zs = NULL;
+    }
+    metrics_transfer_begin();
+    // Desde la caché o el paquete el archivo ya está en memoria
+    const char* mem = cached ? cached->data : packed ? session->pack->base + packed->offset : NULL;
+    long long mem_size = cached ? cached->size : packed ? packed->size : 0;
+    if (session->mode_z && !zs) {
+        total_size = -1;
+    } else if (zs) {
+        // MODE Z: se comprime al vuelo (sin sendfile ni envío directo desde la caché)
+        if (mem) {
+            long long remaining = offset < mem_size ? mem_size - offset : 0;
+            total_size = zstream_send(zs, session->data_sock, mem + offset, (size_t)remaining, 1, rate) == 0
+                             ? remaining : -1;
+        } else {
+            total_size = send_file_deflated(session->data_sock, zs, file, offset, rate);
+        }
+        cpu_us = zstream_end(zs);
+    } else if (packed) {
+        total_size = pack_send(session->data_sock, session->pack, packed, offset, rate);
+    } else if (cached) {
+        // Acierto en caché: se envía directamente desde memoria
+        long long remaining = offset < cached->size ? cached->size - offset : 0;
+        total_size = send_paced(session->data_sock, cached->data + offset, remaining, rate);
+    } else {
+        total_size = send_file_data(session->data_sock, file, offset, rate);
+    }
+    if (rate) rate_end(rate);
+    long long duration = now_us() - start;
+    metrics_transfer_end(total_size, 0, duration);
+
+    if (file) fclose(file);
+    file_cache_release(cached);
+    closesocket(session->data_sock);
+    session->data_sock = INVALID_SOCKET;
+    pasv_release(session);
+
+    if (total_size < 0) {
+        send_response(session->ctrl_sock, "426", "Connection closed; transfer aborted.");
+        log_transfer(session->client_ip, session->client_port, "RETR", "426", duration, 0);
+        free(zs);
+        return;
+    }
+
+    send_response(session->ctrl_sock, "226", "Transfer complete.");
+    if (zs) {
+        log_compressed(session->client_ip, session->client_port, "RETR", "226", duration, total_size,
+                       zs->wire, cpu_us);
+    } else {
+        log_transfer(session->client_ip, session->client_port, "RETR", "226", duration, total_size);
+    }
+    free(zs);
+}
+
+// Ruta virtual del sidecar con los checksums de 'vpath': /dir/.nombre.sum
+int checksum_sidecar_path(const char* vpath, char* out, size_t size) {
+    char parent[MAX_PATH_LEN];
+    vfs_parent(vpath, parent, sizeof(parent));
+    int len = snprintf(out, size, "%s/.%s.sum", strcmp(parent, "/") == 0 ? "" : parent,
+                       strrchr(vpath, '/') + 1);
+    return len > 0 && len < (int)size ? 0 : -1;
+}
+
+// Guarda los checksums de un archivo recién escrito en memoria y en su sidecar
+void checksums_store(ClientSession* session, const char* vpath, const FileChecksums* sums) {
+    VfsStat st;
+    char native[MAX_PATH_LEN * 2];
+    char sidecar[MAX_PATH_LEN];
+    char sha_hex[65];
+    if (vfs_stat(session, vpath, &st) != 0 || checksum_sidecar_path(vpath, sidecar, sizeof(sidecar)) != 0) {
+        return;
+    }
+
+    vfs_native_path(session, vpath, native, sizeof(native));
+    checksum_cache_put(native, st.mtime_ns, st.size, sums);
+
+    FILE* f = vfs_fopen(session, sidecar, "wb");
+    if (f) {
+        sha256_hex(sums->sha256, sha_hex);
+        fprintf(f, "FTPSUM1 %lld %lld %08x %s\n", st.mtime_ns, st.size, sums->crc32c, sha_hex);
+        fclose(f);
+    }
+}
+
+// Checksums de un archivo: memoria, luego sidecar y, si ninguno sigue
+// vigente, se lee el archivo una vez y se guardan en ambos
+int checksums_get(ClientSession* session, const char* vpath, FileChecksums* out, long long* size) {
+    VfsStat st;
+    char native[MAX_PATH_LEN * 2];
+    char sidecar[MAX_PATH_LEN];
+    if (vfs_stat(session, vpath, &st) != 0 || st.is_dir) return -1;
+    *size = st.size;
+
+    vfs_native_path(session, vpath, native, sizeof(native));
+    if (checksum_cache_get(native, st.mtime_ns, st.size, out)) return 0;
+
+    if (checksum_sidecar_path(vpath, sidecar, sizeof(sidecar)) == 0) {
+        FILE* f = vfs_fopen(session, sidecar, "rb");
+        if (f) {
+            long long mtime_ns, file_size;
+            unsigned int crc;
+            char sha_hex[65];
+            int fields = fscanf(f, "FTPSUM1 %lld %lld %x %64s", &mtime_ns, &file_size, &crc, sha_hex);
+            fclose(f);
+            if (fields == 4 && mtime_ns == st.mtime_ns && file_size == st.size && strlen(sha_hex) == 64) {
+                out->crc32c = crc;
+                for (int i = 0; i < 32; i++) {
+                    unsigned int byte;
+                    sscanf(sha_hex + i * 2, "%2x", &byte);
+                    out->sha256[i] = (unsigned char)byte;
+                }
+                checksum_cache_put(native, st.mtime_ns, st.size, out);
+                return 0;
+            }
+        }
+    }
+
+    ChecksumState state;
+    if (session->pack) {
+        // Paquete: se calcula sobre el mapeo y sólo se recuerda en memoria
+        const PackEntry* entry = pack_lookup(session->pack, vpath);
+        if (!entry) return -1;
+        checksum_begin(&state);
+        checksum_update(&state, session->pack->base + entry->offset, (size_t)entry->size);
+        checksum_end(&state, out);
+        checksum_cache_put(native, st.mtime_ns, st.size, out);
+        return 0;
+    }
+
+    FILE* file = vfs_fopen(session, vpath, "rb");
+    if (!file) return -1;
+    size_t buffer_size = (size_t)config.transfer_buffer_kb * 1024;
+    char* buffer = (char*)malloc(buffer_size);
+    size_t n;
+    long long total = 0;
+    checksum_begin(&state);
+    while (buffer && (n = fread(buffer, 1, buffer_size, file)) > 0) {
+        checksum_update(&state, buffer, n);
+        total += n;
+    }
+    int failed = !buffer || ferror(file);
+    free(buffer);
+    fclose(file);
+    if (failed) return -1;
+
+    checksum_end(&state, out);
+    if (total == st.size) checksums_store(session, vpath, out);
+    *size = total;
+    return 0;
+}
+
+// ==================== SUBIDAS (write-behind) ====================
+// STOR se divide en dos etapas: el hilo de la sesión sólo llena buffers
+// grandes desde el socket y los encola; un hilo escritor por subida los
+// vacía a disco. Así una pausa del disco no deja de drenar el socket
+// mientras queden buffers libres en la cola (UPLOAD_QUEUE_DEPTH).
+// Los buffers salen de un pool global reutilizable (upload_pool_buffers);
+// si está agotado no se espera: el resto de la subida se copia directamente.
+
+typedef struct UploadBuffer {
+    char* data;
+    int len;
+    struct UploadBuffer* next;
+} UploadBuffer;
+
+UploadBuffer* upload_pool_free = NULL;
+int upload_pool_allocated = 0;
+CRITICAL_SECTION upload_pool_cs;
+atomic_uint upload_counter = 0;
+
+void upload_pool_init(void) {
+    InitializeCriticalSection(&upload_pool_cs);
+}
+
+// Toma un buffer del pool. NULL si ya están todos en uso o falta memoria.
+UploadBuffer* upload_buffer_get(void) {
+    size_t size = (size_t)config.transfer_buffer_kb * 1024;
+    EnterCriticalSection(&upload_pool_cs);
+    UploadBuffer* buf = upload_pool_free;
+    if (buf) {
+        upload_pool_free = buf->next;
+    } else if (upload_pool_allocated < config.upload_pool_buffers) {
+        upload_pool_allocated++;
+    } else {
+        LeaveCriticalSection(&upload_pool_cs);
+        return NULL;
+    }
+    LeaveCriticalSection(&upload_pool_cs);
+
+    if (!buf) {
+        buf = (UploadBuffer*)malloc(sizeof(UploadBuffer));
+        if (buf && !(buf->data = (char*)malloc(size))) {
+            free(buf);
+            buf = NULL;
+        }
+        if (!buf) {
+            EnterCriticalSection(&upload_pool_cs);
+            upload_pool_allocated--;
+            LeaveCriticalSection(&upload_pool_cs);
+            return NULL;
+        }
+    }
+    buf->len = 0;
+    return buf;
+}
+
+void upload_buffer_put(UploadBuffer* buf) {
+    EnterCriticalSection(&upload_pool_cs);
+    buf->next = upload_pool_free;
+    upload_pool_free = buf;
+    LeaveCriticalSection(&upload_pool_cs);
+}
+
+typedef struct {
+    FILE* file;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+    UploadBuffer* queue[UPLOAD_QUEUE_DEPTH];
+    int head;
+    int count;
+    int closed;      // La etapa de red no encolará más
+    int finished;    // El escritor terminó
+    int write_error;
+    long long written;
+    ChecksumState* checksum; // Checksums calculados al vuelo (NULL = no)
+} UploadPipe;
+
+DWORD WINAPI upload_writer(LPVOID param) {
+    UploadPipe* upload = (UploadPipe*)param;
+
+    EnterCriticalSection(&upload->lock);
+    while (1) {
+        while (upload->count == 0 && !upload->closed) {
+            SleepConditionVariableCS(&upload->changed, &upload->lock, INFINITE);
+        }
+        if (upload->count == 0) break;
+
+        UploadBuffer* buf = upload->queue[upload->head];
+        LeaveCriticalSection(&upload->lock);
+
+        // La escritura a disco se hace sin el lock: la red sigue encolando
+        if (upload->checksum) checksum_update(upload->checksum, buf->data, buf->len);
+        int ok = !upload->write_error && fwrite(buf->data, 1, buf->len, upload->file) == (size_t)buf->len;
+        upload_buffer_put(buf);
+
+        EnterCriticalSection(&upload->lock);
+        upload->head = (upload->head + 1) % UPLOAD_QUEUE_DEPTH;
+        upload->count--;
+        if (ok) upload->written += buf->len;
+        else upload->write_error = 1;
+        WakeAllConditionVariable(&upload->changed);
+    }
+    upload->finished = 1;
+    WakeAllConditionVariable(&upload->changed);
+    LeaveCriticalSection(&upload->lock);
+    return 0;
+}
+
+// Encola un buffer lleno; espera sólo si la cola está completa. Devuelve -1 si el disco falló.
+int upload_push(UploadPipe* upload, UploadBuffer* buf) {
+    EnterCriticalSection(&upload->lock);
+    while (upload->count == UPLOAD_QUEUE_DEPTH && !upload->write_error) {
+        SleepConditionVariableCS(&upload->changed, &upload->lock, INFINITE);
+    }
+    int error = upload->write_error;
+    if (!error) {
+        upload->queue[(upload->head + upload->count) % UPLOAD_QUEUE_DEPTH] = buf;
+        upload->count++;
+        WakeAllConditionVariable(&upload->changed);
+    }
+    LeaveCriticalSection(&upload->lock);
+    if (error) upload_buffer_put(buf);
+    return error ? -1 : 0;
+}
+
+// Recibe todo el canal de datos hacia 'file'. Devuelve los bytes recibidos;
+// '*write_error' indica si el disco falló (en ese caso se deja de leer).
+// Con 'checksum' se calculan CRC32C/SHA-256 de lo escrito en la etapa de disco.
+// Con 'rate' se deja de leer mientras se supere el límite (TCP frena al cliente).
+// Con 'inflater' (MODE Z) lo recibido se descomprime antes de escribirse.
+long long receive_upload(SOCKET sock, FILE* file, ChecksumState* checksum, int* write_error,
+                         RateLimiter* rate, ZStream* inflater) {
+    UploadPipe upload;
+    long long received = 0;
+    int use_pipeline = 1;
+    int eof = 0;
+
+    memset(&upload, 0, sizeof(upload));
+    upload.file = file;
+    upload.checksum = checksum;
+    InitializeCriticalSection(&upload.lock);
+    InitializeConditionVariable(&upload.changed);
+    if (!spawn_thread(upload_writer, &upload)) use_pipeline = 0;
+
+    *write_error = 0;
+    if (use_pipeline) {
+        size_t capacity = (size_t)config.transfer_buffer_kb * 1024;
+        while (!eof) {
+            UploadBuffer* buf = upload_buffer_get();
+            if (!buf) break; // Pool agotado: se sigue con la copia directa
+
+            // Se llena el buffer completo antes de entregarlo al escritor
+            while ((size_t)buf->len < capacity) {
+                int n = data_recv(sock, inflater, buf->data + buf->len,
+                                  (int)rate_chunk(rate, (long long)(capacity - buf->len)), rate);
+                if (n <= 0) {
+                    eof = 1;
+                    break;
+                }
+                buf->len += n;
+                received += n;
+            }
+            if (buf->len == 0) {
+                upload_buffer_put(buf);
+            } else if (upload_push(&upload, buf) != 0) {
+                break;
+            }
+        }
+
+        EnterCriticalSection(&upload.lock);
+        upload.closed = 1;
+        WakeAllConditionVariable(&upload.changed);
+        while (!upload.finished) {
+            SleepConditionVariableCS(&upload.changed, &upload.lock, INFINITE);
+        }
+        LeaveCriticalSection(&upload.lock);
+        *write_error = upload.write_error;
+    }
+
+    if (!eof && !*write_error) {
+        // Sin hilo escritor o sin buffers libres: copia directa con un buffer
+        // propio (la etapa de disco ya vació lo que tenía encolado)
+        char buffer[BUFFER_SIZE];
+        int n;
+        while ((n = data_recv(sock, inflater, buffer, (int)rate_chunk(rate, sizeof(buffer)), rate)) > 0) {
+            if (checksum) checksum_update(checksum, buffer, n);
+            if (fwrite(buffer, 1, n, file) != (size_t)n) {
+                *write_error = 1;
+                break;
+            }
+            received += n;
+        }
+    }
+
+    DeleteCriticalSection(&upload.lock);
+    return received;
+}
+
+// Reserva espacio para 'size' bytes (ALLO) y evita fragmentación en subidas grandes
+void preallocate_file(FILE* file, long long size) {
+#ifdef _WIN32
+    _chsize_s(_fileno(file), size);
+#else
+    posix_fallocate(fileno(file), 0, (off_t)size);
+#endif
+}
+
+// Deja el archivo con exactamente 'size' bytes (tras una reserva mayor que lo recibido)
+int truncate_file(FILE* file, long long size) {
+    if (fflush(file) != 0) return -1;
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(file), (off_t)size);
+#endif
+}
+
+// Temporal oculto junto a 'vpath' (/dir/.nombre.N.part): un rename sobre el destino es atómico
+int temp_vpath_for(const char* vpath, char* out, size_t size) {
+    char parent[MAX_PATH_LEN];
+    vfs_parent(vpath, parent, sizeof(parent));
+    int len = snprintf(out, size, "%s/.%s.%u.part", strcmp(parent, "/") == 0 ? "" : parent,
+                       strrchr(vpath, '/') + 1, atomic_fetch_add(&upload_counter, 1));
+    return len > 0 && len < (int)size ? 0 : -1;
+}
+
+// ==================== DEDUPLICACIÓN ====================
+// Con dedup=1 cada STOR completo queda como un enlace duro a un blob del
+// almacén (dedup_store/ab/<sha256>), compartido por todos los archivos con
+// el mismo contenido en cualquier home. El SHA-256 ya se calcula al recibir,
+// así que una subida repetida sólo cuesta crear el enlace. La cuenta de
+// referencias es la del propio sistema de archivos (enlaces del inodo):
+// cuando sólo queda el enlace del almacén el blob se borra. Antes de
+// modificar in situ un archivo compartido (APPE, REST + STOR) se copia.
+
+CRITICAL_SECTION dedup_cs; // Sólo en altas/bajas de blobs, nunca durante la transferencia
+
+void dedup_init(void) {
+    InitializeCriticalSection(&dedup_cs);
+    if (config.dedup) {
+        to_native_path(config.dedup_store);
+        make_dir(config.dedup_store);
+    }
+}
+
+// Ruta del blob de un contenido; con 'create' se crea su subcarpeta
+static int dedup_blob_path(const unsigned char sha256[32], char* out, size_t size, int create) {
+    char hex[65];
+    sha256_hex(sha256, hex);
+    int len = snprintf(out, size, "%s%c%.2s", config.dedup_store, PATH_SEP, hex);
+    if (len <= 0 || len >= (int)size) return -1;
+    if (create) make_dir(out);
+    len = snprintf(out, size, "%s%c%.2s%c%s", config.dedup_store, PATH_SEP, hex, PATH_SEP, hex);
+    return len > 0 && len < (int)size ? 0 : -1;
+}
+
+// Borra el blob si ya nadie más que el almacén lo referencia
+static void dedup_collect(const char* blob) {
+    EnterCriticalSection(&dedup_cs);
+    if (native_links(blob, NULL) == 1) {
+        remove(blob);
+    }
+    LeaveCriticalSection(&dedup_cs);
+}
+
+// Tras un STOR completo: si el contenido ya está en el almacén el archivo
+// se reemplaza por un enlace al blob; si no, el archivo pasa a ser el blob.
+void dedup_commit(ClientSession* session, const char* vpath, const FileChecksums* sums, long long size) {
+    char blob[MAX_PATH_LEN * 2];
+    char link_vpath[MAX_PATH_LEN];
+    long long blob_size;
+    if (!config.dedup || size == 0 || dedup_blob_path(sums->sha256, blob, sizeof(blob), 1) != 0) return;
+
+    EnterCriticalSection(&dedup_cs);
+    int links = native_links(blob, &blob_size);
+    if (links < 0) {
+        vfs_link_out(session, vpath, blob);
+    } else if (blob_size == size && temp_vpath_for(vpath, link_vpath, sizeof(link_vpath)) == 0 &&
+               vfs_link_in(session, blob, link_vpath) == 0) {
+        if (vfs_rename(session, link_vpath, vpath) == 0) {
+            atomic_fetch_add(&dedup_hits, 1);
+            atomic_fetch_add(&dedup_saved_bytes, size);
+        } else {
+            vfs_unlink(session, link_vpath);
+        }
+    }
+    LeaveCriticalSection(&dedup_cs);
+}
+
+// Archivo a punto de borrarse: devuelve en 'blob' el blob que comparte (o "")
+// para pasarlo a dedup_collect una vez borrado
+void dedup_lookup(ClientSession* session, const char* vpath, char* blob, size_t size) {
+    FileChecksums sums;
+    long long file_size;
+    blob[0] = '\0';
+    if (config.dedup && vfs_link_count(session, vpath) > 1 &&
+        checksums_get(session, vpath, &sums, &file_size) == 0) {
+        dedup_blob_path(sums.sha256, blob, size, 0);
+    }
+}
+
+// Copia privada de un archivo compartido antes de modificarlo en el lugar
+int dedup_unshare(ClientSession* session, const char* vpath) {
+    char blob[MAX_PATH_LEN * 2];
+    char temp[MAX_PATH_LEN];
+    dedup_lookup(session, vpath, blob, sizeof(blob));
+    if (!blob[0]) return 0;
+    if (temp_vpath_for(vpath, temp, sizeof(temp)) != 0) return -1;
+
+    FILE* in = vfs_fopen(session, vpath, "rb");
+    FILE* out = in ? vfs_fopen(session, temp, "wb") : NULL;
+    size_t buffer_size = (size_t)config.transfer_buffer_kb * 1024;
+    char* buffer = out ? (char*)malloc(buffer_size) : NULL;
+    int failed = !buffer;
+    size_t n;
+    while (!failed && (n = fread(buffer, 1, buffer_size, in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) failed = 1;
+    }
+    if (in && ferror(in)) failed = 1;
+    free(buffer);
+    if (in) fclose(in);
+    if (out && fclose(out) != 0) failed = 1;
+    if (failed || vfs_rename(session, temp, vpath) != 0) {
+        if (out) vfs_unlink(session, temp);
+        return -1;
+    }
+    dedup_collect(blob);
+    return 0;
+}
+
+// --- INICIO DE CORRECCIÓN PARA BUG 550 ---
+// STOR (append = 0) o APPE (append = 1). Tras REST, STOR escribe a partir
+// de ese desplazamiento sin truncar el archivo. Un STOR completo se escribe
+// en un temporal junto al destino y sólo se renombra al terminar bien, de
+// modo que nunca queda visible un archivo a medias con el nombre final.
+void handle_stor(ClientSession* session, const char* filename, int append) {
+    const char* cmd_name = append ? "APPE" : "STOR";
+    long long offset = session->rest_offset;
+    long long allo_size = session->allo_size;
+    session->rest_offset = 0;
+    session->allo_size = 0;
+
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    if (session->pasv_sock == INVALID_SOCKET) {
+        send_response(session->ctrl_sock, "425", "Use PASV first.");
+        return;
+    }
+
+    // Ruta resuelta contra el directorio actual de la sesión (acepta sub/archivo)
+    char vpath[MAX_PATH_LEN];
+    char temp_vpath[MAX_PATH_LEN] = "";
+    FILE* file = NULL;
+    if (vfs_resolve(session, filename, vpath, sizeof(vpath)) == 0 && strcmp(vpath, "/") != 0) {
+        if (append || offset > 0) {
+            // Un archivo deduplicado se separa del blob antes de modificarlo
+            if (dedup_unshare(session, vpath) == 0) {
+                file = vfs_fopen(session, vpath, append ? "ab" : "r+b");
+            }
+        } else if (temp_vpath_for(vpath, temp_vpath, sizeof(temp_vpath)) == 0) {
+            // Temporal oculto en el mismo directorio: el rename final es atómico
+            file = vfs_fopen(session, temp_vpath, "wb");
+        } else {
+            temp_vpath[0] = '\0';
+        }
+    }
+    if (file && offset > 0 && fseeko(file, offset, SEEK_SET) != 0) {
+        fclose(file);
+        file = NULL;
+    }
+    if (!file) {
+        send_response(session->ctrl_sock, "550", session->pack ? "Read-only file system." : "Cannot create file.");
+        pasv_release(session);
+        return;
+    }
+    if (allo_size > 0 && temp_vpath[0]) {
+        preallocate_file(file, allo_size);
+    }
+
+    send_response(session->ctrl_sock, "150", "Opening BINARY mode data connection");
+
+    session->data_sock = accept_data_connection(session);
+
+    if (session->data_sock == INVALID_SOCKET) {
+        send_response(session->ctrl_sock, "425", "Cannot open data connection.");
+        fclose(file);
+        if (temp_vpath[0]) vfs_unlink(session, temp_vpath);
+        pasv_release(session);
+        return;
+    }
+
+    long long start = now_us();
+    int write_error = 0;
+    ChecksumState checksum;
+    checksum_begin(&checksum);
+    RateLimiter limiter;
+    RateLimiter* rate = rate_begin(&limiter, session) ? &limiter : NULL;
+    ZStream* zs = NULL;
+    long long cpu_us = 0;
+    if (session->mode_z && (zs = (ZStream*)malloc(sizeof(ZStream))) != NULL && zstream_begin(zs, 0, 0) != 0) {
+        free(zs);
+        zs = NULL;
+    }
+    metrics_transfer_begin();
+    long long total_size = 0;
+    if (session->mode_z && !zs) {
+        write_error = 1;
+    } else {
+        total_size = receive_upload(session->data_sock, file, temp_vpath[0] ? &checksum : NULL,
+                                    &write_error, rate, zs);
+    }
+    if (rate) rate_end(rate);
+    int stream_error = zs && (zs->truncated || zs->corrupt);
+    if (zs) cpu_us = zstream_end(zs);
+    if (stream_error) write_error = 1; // No se confirma un archivo a medias
+
+    if (!write_error && allo_size > total_size && temp_vpath[0] && truncate_file(file, total_size) != 0) {
+        write_error = 1;
+    }
+    if (fclose(file) != 0) write_error = 1;
+    if (temp_vpath[0]) {
+        // Commit: el temporal reemplaza al destino sólo si todo se escribió
+        char old_blob[MAX_PATH_LEN * 2] = "";
+        if (!write_error) dedup_lookup(session, vpath, old_blob, sizeof(old_blob));
+        if (write_error || vfs_rename(session, temp_vpath, vpath) != 0) {
+            write_error = 1;
+            vfs_unlink(session, temp_vpath);
+        } else {
+            // Los checksums ya calculados quedan listos para HASH/XCRC
+            FileChecksums sums;
+            checksum_end(&checksum, &sums);
+            if (old_blob[0]) dedup_collect(old_blob); // La versión reemplazada compartía un blob
+            dedup_commit(session, vpath, &sums, total_size);
+            checksums_store(session, vpath, &sums);
+        }
+    }
+    long long duration = now_us() - start;
+    metrics_transfer_end(0, total_size, duration);
+    closesocket(session->data_sock);
+    session->data_sock = INVALID_SOCKET;
+    pasv_release(session);
+
+    if (stream_error) {
+        listing_invalidate(session, vpath);
+        tree_index_touch(session, vpath);
+        send_response(session->ctrl_sock, "426", "Compressed data stream truncated or corrupt.");
+        log_transfer(session->client_ip, session->client_port, cmd_name, "426", duration, total_size);
+        free(zs);
+        return;
+    }
+    if (write_error) {
+        listing_invalidate(session, vpath);
+        tree_index_touch(session, vpath);
+        send_response(session->ctrl_sock, "452", "Error writing file.");
+        log_transfer(session->client_ip, session->client_port, cmd_name, "452", duration, total_size);
+        free(zs);
+        return;
+    }
+
+    listing_invalidate(session, vpath);
+    tree_index_touch(session, vpath);
+    send_response(session->ctrl_sock, "226", "Transfer complete.");
+    if (zs) {
+        log_compressed(session->client_ip, session->client_port, cmd_name, "226", duration, total_size,
+                       zs->wire, cpu_us);
+    } else {
+        log_transfer(session->client_ip, session->client_port, cmd_name, "226", duration, total_size);
+    }
+    free(zs);
+}
+// --- FIN DE CORRECCIÓN ---
+
+
+void handle_rest(ClientSession* session, const char* arg) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    char* end = NULL;
+    long long offset = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || offset < 0) {
+        send_response(session->ctrl_sock, "501", "Invalid restart offset.");
+        return;
+    }
+
+    char buffer[128];
+    session->rest_offset = offset;
+    snprintf(buffer, sizeof(buffer), "Restarting at %lld. Send STORE or RETRIEVE.", offset);
+    send_response(session->ctrl_sock, "350", buffer);
+    log_message(session->client_ip, session->client_port, "REST", "350", 0, 0);
+}
+
+// ALLO <bytes>: tamaño del próximo STOR para reservar espacio en disco
+void handle_allo(ClientSession* session, const char* arg) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    char* end;
+    long long size = strtoll(arg, &end, 10);
+    if (end == arg || size < 0) {
+        send_response(session->ctrl_sock, "501", "Invalid ALLO size.");
+        return;
+    }
+
+    session->allo_size = size;
+    send_response(session->ctrl_sock, "200", "ALLO command successful.");
+    log_message(session->client_ip, session->client_port, "ALLO", "200", 0, size);
+}
+
+// MDTM: fecha de modificación en UTC (RFC 3659)
+void handle_mdtm(ClientSession* session, const char* filename) {
+    if (!session->logged_in) {
+        send_response(session->ctrl_sock, "530", "Not logged in.");
+        return;
+    }
+
+    char vpath[MAX_PATH_LEN];
+    VfsStat st;
+    if (vfs_resolve(session, filename, vpath, sizeof(vpath)) != 0 ||
+        vfs_stat(session, vpath, &st) != 0 || st.is_dir) {
+        send_response(session->ctrl_sock, "550", "File not found.");
+        log_message(session->client_ip, session->client_port, "MDTM", "550", 0, 0);
+        return;
+    }
+
+    struct tm ut;
+    char buffer[32];
+    utc_tm(st.mtime, &ut);
+    snprintf(buffer, sizeof(buffer), "%04d%02d%02d%02d%02d%02d", ut.tm_year + 1900, ut.tm_mon + 1,
+             ut.tm_mday, ut.tm_hour, ut.tm_min, ut.tm_sec);
+    send_response(session->ctrl_sock, "213", buffer);
+    log_message(session->client_ip, session->client_port, "MDTM", "213", 0, 0);
 }
 
+// HASH (draft-bryan-ftp-hash) con el algoritmo elegido en OPTS HASH, o XCRC (siempre CRC32C)
+void handle_hash(ClientSession* session, const char* filename, int xcrc) {
+    const char* cmd_name = xcrc ? "XCRC" : "HASH";
 
-void handle_pasv(ClientSession* session) {
     if (!session->logged_in) {
         send_response(session->ctrl_sock, "530", "Not logged in.");
         return;
     }
-    
-    // Crear socket pasivo
-    session->pasv_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (session->pasv_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Cannot open passive connection.");
+
+    char vpath[MAX_PATH_LEN];
+    FileChecksums sums;
+    long long size = 0;
+    long long start = now_us();
+    if (vfs_resolve(session, filename, vpath, sizeof(vpath)) != 0 ||
+        checksums_get(session, vpath, &sums, &size) != 0) {
+        send_response(session->ctrl_sock, "550", "File not found.");
+        log_message(session->client_ip, session->client_port, cmd_name, "550", 0, 0);
         return;
     }
-    
-    struct sockaddr_in pasv_addr;
-    memset(&pasv_addr, 0, sizeof(pasv_addr));
-    pasv_addr.sin_family = AF_INET;
-    pasv_addr.sin_addr.s_addr = INADDR_ANY;
-    pasv_addr.sin_port = 0; // Puerto aleatorio
-    
-    if (bind(session->pasv_sock, (struct sockaddr*)&pasv_addr, sizeof(pasv_addr)) == SOCKET_ERROR) {
-        closesocket(session->pasv_sock);
-        send_response(session->ctrl_sock, "425", "Cannot open passive connection.");
-        return;
+
+    char buffer[MAX_PATH_LEN + 128];
+    if (xcrc) {
+        snprintf(buffer, sizeof(buffer), "%08X", sums.crc32c);
+        send_response(session->ctrl_sock, "250", buffer);
+    } else if (session->hash_sha256) {
+        char sha_hex[65];
+        sha256_hex(sums.sha256, sha_hex);
+        snprintf(buffer, sizeof(buffer), "SHA-256 0-%lld %s %s", size, sha_hex, filename);
+        send_response(session->ctrl_sock, "213", buffer);
+    } else {
+        snprintf(buffer, sizeof(buffer), "CRC32C 0-%lld %08x %s", size, sums.crc32c, filename);
+        send_response(session->ctrl_sock, "213", buffer);
     }
-    
-    if (listen(session->pasv_sock, 1) == SOCKET_ERROR) {
-        closesocket(session->pasv_sock);
-        send_response(session->ctrl_sock, "425", "Cannot open passive connection.");
-        return;
-    }
-    
-    // Obtener puerto asignado
-    int addr_len = sizeof(pasv_addr);
-    getsockname(session->pasv_sock, (struct sockaddr*)&pasv_addr, &addr_len);
-    int port = ntohs(pasv_addr.sin_port);
-    
-    // Usar IP del servidor (localhost para pruebas)
-    unsigned char ip_parts[4] = {127, 0, 0, 1};
-    
-    char buffer[BUFFER_SIZE];
-    snprintf(buffer, sizeof(buffer), "Entering Passive Mode (%d,%d,%d,%d,%d,%d).",
-             ip_parts[0], ip_parts[1], ip_parts[2], ip_parts[3], port / 256, port % 256);
-    send_response(session->ctrl_sock, "227", buffer);
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "PASV", "227", 0, 0);
+    log_message(session->client_ip, session->client_port, cmd_name, xcrc ? "250" : "213",
+                (long)((now_us() - start) / 1000), size);
 }
 
-// --- INICIO DE CORRECCIÓN PARA BUG 550 ---
-void handle_list(ClientSession* session) {
-    if (!session->logged_in) {
-        send_response(session->ctrl_sock, "530", "Not logged in.");
-        return;
+// MODE S|Z: flujo sin transformar o comprimido con deflate (MODE Z)
+void handle_mode(ClientSession* session, const char* arg) {
+    if (strcasecmp(arg, "S") == 0) {
+        session->mode_z = 0;
+        send_response(session->ctrl_sock, "200", "Mode set to S.");
+    } else if (strcasecmp(arg, "Z") == 0) {
+        session->mode_z = 1;
+        send_response(session->ctrl_sock, "200", "Mode set to Z.");
+    } else {
+        send_response(session->ctrl_sock, "504", "Unsupported transfer mode.");
     }
-    
-    if (session->pasv_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Use PASV first.");
+}
+
+// OPTS MODE Z LEVEL <n> / OPTS HASH [algoritmo]: nivel de deflate o algoritmo de HASH
+void handle_opts(ClientSession* session, const char* arg) {
+    if (strncasecmp(arg, "MODE Z", 6) == 0 && (arg[6] == '\0' || arg[6] == ' ')) {
+        // OPTS MODE Z LEVEL <1-9>
+        const char* opt = arg + 6;
+        while (*opt == ' ') opt++;
+        char response[64];
+        if (strncasecmp(opt, "LEVEL ", 6) == 0 && atoi(opt + 6) >= 1 && atoi(opt + 6) <= 9) {
+            session->deflate_level = atoi(opt + 6);
+        } else if (*opt != '\0') {
+            send_response(session->ctrl_sock, "501", "Usage: OPTS MODE Z LEVEL <1-9>.");
+            return;
+        }
+        snprintf(response, sizeof(response), "MODE Z LEVEL %d", session->deflate_level);
+        send_response(session->ctrl_sock, "200", response);
         return;
     }
-    
-    send_response(session->ctrl_sock, "150", "Opening ASCII mode data connection for file list");
-    
-    // Aceptar conexion de datos
-    struct sockaddr_in data_client_addr;
-    int addr_len = sizeof(data_client_addr);
-    session->data_sock = accept(session->pasv_sock, (struct sockaddr*)&data_client_addr, &addr_len);
-    
-    if (session->data_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Cannot open data connection.");
-        closesocket(session->pasv_sock);
-        session->pasv_sock = INVALID_SOCKET;
+    if (strncasecmp(arg, "HASH", 4) != 0 || (arg[4] != '\0' && arg[4] != ' ')) {
+        send_response(session->ctrl_sock, "501", "Option not supported.");
         return;
     }
-    
-    // El servidor ya está en el directorio correcto (gracias a _chdir en handle_pass/handle_cwd)
-    // Solo necesitamos listar el directorio actual "."
-    char search_path[MAX_PATH_LEN];
-    snprintf(search_path, sizeof(search_path), ".\\*");
-    
-    // Listar archivos
-    WIN32_FIND_DATAA find_data;
-    HANDLE hFind = FindFirstFileA(search_path, &find_data);
-    char buffer[BUFFER_SIZE];
-    long total_size = 0;
-    clock_t start = clock();
-    
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            // Saltar . y ..
-            if (strcmp(find_data.cFileName, ".") == 0 || strcmp(find_data.cFileName, "..") == 0) {
-                continue;
-            }
-            
-            // Formato detallado tipo UNIX
-            char* type = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? "d" : "-";
-            char permissions[] = "rw-rw-rw-";
-            LARGE_INTEGER file_size;
-            file_size.LowPart = find_data.nFileSizeLow;
-            file_size.HighPart = find_data.nFileSizeHigh;
-            
-            // Convertir tiempo
-            SYSTEMTIME sys_time;
-            FileTimeToSystemTime(&find_data.ftLastWriteTime, &sys_time);
-            
-            snprintf(buffer, sizeof(buffer), "%s%s 1 user group %10lld %04d-%02d-%02d %02d:%02d %s\r\n",
-                    type, permissions, file_size.QuadPart,
-                    sys_time.wYear, sys_time.wMonth, sys_time.wDay,
-                    sys_time.wHour, sys_time.wMinute, find_data.cFileName);
-            
-            send(session->data_sock, buffer, strlen(buffer), 0);
-            total_size += strlen(buffer);
-            
-        } while (FindNextFileA(hFind, &find_data));
-        FindClose(hFind);
+
+    const char* algo = arg + 4;
+    while (*algo == ' ') algo++;
+    if (*algo == '\0') {
+        send_response(session->ctrl_sock, "200", session->hash_sha256 ? "SHA-256" : "CRC32C");
+    } else if (strcasecmp(algo, "SHA-256") == 0) {
+        session->hash_sha256 = 1;
+        send_response(session->ctrl_sock, "200", "SHA-256");
+    } else if (strcasecmp(algo, "CRC32C") == 0) {
+        session->hash_sha256 = 0;
+        send_response(session->ctrl_sock, "200", "CRC32C");
     } else {
-        strcpy(buffer, "No files found\r\n");
-        send(session->data_sock, buffer, strlen(buffer), 0);
-        total_size = strlen(buffer);
+        send_response(session->ctrl_sock, "504", "Unknown algorithm.");
     }
-    
-    long duration = (clock() - start) * 1000 / CLOCKS_PER_SEC;
-    
-    closesocket(session->data_sock);
-    closesocket(session->pasv_sock);
-    session->data_sock = INVALID_SOCKET;
-    session->pasv_sock = INVALID_SOCKET;
-    
-    send_response(session->ctrl_sock, "226", "Directory send OK.");
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "LIST", "226", duration, total_size);
 }
 
-// --- INICIO DE CORRECCIÓN PARA BUG 550 ---
-void handle_retr(ClientSession* session, const char* filename) {
+// SIZE (RFC 3659): lo necesita el cliente para calcular REST y segmentos
+void handle_size(ClientSession* session, const char* filename) {
     if (!session->logged_in) {
         send_response(session->ctrl_sock, "530", "Not logged in.");
         return;
     }
-    
-    if (session->pasv_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Use PASV first.");
-        return;
-    }
-    
-    // El CWD del servidor ya es correcto. Solo usamos el nombre del archivo.
-    char full_path[MAX_PATH_LEN];
-    strncpy(full_path, filename, sizeof(full_path) - 1);
 
-    // Reemplazar / con \ para Windows (por si el cliente envía sub/archivo)
-    for (char* p = full_path; *p; p++) {
-        if (*p == '/') *p = '\\';
-    }
-    
-    FILE* file = fopen(full_path, "rb");
-    if (!file) {
+    char vpath[MAX_PATH_LEN];
+    VfsStat st;
+    if (vfs_resolve(session, filename, vpath, sizeof(vpath)) != 0 ||
+        vfs_stat(session, vpath, &st) != 0 || st.is_dir) {
         send_response(session->ctrl_sock, "550", "File not found.");
-        closesocket(session->pasv_sock);
-        session->pasv_sock = INVALID_SOCKET;
-        return;
-    }
-    
-    send_response(session->ctrl_sock, "150", "Opening BINARY mode data connection");
-    
-    struct sockaddr_in data_client_addr;
-    int addr_len = sizeof(data_client_addr);
-    session->data_sock = accept(session->pasv_sock, (struct sockaddr*)&data_client_addr, &addr_len);
-    
-    if (session->data_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Cannot open data connection.");
-        fclose(file);
-        closesocket(session->pasv_sock);
-        session->pasv_sock = INVALID_SOCKET;
+        log_message(session->client_ip, session->client_port, "SIZE", "550", 0, 0);
         return;
     }
-    
-    clock_t start = clock();
-    char buffer[BUFFER_SIZE];
-    long total_size = 0;
-    int bytes_read;
-    
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        send(session->data_sock, buffer, bytes_read, 0);
-        total_size += bytes_read;
-    }
-    
-    long duration = (clock() - start) * 1000 / CLOCKS_PER_SEC;
-    
-    fclose(file);
-    closesocket(session->data_sock);
-    closesocket(session->pasv_sock);
-    session->data_sock = INVALID_SOCKET;
-    session->pasv_sock = INVALID_SOCKET;
-    
-    send_response(session->ctrl_sock, "226", "Transfer complete.");
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "RETR", "226", duration, total_size);
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%lld", st.size);
+    send_response(session->ctrl_sock, "213", buffer);
+    log_message(session->client_ip, session->client_port, "SIZE", "213", 0, 0);
 }
 
-// --- INICIO DE CORRECCIÓN PARA BUG 550 ---
-void handle_stor(ClientSession* session, const char* filename) {
+void handle_dele(ClientSession* session, const char* filename) {
     if (!session->logged_in) {
         send_response(session->ctrl_sock, "530", "Not logged in.");
         return;
     }
-    
-    if (session->pasv_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Use PASV first.");
-        return;
-    }
-    
-    // El CWD del servidor ya es correcto. Solo usamos el nombre del archivo.
-    char full_path[MAX_PATH_LEN];
-    strncpy(full_path, filename, sizeof(full_path) - 1);
-    
-    // Reemplazar / con \ para Windows (por si el cliente envía sub/archivo)
-    for (char* p = full_path; *p; p++) {
-        if (*p == '/') *p = '\\';
+
+    char vpath[MAX_PATH_LEN] = "";
+    char blob[MAX_PATH_LEN * 2] = "";
+    if (vfs_resolve(session, filename, vpath, sizeof(vpath)) == 0) {
+        dedup_lookup(session, vpath, blob, sizeof(blob));
     }
-    
-    FILE* file = fopen(full_path, "wb");
-    if (!file) {
-        send_response(session->ctrl_sock, "550", "Cannot create file.");
-        closesocket(session->pasv_sock);
-        session->pasv_sock = INVALID_SOCKET;
+    if (vpath[0] != '/' || vfs_unlink(session, vpath) != 0) {
+        send_response(session->ctrl_sock, "550", session->pack ? "Read-only file system." : "Cannot delete file.");
+        log_message(session->client_ip, session->client_port, "DELE", "550", 0, 0);
         return;
     }
-    
-    send_response(session->ctrl_sock, "150", "Opening BINARY mode data connection");
-    
-    struct sockaddr_in data_client_addr;
-    int addr_len = sizeof(data_client_addr);
-    session->data_sock = accept(session->pasv_sock, (struct sockaddr*)&data_client_addr, &addr_len);
-    
-    if (session->data_sock == INVALID_SOCKET) {
-        send_response(session->ctrl_sock, "425", "Cannot open data connection.");
-        fclose(file);
-        closesocket(session->pasv_sock);
-        session->pasv_sock = INVALID_SOCKET;
-        return;
+    if (blob[0]) dedup_collect(blob);
+
+    char sidecar[MAX_PATH_LEN];
+    if (checksum_sidecar_path(vpath, sidecar, sizeof(sidecar)) == 0) {
+        vfs_unlink(session, sidecar);
     }
-    
-    clock_t start = clock();
-    char buffer[BUFFER_SIZE];
-    long total_size = 0;
-    int bytes_recv;
-    
-    while ((bytes_recv = recv(session->data_sock, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_recv, file);
-        total_size += bytes_recv;
-    }
-    
-    long duration = (clock() - start) * 1000 / CLOCKS_PER_SEC;
-    
-    fclose(file);
-    closesocket(session->data_sock);
-    closesocket(session->pasv_sock);
-    session->data_sock = INVALID_SOCKET;
-    session->pasv_sock = INVALID_SOCKET;
-    
-    send_response(session->ctrl_sock, "226", "Transfer complete.");
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "STOR", "226", duration, total_size);
+    listing_invalidate(session, vpath);
+    tree_index_touch(session, vpath);
+    send_response(session->ctrl_sock, "250", "File deleted.");
+    log_message(session->client_ip, session->client_port, "DELE", "250", 0, 0);
 }
-// --- FIN DE CORRECCIÓN ---
 
+// FEAT (RFC 2389): extensiones soportadas, una por línea
+void handle_feat(ClientSession* session) {
+    char features[256];
+    snprintf(features, sizeof(features),
+             "211-Features:\r\n"
+             " EPSV\r\n"
+             " MLSD\r\n"
+             " SIZE\r\n"
+             " MDTM\r\n"
+             " MODE Z\r\n"
+             " HASH %s\r\n"
+             " XCRC\r\n"
+             " REST STREAM\r\n"
+             "211 End\r\n",
+             session->hash_sha256 ? "SHA-256*;CRC32C" : "SHA-256;CRC32C*");
+    send_all(session->ctrl_sock, features, (int)strlen(features));
+    printf(">> %s", features);
+}
 
 void handle_quit(ClientSession* session) {
     send_response(session->ctrl_sock, "221", "Goodbye.");
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    log_message(session->log_file, client_ip, client_port, "QUIT", "221", 0, 0);
+    log_message(session->client_ip, session->client_port, "QUIT", "221", 0, 0);
+}
+
+// Empaqueta el verbo (3-4 letras, en mayúsculas) en 32 bits con la misma
+// codificación que VERB, para que el despacho sea un único switch en lugar de
+// una cadena de strcmp. Devuelve 0 si no es un verbo válido; 'arg' queda
+// apuntando al argumento.
+unsigned int pack_verb(const char* line, const char** arg) {
+    unsigned int verb = 0;
+    int i = 0;
+
+    for (; i < 4 && isalpha((unsigned char)line[i]); i++) {
+        verb |= (unsigned int)toupper((unsigned char)line[i]) << (8 * i);
+    }
+    if (i < 3 || (line[i] != '\0' && line[i] != ' ')) return 0;
+
+    const char* p = line + i;
+    while (*p == ' ') p++;
+    *arg = p;
+    return verb;
+}
+
+// Ejecuta una línea de comando ya sin CRLF. Devuelve 0 si la sesión debe
+// cerrarse (tras QUIT).
+int dispatch_command(ClientSession* session, const char* line) {
+    const char* arg = "";
+    int keep_open = 1;
+
+    printf("<< %s\n", line);
+
+    if (*line == '\0') {
+        return 1;
+    }
+
+    long long start = now_us();
+    unsigned int verb = pack_verb(line, &arg);
+
+    switch (verb) {
+    case VERB('U', 'S', 'E', 'R'):
+        handle_user(session, arg);
+        break;
+    case VERB('P', 'A', 'S', 'S'):
+        handle_pass(session, arg);
+        break;
+    case VERB('P', 'W', 'D', 0):
+    case VERB('X', 'P', 'W', 'D'):
+        handle_pwd(session);
+        break;
+    case VERB('C', 'W', 'D', 0):
+        handle_cwd(session, arg);
+        break;
+    case VERB('P', 'A', 'S', 'V'):
+        handle_pasv(session, 0);
+        break;
+    case VERB('E', 'P', 'S', 'V'):
+        if (strcasecmp(arg, "ALL") == 0) {
+            send_response(session->ctrl_sock, "200", "EPSV ALL ok.");
+        } else {
+            handle_pasv(session, 1);
+        }
+        break;
+    case VERB('S', 'I', 'T', 'E'):
+        handle_site(session, arg);
+        break;
+    case VERB('L', 'I', 'S', 'T'):
+    case VERB('N', 'L', 'S', 'T'):
+        handle_list(session, 0, arg);
+        break;
+    case VERB('M', 'L', 'S', 'D'):
+        handle_list(session, 1, arg);
+        break;
+    case VERB('D', 'E', 'L', 'E'):
+        handle_dele(session, arg);
+        break;
+    case VERB('R', 'E', 'T', 'R'):
+        handle_retr(session, arg);
+        break;
+    case VERB('S', 'T', 'O', 'R'):
+        handle_stor(session, arg, 0);
+        break;
+    case VERB('A', 'P', 'P', 'E'):
+        handle_stor(session, arg, 1);
+        break;
+    case VERB('R', 'E', 'S', 'T'):
+        handle_rest(session, arg);
+        break;
+    case VERB('A', 'L', 'L', 'O'):
+        handle_allo(session, arg);
+        break;
+    case VERB('S', 'I', 'Z', 'E'):
+        handle_size(session, arg);
+        break;
+    case VERB('M', 'D', 'T', 'M'):
+        handle_mdtm(session, arg);
+        break;
+    case VERB('H', 'A', 'S', 'H'):
+        handle_hash(session, arg, 0);
+        break;
+    case VERB('X', 'C', 'R', 'C'):
+        handle_hash(session, arg, 1);
+        break;
+    case VERB('O', 'P', 'T', 'S'):
+        handle_opts(session, arg);
+        break;
+    case VERB('F', 'E', 'A', 'T'):
+        handle_feat(session);
+        break;
+    case VERB('S', 'T', 'A', 'T'):
+        handle_stat(session);
+        break;
+    case VERB('Q', 'U', 'I', 'T'):
+        handle_quit(session);
+        keep_open = 0;
+        break;
+    case VERB('S', 'Y', 'S', 'T'):
+        send_response(session->ctrl_sock, "215", "UNIX Type: L8");
+        break;
+    case VERB('M', 'O', 'D', 'E'):
+        handle_mode(session, arg);
+        break;
+    case VERB('T', 'Y', 'P', 'E'):
+        send_response(session->ctrl_sock, "200", "Type set to I");
+        break;
+    case VERB('N', 'O', 'O', 'P'):
+        send_response(session->ctrl_sock, "200", "OK");
+        break;
+    default:
+        send_response(session->ctrl_sock, "500", "Unknown command.");
+        break;
+    }
+
+    metrics_command(verb, now_us() - start);
+    return keep_open;
+}
+
+// Comandos que esperan la conexión de datos, transfieren (y pueden esperar
+// al limitador de ancho de banda) o leen un archivo entero. Con dedup, DELE
+// de un archivo compartido sin checksums vigentes lo lee para hallar su blob;
+// PASS de un usuario con home empaquetado puede mapear y validar el paquete;
+// SITE FIND (como LIST -R) puede tener que recorrer el home para el índice.
+int is_blocking_verb(ClientSession* session, unsigned int verb, const char* arg) {
+    User user;
+    switch (verb) {
+    case VERB('S', 'I', 'T', 'E'):
+        return strncasecmp(arg, "FIND", 4) == 0 && (arg[4] == '\0' || arg[4] == ' ');
+    case VERB('D', 'E', 'L', 'E'):
+        return config.dedup;
+    case VERB('P', 'A', 'S', 'S'):
+        return find_user(session->username, &user) && pack_file_info(user.home_dir, NULL, NULL) == 0;
+    case VERB('L', 'I', 'S', 'T'):
+    case VERB('N', 'L', 'S', 'T'):
+    case VERB('M', 'L', 'S', 'D'):
+    case VERB('R', 'E', 'T', 'R'):
+    case VERB('S', 'T', 'O', 'R'):
+    case VERB('A', 'P', 'P', 'E'):
+    case VERB('H', 'A', 'S', 'H'):
+    case VERB('X', 'C', 'R', 'C'):
+        return 1;
+    }
+    return 0;
+}
+
+// Extrae y ejecuta todas las líneas completas acumuladas en el buffer de la
+// sesión; un comando partido entre varios recv() queda pendiente hasta que
+// llegue su '\n'. Devuelve 0 tras QUIT. En el motor de eventos un comando
+// que bloquea no se ejecuta aquí: se deja en el buffer y se devuelve
+// SESSION_DEFERRED para que lo ejecute el pool de transferencias.
+int session_process_input(ClientSession* session) {
+    char* line = session->inbuf;
+    char* end = session->inbuf + session->inlen;
+    char* nl;
+    int deferred = 0;
+
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+        const char* arg;
+        unsigned int verb;
+        int cr = nl > line && nl[-1] == '\r';
+        *nl = '\0';
+        if (cr) nl[-1] = '\0';
+        if (session->discarding) {
+            session->discarding = 0; // Fin de la línea demasiado larga
+        } else if (session->engine && !session->in_transfer &&
+                   (verb = pack_verb(line, &arg), is_blocking_verb(session, verb, arg))) {
+            if (cr) nl[-1] = '\r';
+            *nl = '\n';
+            deferred = 1;
+            break;
+        } else if (!dispatch_command(session, line)) {
+            return 0;
+        }
+        line = nl + 1;
+    }
+
+    session->inlen = (int)(end - line);
+    memmove(session->inbuf, line, session->inlen);
+    if (deferred) return SESSION_DEFERRED;
+
+    if (session->inlen == (int)sizeof(session->inbuf) - 1) {
+        // Línea más larga que el buffer: se descarta hasta su '\n'
+        session->inlen = 0;
+        if (!session->discarding) {
+            session->discarding = 1;
+            send_response(session->ctrl_sock, "500", "Line too long.");
+        }
+    }
+    return 1;
+}
+
+ClientSession* create_session(SOCKET client_sock, const struct sockaddr_in* client_addr) {
+    ClientSession* session = (ClientSession*)calloc(1, sizeof(ClientSession));
+    if (!session) return NULL;
+
+    session->ctrl_sock = client_sock;
+    session->data_sock = INVALID_SOCKET;
+    session->pasv_sock = INVALID_SOCKET;
+    session->pasv_slot = -1;
+    session->logged_in = 0;
+    session->hash_sha256 = 1;
+    session->deflate_level = config.deflate_level;
+    session->client_addr = *client_addr;
+    format_ip(client_addr, session->client_ip, sizeof(session->client_ip));
+    session->client_port = ntohs(client_addr->sin_port);
+    // Inicializar directorio para el log
+    strcpy(session->current_dir, "/");
+#ifndef _WIN32
+    session->root_fd = -1;
+    session->cwd_fd = -1;
+#endif
+    atomic_fetch_add(&active_sessions, 1);
+    return session;
+}
+
+void destroy_session(ClientSession* session) {
+    closesocket(session->ctrl_sock);
+    if (session->data_sock != INVALID_SOCKET) closesocket(session->data_sock);
+    pasv_release(session);
+    vfs_logout(session);
+    listener_release(&listener, &session->client_addr);
+    free(session);
+    atomic_fetch_sub(&active_sessions, 1);
 }
 
 DWORD WINAPI client_handler(LPVOID param) {
     ClientSession* session = (ClientSession*)param;
-    char buffer[BUFFER_SIZE];
     int bytes_recv;
-    
-    User users[100];
-    int user_count = load_users(users, 100);
-    
-    // Guardar directorio raíz del proyecto
-    char root_dir[MAX_PATH_LEN];
-    _getcwd(root_dir, sizeof(root_dir));
-    
-    // Inicializar directorio para el log
-    strcpy(session->current_dir, "/");
-    
-    char client_ip[16];
-    strcpy(client_ip, inet_ntoa(session->client_addr.sin_addr));
-    int client_port = ntohs(session->client_addr.sin_port);
-    
-    printf("Cliente conectado: %s:%d\n", client_ip, client_port);
+
+    printf("Cliente conectado: %s:%d\n", session->client_ip, session->client_port);
     send_response(session->ctrl_sock, "220", "FTP Server Ready.");
-    
-    while ((bytes_recv = recv(session->ctrl_sock, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytes_recv] = '\0';
-        printf("<< %s", buffer);
-        
-        // Remover \r\n
-        buffer[strcspn(buffer, "\r\n")] = '\0';
-        
-        char cmd[32];
-        char arg[BUFFER_SIZE] = "";
-        
-        // Parsear comando y argumento
-        if (sscanf(buffer, "%31s %[^\r\n]", cmd, arg) < 1) {
+
+    while ((bytes_recv = recv(session->ctrl_sock, session->inbuf + session->inlen,
+                              sizeof(session->inbuf) - 1 - session->inlen, 0)) > 0) {
+        session->inlen += bytes_recv;
+        if (!session_process_input(session)) {
+            break;
+        }
+    }
+
+    destroy_session(session);
+    logger_release_ring();
+    metrics_release_shard();
+
+    return 0;
+}
+
+#ifndef __linux__
+// Conexión ya admitida por el listener: se atiende en un hilo propio
+static void on_client_accepted(Listener* l, SOCKET client_sock, const struct sockaddr_in* client_addr, void* ctx) {
+    (void)ctx;
+    ClientSession* session = create_session(client_sock, client_addr);
+    if (!session) {
+        closesocket(client_sock);
+        listener_release(l, client_addr);
+    } else if (!spawn_thread(client_handler, session)) {
+        destroy_session(session);
+    }
+}
+#endif
+
+#ifdef __linux__
+// ==================== MOTOR DE EVENTOS (epoll) ====================
+// Todas las conexiones de control se multiplexan sobre un número fijo de
+// hilos. Cada hilo tiene su propio epoll y su propio socket de escucha
+// SO_REUSEPORT: el kernel reparte las conexiones nuevas entre los sockets y
+// cada sesión vive siempre en el mismo hilo. Una sesión inactiva sólo
+// cuesta su ClientSession (sin pila ni hilo propio).
+// Los hilos del motor sólo leen y responden comandos de control: los que
+// bloquean (ver is_blocking_verb) pasan al pool de transferencias. Las
+// sesiones se registran con EPOLLONESHOT, así que mientras tanto su hilo no
+// las atiende; al terminar se rearman.
+
+typedef struct {
+    int epfd;
+    int index; // Socket de escucha propio: listener.sockets[index]
+} EventEngine;
+
+static void engine_close_session(EventEngine* engine, ClientSession* session) {
+    epoll_ctl(engine->epfd, EPOLL_CTL_DEL, session->ctrl_sock, NULL);
+    printf("Cliente desconectado: %s:%d\n", session->client_ip, session->client_port);
+    destroy_session(session);
+}
+
+// Devuelve la sesión a epoll para su siguiente comando, o la cierra
+static void engine_resume(ClientSession* session, int alive) {
+    EventEngine* engine = (EventEngine*)session->engine;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = session;
+    if (!alive || epoll_ctl(engine->epfd, EPOLL_CTL_MOD, session->ctrl_sock, &ev) != 0) {
+        engine_close_session(engine, session);
+    }
+}
+
+// --- Pool de transferencias ---
+// Cola de sesiones con un comando pendiente. Los hilos se crean bajo demanda
+// (hasta transfer_threads) y quedan a la espera de la siguiente; si todos
+// están ocupados la sesión espera turno sin frenar a las demás.
+typedef struct {
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE ready;
+    ClientSession* head;
+    ClientSession* tail;
+    int threads;
+    int idle;
+} TransferPool;
+
+static TransferPool transfer_pool;
+
+static DWORD transfer_worker(LPVOID param) {
+    (void)param;
+    for (;;) {
+        EnterCriticalSection(&transfer_pool.lock);
+        while (!transfer_pool.head) {
+            transfer_pool.idle++;
+            SleepConditionVariableCS(&transfer_pool.ready, &transfer_pool.lock, INFINITE);
+            transfer_pool.idle--;
+        }
+        ClientSession* session = transfer_pool.head;
+        transfer_pool.head = session->next_job;
+        if (!transfer_pool.head) transfer_pool.tail = NULL;
+        LeaveCriticalSection(&transfer_pool.lock);
+
+        // El comando pendiente y los que le sigan ya en el buffer
+        session->next_job = NULL;
+        session->in_transfer = 1;
+        int alive = session_process_input(session);
+        session->in_transfer = 0;
+        engine_resume(session, alive);
+    }
+    return 0;
+}
+
+// Arranca con un hilo para que transfer_submit siempre tenga quien atienda
+static int transfer_pool_init(void) {
+    InitializeCriticalSection(&transfer_pool.lock);
+    InitializeConditionVariable(&transfer_pool.ready);
+    if (!spawn_thread(transfer_worker, NULL)) return 0;
+    transfer_pool.threads = 1;
+    return 1;
+}
+
+// Encola la sesión; si todos los hilos están ocupados crea otro (hasta el máximo)
+static void transfer_submit(ClientSession* session) {
+    EnterCriticalSection(&transfer_pool.lock);
+    if (transfer_pool.idle == 0 && transfer_pool.threads < config.transfer_threads) {
+        if (spawn_thread(transfer_worker, NULL)) transfer_pool.threads++;
+    }
+    session->next_job = NULL;
+    if (transfer_pool.tail) transfer_pool.tail->next_job = session;
+    else transfer_pool.head = session;
+    transfer_pool.tail = session;
+    WakeConditionVariable(&transfer_pool.ready);
+    LeaveCriticalSection(&transfer_pool.lock);
+}
+
+// Acepta todo lo pendiente en el socket de escucha del hilo (ya pasado por admisión)
+static void engine_accept(EventEngine* engine) {
+    for (;;) {
+        struct sockaddr_in client_addr;
+        SOCKET client_sock = listener_accept(&listener, engine->index, &client_addr);
+        if (client_sock == INVALID_SOCKET) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Error al aceptar conexión: %d\n", errno);
+            }
+            return;
+        }
+
+        ClientSession* session = create_session(client_sock, &client_addr);
+        if (!session) {
+            closesocket(client_sock);
+            listener_release(&listener, &client_addr);
             continue;
         }
-        
-        // Convertir a mayúsculas para comparación
-        for (char* p = cmd; *p; p++) {
-            *p = toupper(*p);
-        }
-        
-        if (strcmp(cmd, "USER") == 0) {
-            handle_user(session, arg, users, user_count);
-        } else if (strcmp(cmd, "PASS") == 0) {
-            handle_pass(session, arg, users, user_count);
-        } else if (strcmp(cmd, "PWD") == 0 || strcmp(cmd, "XPWD") == 0) {
-            handle_pwd(session);
-        } else if (strcmp(cmd, "CWD") == 0) {
-            handle_cwd(session, arg);
-        } else if (strcmp(cmd, "PASV") == 0) {
-            handle_pasv(session);
-        } else if (strcmp(cmd, "LIST") == 0 || strcmp(cmd, "NLST") == 0) {
-            handle_list(session);
-        } else if (strcmp(cmd, "RETR") == 0) {
-            handle_retr(session, arg);
-        } else if (strcmp(cmd, "STOR") == 0) {
-            handle_stor(session, arg);
-        } else if (strcmp(cmd, "QUIT") == 0) {
-            handle_quit(session);
-            break;
-        } else if (strcmp(cmd, "SYST") == 0) {
-            send_response(session->ctrl_sock, "215", "UNIX Type: L8");
-        } else if (strcmp(cmd, "TYPE") == 0) {
-            send_response(session->ctrl_sock, "200", "Type set to I");
-        } else if (strcmp(cmd, "NOOP") == 0) {
-            send_response(session->ctrl_sock, "200", "OK");
-        } else {
-            send_response(session->ctrl_sock, "500", "Unknown command.");
+        session->engine = engine;
+        if (set_socket_blocking(client_sock, 0) != 0) {
+            destroy_session(session);
+            continue;
+        }
+
+        int nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        printf("Cliente conectado: %s:%d\n", session->client_ip, session->client_port);
+        send_response(session->ctrl_sock, "220", "FTP Server Ready.");
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = session;
+        if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, client_sock, &ev) != 0) {
+            destroy_session(session);
+        }
+    }
+}
+
+// Lee todo lo disponible sin bloquear. Devuelve 0 si la sesión terminó y
+// SESSION_DEFERRED si quedó un comando para el pool de transferencias.
+static int engine_on_readable(ClientSession* session) {
+    for (;;) {
+        int n = recv(session->ctrl_sock, session->inbuf + session->inlen,
+                     sizeof(session->inbuf) - 1 - session->inlen, 0);
+        if (n > 0) {
+            session->inlen += n;
+            int state = session_process_input(session);
+            if (state != 1) return state;
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+static DWORD engine_worker(LPVOID param) {
+    EventEngine* engine = (EventEngine*)param;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(engine->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("Error en epoll_wait: %d\n", errno);
+            return 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            // El socket de escucha se registra sin puntero
+            if (!events[i].data.ptr) {
+                engine_accept(engine);
+                continue;
+            }
+
+            ClientSession* session = (ClientSession*)events[i].data.ptr;
+            int state = (events[i].events & (EPOLLERR | EPOLLHUP)) ? 0 : engine_on_readable(session);
+            if (state == SESSION_DEFERRED) {
+                // Sin rearmar: la sesión es del pool hasta que termine el comando.
+                // Las transferencias (y sus esperas de ancho de banda) nunca corren aquí.
+                transfer_submit(session);
+                continue;
+            }
+            if (state && (events[i].events & EPOLLRDHUP) && session->inlen == 0) {
+                state = 0;
+            }
+
+            // Rearmar la sesión para el siguiente comando
+            engine_resume(session, state);
         }
     }
-    
-    closesocket(session->ctrl_sock);
-    if (session->data_sock != INVALID_SOCKET) closesocket(session->data_sock);
-    if (session->pasv_sock != INVALID_SOCKET) closesocket(session->pasv_sock);
-    
-    // Regresar al directorio raíz del proyecto antes de que el hilo muera
-    _chdir(root_dir); 
-    free(session);
-    
     return 0;
 }
 
+// Sube el límite de descriptores abiertos para soportar miles de sesiones
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int run_event_engine(void) {
+    static EventEngine engines[LISTENER_MAX_SOCKETS];
+    int workers = listener.acceptors; // Un hilo por socket de escucha (ver main)
+
+    raise_fd_limit();
+    if (!transfer_pool_init()) {
+        printf("Error al crear el pool de transferencias\n");
+        return 1;
+    }
+
+    for (int i = 0; i < listener.socket_count; i++) {
+        if (set_socket_blocking(listener.sockets[i], 0) != 0) {
+            printf("Error al registrar el socket de escucha: %d\n", errno);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        EventEngine* engine = &engines[i];
+        engine->index = i % listener.socket_count;
+        engine->epfd = epoll_create1(0);
+
+        // Sin SO_REUSEPORT los hilos comparten un socket: EPOLLEXCLUSIVE
+        // despierta a uno solo por conexión nueva
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (listener.socket_count < workers ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = NULL;
+        if (engine->epfd < 0 ||
+            epoll_ctl(engine->epfd, EPOLL_CTL_ADD, listener.sockets[engine->index], &ev) != 0) {
+            printf("Error al crear el motor de eventos: %d\n", errno);
+            return 1;
+        }
+    }
+    printf("Motor de eventos epoll con %d hilos (%d sockets de escucha)\n", workers, listener.socket_count);
+
+    for (int i = 1; i < workers; i++) {
+        if (!spawn_thread(engine_worker, &engines[i])) {
+            printf("Error al crear hilo de trabajo %d\n", i);
+        }
+    }
+    // El hilo principal también atiende eventos
+    return (int)engine_worker(&engines[0]);
+}
+#endif
+
 int main() {
+#ifdef _WIN32
     // Configurar consola para UTF-8 (acentos)
     SetConsoleOutputCP(65001);
 
     WSADATA wsa;
-    SOCKET server_sock;
-    struct sockaddr_in server_addr, client_addr;
-    int client_addr_len = sizeof(client_addr);
-    
+#else
+    // Un cliente que cierra el canal de datos no debe terminar el proceso
+    signal(SIGPIPE, SIG_IGN);
+#endif
     printf("=== Servidor FTP Mejorado ===\n");
-    
+
     // Crear directorios necesarios
-    CreateDirectoryA("logs", NULL);
-    CreateDirectoryA("config", NULL);
-    CreateDirectoryA("ftp", NULL);
-    
+    make_dir("logs");
+    make_dir("config");
+    make_dir("ftp");
+
     // Crear subdirectorios de usuarios base
-    CreateDirectoryA("ftp\\admin", NULL);
-    CreateDirectoryA("ftp\\user", NULL);
-    CreateDirectoryA("ftp\\test", NULL);
+    make_dir("ftp/admin");
+    make_dir("ftp/user");
+    make_dir("ftp/test");
 
     // Crear archivo de usuarios si no existe
     FILE* users_file = fopen(USERS_FILE, "r");
@@ -619,67 +5509,75 @@ int main() {
     } else {
         fclose(users_file);
     }
-    
+
+    load_config(&config);
+
+    // Tabla de usuarios compartida: se carga una vez y se recarga si el archivo cambia
+    InitializeCriticalSection(&user_reload_cs);
+    reload_users();
+    spawn_thread(users_watcher, NULL);
+
+#ifdef _WIN32
     printf("Inicializando Winsock...\n");
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
         printf("Error al inicializar Winsock: %d\n", WSAGetLastError());
         return 1;
     }
-    
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock == INVALID_SOCKET) {
-        printf("Error al crear socket: %d\n", WSAGetLastError());
-        WSACleanup();
-        return 1;
-    }
-    
-    // Permitir reuso de direccion
-    int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-    
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(FTP_PORT);
-    
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        printf("Error en bind (puerto %d): %d\n", FTP_PORT, WSAGetLastError());
+#endif
+
+    // Sockets de escucha (SO_REUSEPORT por hilo donde exista) con límites de admisión
+    ListenerConfig listen_cfg;
+    memset(&listen_cfg, 0, sizeof(listen_cfg));
+    listen_cfg.port = config.port;
+    listen_cfg.acceptors = config.workers > 0 ? config.workers : cpu_count();
+    listen_cfg.max_connections = config.max_connections;
+    listen_cfg.max_per_ip = config.max_per_ip;
+    listen_cfg.busy_reply = "421 Too many connections, try again later.\r\n";
+    listen_cfg.per_ip_reply = "421 Too many connections from your address.\r\n";
+
+    if (listener_open(&listener, &listen_cfg) != 0) {
+        printf("Error en bind/listen (puerto %d): %d\n", config.port, WSAGetLastError());
         printf("Sugerencia: Ejecutar como Administrador o cambiar puerto\n");
-        closesocket(server_sock);
+#ifdef _WIN32
         WSACleanup();
+#endif
         return 1;
     }
-    
-    if (listen(server_sock, 10) == SOCKET_ERROR) {
-        printf("Error en listen: %d\n", WSAGetLastError());
-        closesocket(server_sock);
+
+    pasv_pool_init();
+    listing_cache_init();
+    rate_init();
+    dedup_init();
+    pack_init();
+    tree_index_init();
+    metrics_init();
+    upload_pool_init();
+    file_cache_init();
+    checksums_init();
+    checksum_cache_init();
+
+    if (!logger_start()) {
+        printf("Error al abrir el archivo de log\n");
+#ifdef _WIN32
         WSACleanup();
+#endif
         return 1;
     }
-    
-    FILE* log_file = fopen(LOG_FILE, "a");
-    printf("Servidor FTP iniciado en puerto %d\n", FTP_PORT);
+    printf("Servidor FTP iniciado en puerto %d (%d sockets de escucha)\n", config.port, listener.socket_count);
     printf("Esperando conexiones...\n\n");
-    
-    while (1) {
-        SOCKET client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &client_addr_len);
-        if (client_sock == INVALID_SOCKET) {
-            printf("Error al aceptar conexión: %d\n", WSAGetLastError());
-            continue;
-        }
-        
-        ClientSession* session = (ClientSession*)malloc(sizeof(ClientSession));
-        session->ctrl_sock = client_sock;
-        session->data_sock = INVALID_SOCKET;
-        session->pasv_sock = INVALID_SOCKET;
-        session->logged_in = 0;
-        session->client_addr = client_addr;
-        session->log_file = log_file;
-        
-        CreateThread(NULL, 0, client_handler, session, 0, NULL);
-    }
-    
-    fclose(log_file);
-    closesocket(server_sock);
+
+#ifdef __linux__
+    int result = run_event_engine();
+    logger_stop();
+    return result;
+#else
+    // Varios hilos aceptadores; cada sesión admitida tiene su propio hilo
+    listener_run(&listener, on_client_accepted, NULL);
+
+    logger_stop();
+#ifdef _WIN32
     WSACleanup();
+#endif
     return 0;
-}
\ No newline at end of file
+#endif
+}
@@ -0,0 +1,311 @@
+// bench.c - Generador de carga HTTP para medir el servidor (req/s y latencia)
+// Compilar (Linux): gcc -O2 bench.c -o bench -lpthread
+// Uso: bench <host> <puerto> <conexiones> <segundos> [ruta] [hilos]
+//
+// Abre todas las conexiones persistentes, espera a que estén conectadas y
+// durante <segundos> mantiene una petición en curso por conexión (cada una
+// envía la siguiente al recibir la respuesta completa). Si el servidor cierra
+// la conexión (Connection: close, límite de peticiones) se reconecta. La
+// latencia es desde que se envía la petición hasta el último byte de la
+// respuesta; el tiempo de conexión no se cuenta.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_THREADS 64
+#define MAX_EVENTS 512
+#define HEADER_BUFFER 8192
+
+typedef struct {
+    int fd;
+    int connected;
+    int header_len;        // Bytes de cabecera acumulados en 'header'
+    long body_left;        // Bytes de cuerpo de la respuesta en curso por leer
+    int close_after;       // La respuesta en curso trae Connection: close
+    long long sent_at;     // ns
+    char header[HEADER_BUFFER];
+} BenchConn;
+
+typedef struct {
+    int index;
+    int first, count;      // Conexiones de este hilo
+    BenchConn* conns;
+    int epfd;
+    long long* samples;    // Latencias en µs de las respuestas medidas
+    long sample_count, sample_cap;
+    long errors, reconnects;
+} BenchThread;
+
+static struct sockaddr_in target;
+static char request[512];
+static int request_len;
+static volatile int phase = 0; // 0 = conectando, 1 = midiendo, 2 = fin
+static int connected_total = 0;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int conn_open(BenchThread* t, BenchConn* c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    int nodelay = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (connect(c->fd, (struct sockaddr*)&target, sizeof(target)) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->connected = 0;
+    c->header_len = 0;
+    c->body_left = -1;
+    c->close_after = 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = c;
+    return epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void conn_reopen(BenchThread* t, BenchConn* c) {
+    if (c->fd >= 0) {
+        epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    if (c->connected) __atomic_fetch_sub(&connected_total, 1, __ATOMIC_RELAXED);
+    c->connected = 0;
+    t->reconnects++;
+    if (conn_open(t, c) != 0) t->errors++;
+}
+
+static int conn_send(BenchConn* c) {
+    c->sent_at = now_ns();
+    return send(c->fd, request, request_len, MSG_NOSIGNAL) == request_len ? 0 : -1;
+}
+
+static void record(BenchThread* t, long long us) {
+    if (t->sample_count == t->sample_cap) {
+        long cap = t->sample_cap ? t->sample_cap * 2 : 65536;
+        long long* grown = realloc(t->samples, cap * sizeof(long long));
+        if (!grown) return;
+        t->samples = grown;
+        t->sample_cap = cap;
+    }
+    t->samples[t->sample_count++] = us;
+}
+
+// Valor de la cabecera 'name' en la cabecera de respuesta (terminada en '\0')
+static const char* find_header(const char* header, const char* name) {
+    size_t len = strlen(name);
+    for (const char* line = strstr(header, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, len) == 0 && line[2 + len] == ':') return line + 3 + len;
+    }
+    return NULL;
+}
+
+// Consume lo recibido. Devuelve 0 si la conexión sigue, -1 si hay que reconectar.
+static int conn_on_data(BenchThread* t, BenchConn* c, char* data, int n) {
+    while (n > 0) {
+        if (c->body_left < 0) {
+            int take = n < HEADER_BUFFER - 1 - c->header_len ? n : HEADER_BUFFER - 1 - c->header_len;
+            memcpy(c->header + c->header_len, data, take);
+            c->header_len += take;
+            c->header[c->header_len] = '\0';
+            char* end = strstr(c->header, "\r\n\r\n");
+            if (!end) {
+                if (c->header_len >= HEADER_BUFFER - 1) return -1;
+                return 0;
+            }
+            int used = (int)(end + 4 - c->header) - (c->header_len - take);
+            const char* length = find_header(c->header, "Content-Length");
+            const char* connection = find_header(c->header, "Connection");
+            c->body_left = length ? atol(length) : 0;
+            c->close_after = connection && strncasecmp(connection + strspn(connection, " "), "close", 5) == 0;
+            c->header_len = 0;
+            data += used;
+            n -= used;
+        }
+
+        long take = n < c->body_left ? n : c->body_left;
+        c->body_left -= take;
+        data += take;
+        n -= (int)take;
+        if (c->body_left > 0) return 0;
+
+        // Respuesta completa
+        if (phase == 1) record(t, (now_ns() - c->sent_at) / 1000);
+        c->body_left = -1;
+        if (c->close_after) return -1;
+        if (phase != 2 && conn_send(c) != 0) return -1;
+    }
+    return 0;
+}
+
+static void* bench_thread(void* param) {
+    BenchThread* t = (BenchThread*)param;
+    struct epoll_event events[MAX_EVENTS];
+    static __thread char buffer[65536];
+
+    t->epfd = epoll_create1(0);
+    for (int i = 0; i < t->count; i++) {
+        t->conns[i].fd = -1;
+        if (conn_open(t, &t->conns[i]) != 0) t->errors++;
+    }
+
+    while (phase != 2) {
+        int n = epoll_wait(t->epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            BenchConn* c = (BenchConn*)events[i].data.ptr;
+            if (events[i].events & EPOLLERR) {
+                t->errors++;
+                conn_reopen(t, c);
+                continue;
+            }
+            if (!c->connected && (events[i].events & EPOLLOUT)) {
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->connected = 1;
+                __atomic_fetch_add(&connected_total, 1, __ATOMIC_RELAXED);
+                if (conn_send(c) != 0) {
+                    t->errors++;
+                    conn_reopen(t, c);
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                int got = recv(c->fd, buffer, sizeof(buffer), 0);
+                if (got > 0) {
+                    if (conn_on_data(t, c, buffer, got) != 0) conn_reopen(t, c);
+                } else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    // Cierre sin Connection: close en mitad de una respuesta: error
+                    if (c->body_left >= 0 || c->header_len > 0 || got < 0) t->errors++;
+                    conn_reopen(t, c);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < t->count; i++) {
+        if (t->conns[i].fd >= 0) close(t->conns[i].fd);
+    }
+    close(t->epfd);
+    return NULL;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(long long* sorted, long count, double p) {
+    if (count == 0) return 0;
+    long index = (long)(p * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 5) {
+        printf("Uso: %s <host> <puerto> <conexiones> <segundos> [ruta] [hilos]\n", argv[0]);
+        return 1;
+    }
+    int connections = atoi(argv[3]);
+    int seconds = atoi(argv[4]);
+    const char* path = argc > 5 ? argv[5] : "/";
+    int threads = argc > 6 ? atoi(argv[6]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (threads > connections) threads = connections;
+    if (connections < 1 || seconds < 1) {
+        printf("Conexiones y segundos deben ser positivos\n");
+        return 1;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[1], argv[2], &hints, &res) != 0) {
+        printf("No se pudo resolver %s\n", argv[1]);
+        return 1;
+    }
+    memcpy(&target, res->ai_addr, sizeof(target));
+    freeaddrinfo(res);
+
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: bench\r\n\r\n",
+                           path, argv[1]);
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    static BenchThread workers[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    BenchConn* conns = calloc(connections, sizeof(BenchConn));
+    if (!conns) {
+        printf("Memoria insuficiente\n");
+        return 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].first = (int)((long)connections * i / threads);
+        workers[i].count = (int)((long)connections * (i + 1) / threads) - workers[i].first;
+        workers[i].conns = conns + workers[i].first;
+        pthread_create(&tids[i], NULL, bench_thread, &workers[i]);
+    }
+
+    // La medición empieza con todas las conexiones abiertas (o tras 10 s)
+    long long deadline = now_ns() + 10000000000LL;
+    while (__atomic_load_n(&connected_total, __ATOMIC_RELAXED) < connections && now_ns() < deadline) {
+        usleep(10000);
+    }
+    int open_at_start = __atomic_load_n(&connected_total, __ATOMIC_RELAXED);
+    long long start = now_ns();
+    phase = 1;
+    sleep(seconds);
+    phase = 2;
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+
+    long total = 0, errors = 0, reconnects = 0;
+    for (int i = 0; i < threads; i++) {
+        total += workers[i].sample_count;
+        errors += workers[i].errors;
+        reconnects += workers[i].reconnects;
+    }
+    long long* all = malloc((total ? total : 1) * sizeof(long long));
+    long pos = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + pos, workers[i].samples, workers[i].sample_count * sizeof(long long));
+        pos += workers[i].sample_count;
+    }
+    qsort(all, total, sizeof(long long), compare_samples);
+
+    printf("Conexiones: %d (%d abiertas al empezar), hilos: %d, %.1f s\n", connections, open_at_start, threads, elapsed);
+    printf("Peticiones: %ld (%.0f req/s), reconexiones: %ld, errores: %ld\n", total, total / elapsed, reconnects, errors);
+    printf("Latencia ms: p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+           percentile(all, total, 0.50), percentile(all, total, 0.90), percentile(all, total, 0.99),
+           percentile(all, total, 0.999), total ? all[total - 1] / 1000.0 : 0);
+    return 0;
+}
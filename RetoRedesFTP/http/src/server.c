@@ -1,33 +1,125 @@
 // server.c - Servidor HTTP robusto con diagnóstico de errores
-// Compilar: gcc server.c -o server.exe -lws2_32
+// Compilar (Windows): gcc server.c -o server.exe -lws2_32
+// Compilar (Linux):   gcc server.c -o server -lpthread
+//
+// En Linux las conexiones se atienden con un motor de eventos epoll (un hilo
+// por núcleo); en Windows, o compilando con -U__linux__, con un hilo por
+// conexión.
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
 #include <winsock2.h>
 #include <windows.h>
-#include <time.h>
+#include <direct.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
+#define SERVER_PLATFORM "Windows"
+#else
+// Capa de compatibilidad POSIX: se conservan los nombres de Winsock/Win32
+// para que los handlers sean los mismos en ambas plataformas.
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+typedef int SOCKET;
+typedef unsigned long DWORD;
+typedef void* LPVOID;
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+#define WINAPI
+#define INVALID_SOCKET (-1)
+#define closesocket(s) close(s)
+#define WSAGetLastError() errno
+#define InitializeCriticalSection(cs) pthread_mutex_init(cs, NULL)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define _stricmp strcasecmp
+#define _strnicmp strncasecmp
+#define localtime_s(tm, t) localtime_r(t, tm)
+#define gmtime_s(tm, t) gmtime_r(t, tm)
+#define Sleep(ms) usleep((ms) * 1000)
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+
+#define SERVER_PLATFORM "POSIX"
+#endif
+
+#include "../../../common/net_listener.h"
+
 #define PORT 8080
 #define BUFFER_SIZE 8192
+#define FILE_CHUNK 65536 // Bloque del cuerpo de un archivo por envío
 #define WWWROOT "../wwwroot"
 #define LOGFILE "../log/http.log"
 #define USERS_FILE "../../config/http_users.txt"
+#ifndef MAX_CONNECTIONS
+#ifdef __linux__
+#define MAX_CONNECTIONS 16384 // Conexiones abiertas en total (con epoll una conexión no ocupa un hilo)
+#else
+#define MAX_CONNECTIONS 256   // Conexiones abiertas en total
+#endif
+#endif
+#ifndef MAX_PER_IP
+#define MAX_PER_IP 32         // Conexiones abiertas por IP (0 = sin límite)
+#endif
+#define KEEPALIVE_TIMEOUT_MS 5000  // Conexión persistente sin peticiones: se cierra
+#define KEEPALIVE_MAX_REQUESTS 100 // Peticiones por conexión antes de cerrarla
+#define LOG_BUFFER_SIZE (1 << 20)  // Líneas de log pendientes de escribir
+#define LOG_FLUSH_MS 200           // Cada cuánto se vuelcan al archivo
 
 CRITICAL_SECTION log_cs;
-int total_requests = 0;
-int total_ok = 0;
-int total_errors = 0;
+CRITICAL_SECTION log_file_cs;
+// Contadores compartidos por todos los hilos: se incrementan con InterlockedIncrement
+volatile long total_requests = 0;
+volatile long total_ok = 0;
+volatile long total_errors = 0;
+Listener listener;
+
+// --- Conexión con un cliente (persistente en HTTP/1.1) ---
+typedef struct {
+    SOCKET sock;
+    char ip[32];
+    int keep_alive; // La respuesta en curso deja la conexión abierta
+    int remaining;  // Peticiones que aún se atenderán por esta conexión
+    int head;       // Petición HEAD: cabeceras sin cuerpo
+    // Motor de eventos: las respuestas se acumulan aquí y el bucle las envía
+    // cuando el socket lo admite. En el modelo de hilos se envían directamente.
+    int buffered;
+    char *out;
+    long out_len;   // Bytes acumulados
+    long out_sent;  // Bytes ya enviados
+    long out_cap;
+    FILE *file;     // Cuerpo de archivo que se envía tras 'out' (sólo motor de eventos)
+    long long file_off;
+    long long file_left;
+} Connection;
 
 // --- Prototipos ---
-DWORD WINAPI client_thread(LPVOID lpParam);
-void serve_file(SOCKET client, const char *path, const char *ip, const char *method);
-void handle_echo(SOCKET client, const char *body, const char *ip);
-void handle_echo_info(SOCKET client, const char *ip);
-void handle_status(SOCKET client, const char *ip);
-void send_response(SOCKET client, int code, const char *msg, const char *type, const char *body);
+void serve_file(Connection *conn, const char *path, const char *method);
+void handle_echo(Connection *conn, const char *body);
+void handle_echo_info(Connection *conn);
+void handle_status(Connection *conn);
+void send_response(Connection *conn, int code, const char *msg, const char *type, const char *body);
+void send_response_len(Connection *conn, int code, const char *msg, const char *type, const char *body, long body_len);
 void log_event(const char *ip, const char *method, const char *path, int status);
 const char *get_mime_type(const char *filename);
 
@@ -46,53 +138,147 @@ const char *get_mime_type(const char *filename) {
 }
 
 // --- Logger ---
+// Las peticiones sólo copian su línea a un buffer en memoria (bajo log_cs,
+// sin tocar el disco) y el hilo log_writer la vuelca a LOGFILE cada
+// LOG_FLUSH_MS. Con el buffer lleno la línea se descarta y se cuenta.
+char *log_buffer = NULL; // Se llena con las peticiones
+char *log_spare = NULL;  // El que está escribiendo log_flush
+int log_len = 0;
+long log_dropped = 0;
+time_t log_stamp_time = 0;
+char log_stamp[32];      // Fecha ya formateada del segundo actual
+FILE *log_file = NULL;
+
 void log_event(const char *ip, const char *method, const char *path, int status) {
+    time_t now = time(NULL);
     EnterCriticalSection(&log_cs);
-    FILE *f = fopen(LOGFILE, "a");
-    if (!f) {
-        printf("No se pudo escribir en el log.\n");
+    if (!log_buffer) {
         LeaveCriticalSection(&log_cs);
         return;
     }
-    time_t now = time(NULL);
-    struct tm t;
-    localtime_s(&t, &now);
-    fprintf(f, "[%04d-%02d-%02d %02d:%02d:%02d] %s %s %s -> %d\n",
-            t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
-            t.tm_hour, t.tm_min, t.tm_sec,
-            ip, method, path, status);
-    fclose(f);
+    if (now != log_stamp_time) {
+        struct tm t;
+        localtime_s(&t, &now);
+        strftime(log_stamp, sizeof(log_stamp), "[%Y-%m-%d %H:%M:%S]", &t);
+        log_stamp_time = now;
+    }
+    int room = LOG_BUFFER_SIZE - log_len;
+    int n = snprintf(log_buffer + log_len, room, "%s %s %s %s -> %d\n", log_stamp, ip, method, path, status);
+    if (n >= 0 && n < room) log_len += n;
+    else log_dropped++;
     LeaveCriticalSection(&log_cs);
 }
 
+// Escribe lo acumulado intercambiando los buffers: log_cs sólo se toma
+// para el intercambio, nunca mientras se escribe
+void log_flush(void) {
+    EnterCriticalSection(&log_file_cs);
+    EnterCriticalSection(&log_cs);
+    char *batch = log_buffer;
+    int len = log_len;
+    long dropped = log_dropped;
+    char stamp[sizeof(log_stamp)];
+    memcpy(stamp, log_stamp, sizeof(stamp));
+    log_buffer = log_spare;
+    log_spare = batch;
+    log_len = 0;
+    log_dropped = 0;
+    LeaveCriticalSection(&log_cs);
+
+    if (len > 0 || dropped > 0) {
+        if (!log_file) log_file = fopen(LOGFILE, "a");
+        if (log_file) {
+            fwrite(batch, 1, len, log_file);
+            if (dropped > 0) fprintf(log_file, "%s log buffer full, %ld lines dropped\n", stamp, dropped);
+            fflush(log_file);
+        } else {
+            printf("No se pudo escribir en el log.\n");
+        }
+    }
+    LeaveCriticalSection(&log_file_cs);
+}
+
+DWORD WINAPI log_writer(LPVOID param) {
+    (void)param;
+    for (;;) {
+        Sleep(LOG_FLUSH_MS);
+        log_flush();
+    }
+    return 0;
+}
+
+// --- Envío completo (send puede aceptar menos bytes de los pedidos) ---
+int send_all(SOCKET sock, const char *data, long len) {
+    while (len > 0) {
+        int chunk = len > 1048576 ? 1048576 : (int)len;
+        int sent = send(sock, data, chunk, 0);
+        if (sent <= 0) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// --- Salida hacia el cliente (directa o acumulada, según el modelo) ---
+int conn_send(Connection *conn, const char *data, long len) {
+    if (!conn->buffered) return send_all(conn->sock, data, len);
+    if (conn->out_len + len > conn->out_cap) {
+        long cap = conn->out_cap ? conn->out_cap : 4096;
+        while (cap < conn->out_len + len) cap *= 2;
+        char *grown = realloc(conn->out, cap);
+        if (!grown) return -1;
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
 // --- Respuesta genérica ---
-void send_response(SOCKET client, int code, const char *msg, const char *type, const char *body) {
-    char header[1024];
+// Con keep-alive el cliente separa las respuestas por Content-Length, así que
+// HEAD nunca lleva cuerpo. Las respuestas pequeñas van en un solo send.
+void send_response_len(Connection *conn, int code, const char *msg, const char *type, const char *body, long body_len) {
+    char packet[BUFFER_SIZE];
     char date[64];
     time_t now = time(NULL);
     struct tm t;
     gmtime_s(&t, &now);
     strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &t);
 
-    int body_len = body ? (int)strlen(body) : 0;
-    int len = snprintf(header, sizeof(header),
+    char connection[96];
+    if (conn->keep_alive)
+        snprintf(connection, sizeof(connection), "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+                 KEEPALIVE_TIMEOUT_MS / 1000, conn->remaining);
+    else
+        snprintf(connection, sizeof(connection), "Connection: close\r\n");
+
+    int len = snprintf(packet, sizeof(packet),
         "HTTP/1.1 %d %s\r\n"
         "Date: %s\r\n"
-        "Server: RetoHTTP/1.1 (Windows)\r\n"
+        "Server: RetoHTTP/1.1 (" SERVER_PLATFORM ")\r\n"
         "Content-Type: %s\r\n"
-        "Content-Length: %d\r\n"
-        "Connection: close\r\n\r\n",
-        code, msg, date, type, body_len);
+        "Content-Length: %ld\r\n"
+        "%s\r\n",
+        code, msg, date, type, body_len, connection);
+    if (len <= 0 || len >= (int)sizeof(packet)) return;
 
-    if (len > 0 && len < (int)sizeof(header)) {
-        send(client, header, len, 0);
-        if (body_len > 0 && body)
-            send(client, body, body_len, 0);
+    if (conn->head || body_len <= 0 || !body) {
+        conn_send(conn, packet, len);
+    } else if (body_len <= (long)sizeof(packet) - len) {
+        memcpy(packet + len, body, body_len);
+        conn_send(conn, packet, len + body_len);
+    } else if (conn_send(conn, packet, len) == 0) {
+        conn_send(conn, body, body_len);
     }
 }
 
+void send_response(Connection *conn, int code, const char *msg, const char *type, const char *body) {
+    send_response_len(conn, code, msg, type, body, body ? (long)strlen(body) : 0);
+}
+
 // --- /api/echo (POST) ---
-void handle_echo(SOCKET client, const char *body, const char *ip) {
+void handle_echo(Connection *conn, const char *body) {
     char escaped_body[BUFFER_SIZE] = {0};
     if (body && strlen(body) > 0) {
         char *dst = escaped_body;
@@ -110,171 +296,699 @@ void handle_echo(SOCKET client, const char *body, const char *ip) {
     snprintf(json, sizeof(json),
         "{\n  \"method\": \"POST\",\n  \"endpoint\": \"/api/echo\",\n  \"echo\": \"%s\"\n}",
         escaped_body[0] ? escaped_body : "");
-    send_response(client, 200, "OK", "application/json", json);
-    log_event(ip, "POST", "/api/echo", 200);
-    total_ok++;
+    send_response(conn, 200, "OK", "application/json", json);
+    log_event(conn->ip, "POST", "/api/echo", 200);
+    InterlockedIncrement(&total_ok);
 }
 
 // --- /api/echo (GET) ---
-void handle_echo_info(SOCKET client, const char *ip) {
+void handle_echo_info(Connection *conn) {
     const char *msg =
         "<html><body><h1>/api/echo</h1>"
         "<p>Este endpoint acepta POST con texto plano.</p>"
         "<p>Ejemplo: <pre>curl -X POST http://localhost:8080/api/echo -d \"Hola\"</pre></p>"
         "</body></html>";
-    send_response(client, 200, "OK", "text/html", msg);
-    log_event(ip, "GET", "/api/echo", 200);
-    total_ok++;
+    send_response(conn, 200, "OK", "text/html", msg);
+    log_event(conn->ip, "GET", "/api/echo", 200);
+    InterlockedIncrement(&total_ok);
 }
 
 // --- /status ---
-void handle_status(SOCKET client, const char *ip) {
+void handle_status(Connection *conn) {
     char html[1024];
+    char stats[256];
+    listener_format_stats(&listener, stats, sizeof(stats));
     snprintf(html, sizeof(html),
         "<html><head><title>Status</title></head><body>"
         "<h1>Estado del Servidor</h1>"
-        "<p>Total requests: %d</p>"
-        "<p>Respuestas 200 OK: %d</p>"
-        "<p>Errores: %d</p>"
+        "<p>Total requests: %ld</p>"
+        "<p>Respuestas 200 OK: %ld</p>"
+        "<p>Errores: %ld</p>"
+        "<p>Conexiones: %s</p>"
         "</body></html>",
-        total_requests, total_ok, total_errors);
-    send_response(client, 200, "OK", "text/html", html);
-    log_event(ip, "GET", "/status", 200);
-    total_ok++;
+        total_requests, total_ok, total_errors, stats);
+    send_response(conn, 200, "OK", "text/html", html);
+    log_event(conn->ip, "GET", "/status", 200);
+    InterlockedIncrement(&total_ok);
 }
 
 // --- Archivos estáticos ---
-void serve_file(SOCKET client, const char *path, const char *ip, const char *method) {
+// Hasta FILE_CHUNK bytes el archivo va en la misma respuesta que las
+// cabeceras; uno mayor nunca se carga entero en memoria: tras las cabeceras
+// el cuerpo sale por bloques de FILE_CHUNK (en el motor de eventos, con
+// sendfile a medida que el socket lo admite).
+void serve_file(Connection *conn, const char *path, const char *method) {
     FILE *file = fopen(path, "rb");
     if (!file) {
         const char *msg = "<h1>404 Not Found</h1>";
-        send_response(client, 404, "Not Found", "text/html", msg);
-        total_errors++;
-        log_event(ip, method, path, 404);
+        send_response(conn, 404, "Not Found", "text/html", msg);
+        InterlockedIncrement(&total_errors);
+        log_event(conn->ip, method, path, 404);
         return;
     }
 
     fseek(file, 0, SEEK_END);
     long size = ftell(file);
     rewind(file);
+    if (size < 0) {
+        fclose(file);
+        send_response(conn, 500, "Internal Server Error", "text/html", "<h1>500 Internal Server Error</h1>");
+        InterlockedIncrement(&total_errors);
+        return;
+    }
 
-    char *content = malloc(size + 1);
-    if (!content) {
+    char *chunk = malloc(FILE_CHUNK);
+    if (!chunk) {
         printf("Error: memoria insuficiente al servir archivo %s\n", path);
         fclose(file);
-        send_response(client, 500, "Internal Server Error", "text/html", "<h1>500 Internal Server Error</h1>");
-        total_errors++;
+        send_response(conn, 500, "Internal Server Error", "text/html", "<h1>500 Internal Server Error</h1>");
+        InterlockedIncrement(&total_errors);
+        return;
+    }
+    int whole = size <= FILE_CHUNK && !conn->head;
+    if (whole && fread(chunk, 1, size, file) != (size_t)size) {
+        free(chunk);
+        fclose(file);
+        send_response(conn, 500, "Internal Server Error", "text/html", "<h1>500 Internal Server Error</h1>");
+        InterlockedIncrement(&total_errors);
         return;
     }
 
-    size_t bytes_read = fread(content, 1, size, file);
-    fclose(file);
-    if (bytes_read != (size_t)size) {
-        free(content);
-        send_response(client, 500, "Internal Server Error", "text/html", "<h1>500 Internal Server Error</h1>");
-        total_errors++;
+    // Texto y binario por igual: la longitud es la del archivo, no strlen
+    send_response_len(conn, 200, "OK", get_mime_type(path), whole ? chunk : NULL, size);
+    log_event(conn->ip, method, path, 200);
+    InterlockedIncrement(&total_ok);
+
+    if (whole || conn->head) {
+        free(chunk);
+        fclose(file);
+        return;
+    }
+    if (conn->buffered) {
+        free(chunk);
+        conn->file = file;
+        conn->file_off = 0;
+        conn->file_left = size;
         return;
     }
 
-    const char *mime_type = get_mime_type(path);
-    if (strncmp(mime_type, "text/", 5) == 0 || 
-        strcmp(mime_type, "application/javascript") == 0 ||
-        strcmp(mime_type, "application/json") == 0) {
-        content[size] = '\0';
-        send_response(client, 200, "OK", mime_type, content);
-    } else {
-        char header[1024];
-        char date[64];
-        time_t now = time(NULL);
-        struct tm t;
-        gmtime_s(&t, &now);
-        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &t);
-        
-        int len = snprintf(header, sizeof(header),
-            "HTTP/1.1 200 OK\r\n"
-            "Date: %s\r\n"
-            "Server: RetoHTTP/1.1 (Windows)\r\n"
-            "Content-Type: %s\r\n"
-            "Content-Length: %ld\r\n"
-            "Connection: close\r\n\r\n",
-            date, mime_type, size);
-            
-        if (len > 0 && len < (int)sizeof(header)) {
-            send(client, header, len, 0);
-            if (strcmp(method, "HEAD") != 0)
-                send(client, content, size, 0);
+    long left = size;
+    while (left > 0) {
+        size_t n = fread(chunk, 1, left < FILE_CHUNK ? (size_t)left : FILE_CHUNK, file);
+        if (n == 0 || send_all(conn->sock, chunk, (long)n) != 0) break;
+        left -= (long)n;
+    }
+    free(chunk);
+    fclose(file);
+    // Cuerpo incompleto: el cliente sólo puede detectarlo si se cierra
+    if (left > 0) conn->keep_alive = 0;
+}
+
+// --- Cabeceras de la petición ---
+// Copia el valor de la cabecera 'name' (sin distinguir mayúsculas) a 'out'.
+// 'headers' apunta tras la línea de petición y termina en la línea vacía.
+int get_header(const char *headers, const char *name, char *out, size_t size) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(headers, "\r\n");
+    while (line && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if (!eol) break;
+        if (_strnicmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') value++;
+            size_t len = eol - value;
+            if (len >= size) len = size - 1;
+            memcpy(out, value, len);
+            out[len] = '\0';
+            return 1;
         }
+        line = eol;
     }
+    return 0;
+}
 
-    log_event(ip, method, path, 200);
-    total_ok++;
-    free(content);
+// ¿La lista separada por comas 'value' contiene 'token'? (Connection: keep-alive, Upgrade)
+int has_token(const char *value, const char *token) {
+    size_t token_len = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == ',') value++;
+        size_t len = strcspn(value, ", ");
+        if (len == token_len && _strnicmp(value, token, len) == 0) return 1;
+        value += len;
+    }
+    return 0;
 }
 
-// --- Hilo del cliente ---
-DWORD WINAPI client_thread(LPVOID lpParam) {
-    SOCKET client = ((SOCKET*)lpParam)[0];
-    struct sockaddr_in clientAddr = ((struct sockaddr_in*)(((char*)lpParam) + sizeof(SOCKET)))[0];
-    free(lpParam);
+// Longitud de la petición completa (cabeceras + Content-Length) al principio
+// del buffer: 0 si aún está incompleta, -1 si no cabe en el buffer y -2 si
+// Content-Length no es un número válido.
+int request_length(char *buffer, int buffered) {
+    buffer[buffered] = '\0';
+    char *end = strstr(buffer, "\r\n\r\n");
+    if (!end) return buffered >= BUFFER_SIZE - 1 ? -1 : 0;
 
-    char ip[32];
-    strcpy(ip, inet_ntoa(clientAddr.sin_addr));
+    char value[32];
+    long header_len = (long)(end - buffer) + 4;
+    long body_len = 0;
+    if (get_header(buffer, "Content-Length", value, sizeof(value))) {
+        // Sólo dígitos (sin signo), sin desbordar y sin nada detrás salvo espacios
+        char *rest;
+        errno = 0;
+        body_len = strtol(value, &rest, 10);
+        while (*rest == ' ' || *rest == '\t') rest++;
+        if (value[0] < '0' || value[0] > '9' || errno == ERANGE || *rest != '\0') return -2;
+    }
+    // Se compara contra el espacio libre: header_len + body_len podría desbordar
+    if (body_len > BUFFER_SIZE - 1 - header_len) return -1;
+    return buffered - header_len >= body_len ? (int)(header_len + body_len) : 0;
+}
 
-    char buffer[BUFFER_SIZE];
-    int bytes = recv(client, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes <= 0) {
-        closesocket(client);
-        return 0;
+// Rechaza una petición que request_length no pudo delimitar; tras ella se cierra
+void reject_request(Connection *conn, int len) {
+    conn->keep_alive = 0;
+    if (len == -2) {
+        send_response(conn, 400, "Bad Request", "text/html", "<h1>400 Bad Request</h1>");
+    } else {
+        send_response(conn, 413, "Payload Too Large", "text/html", "<h1>413 Payload Too Large</h1>");
     }
+    InterlockedIncrement(&total_errors);
+}
 
-    buffer[bytes] = '\0';
-    total_requests++;
+// Atiende la petición de 'len' bytes al principio de 'request'. Devuelve 1 si
+// la conexión sigue abierta para la siguiente.
+int handle_request(Connection *conn, char *request, int len) {
+    char saved = request[len];
+    request[len] = '\0'; // Las peticiones encadenadas que siguen quedan fuera
+    InterlockedIncrement(&total_requests);
 
-    char method[16], path[256];
-    if (sscanf(buffer, "%15s %255s", method, path) != 2) {
-        send_response(client, 400, "Bad Request", "text/html", "<h1>400 Bad Request</h1>");
-        total_errors++;
-        closesocket(client);
+    char method[16], path[256], version[16] = "HTTP/1.0";
+    if (sscanf(request, "%15s %255s %15s", method, path, version) < 2) {
+        conn->keep_alive = 0;
+        conn->head = 0;
+        send_response(conn, 400, "Bad Request", "text/html", "<h1>400 Bad Request</h1>");
+        InterlockedIncrement(&total_errors);
+        request[len] = saved;
         return 0;
     }
 
-    char *body = strstr(buffer, "\r\n\r\n");
-    if (body) body += 4; else body = "";
+    // HTTP/1.1 mantiene la conexión salvo "Connection: close"; HTTP/1.0 sólo
+    // con "Connection: keep-alive". Un cuerpo chunked no se sabe delimitar:
+    // tras responder se cierra.
+    char value[128];
+    int has_connection = get_header(request, "Connection", value, sizeof(value));
+    if (strcmp(version, "HTTP/1.1") == 0)
+        conn->keep_alive = !(has_connection && has_token(value, "close"));
+    else
+        conn->keep_alive = has_connection && has_token(value, "keep-alive");
+    if (get_header(request, "Transfer-Encoding", value, sizeof(value))) conn->keep_alive = 0;
+    if (--conn->remaining <= 0) conn->keep_alive = 0;
+    conn->head = _stricmp(method, "HEAD") == 0;
 
-    printf("%s %s %s\n", ip, method, path);
+    char *body = strstr(request, "\r\n\r\n");
+    if (body) body += 4; else body = "";
 
     if (strcmp(path, "/status") == 0) {
-        handle_status(client, ip);
+        handle_status(conn);
     } else if (strcmp(path, "/api/echo") == 0) {
-        if (_stricmp(method, "POST") == 0) handle_echo(client, body, ip);
-        else handle_echo_info(client, ip);
-    } else if (_stricmp(method, "GET") == 0 || _stricmp(method, "HEAD") == 0) {
+        if (_stricmp(method, "POST") == 0) handle_echo(conn, body);
+        else handle_echo_info(conn);
+    } else if (_stricmp(method, "GET") == 0 || conn->head) {
         if (strcmp(path, "/") == 0) strcpy(path, "/index.html");
         char fullpath[512];
         snprintf(fullpath, sizeof(fullpath), "%s%s", WWWROOT, path);
-        serve_file(client, fullpath, ip, method);
+        serve_file(conn, fullpath, method);
     } else {
-        send_response(client, 405, "Method Not Allowed", "text/html", "<h1>405 Method Not Allowed</h1>");
-        log_event(ip, method, path, 405);
-        total_errors++;
+        send_response(conn, 405, "Method Not Allowed", "text/html", "<h1>405 Method Not Allowed</h1>");
+        log_event(conn->ip, method, path, 405);
+        InterlockedIncrement(&total_errors);
+    }
+
+    request[len] = saved;
+    return conn->keep_alive;
+}
+
+#ifndef _WIN32
+typedef struct {
+    DWORD (*fn)(LPVOID);
+    LPVOID arg;
+} ThreadStart;
+
+static void* thread_trampoline(void *param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return NULL;
+}
+#endif
+
+// --- Hilo suelto (no se espera su fin): 1 si se creó ---
+int spawn_thread(DWORD (WINAPI *fn)(LPVOID), LPVOID arg) {
+#ifdef _WIN32
+    HANDLE h = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    if (!h) return 0;
+    CloseHandle(h);
+    return 1;
+#else
+    ThreadStart *start = malloc(sizeof(ThreadStart));
+    pthread_t tid;
+    if (!start) return 0;
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(&tid, NULL, thread_trampoline, start) != 0) {
+        free(start);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+#endif
+}
+
+#ifndef __linux__
+// --- Hilo del cliente ---
+// Atiende peticiones por la misma conexión hasta que el cliente la cierra,
+// pide cerrarla, pasa KEEPALIVE_TIMEOUT_MS sin enviar nada o se alcanza
+// KEEPALIVE_MAX_REQUESTS. Las peticiones encadenadas (pipelining) que ya
+// están en el buffer se atienden en orden, así que las respuestas salen en
+// el mismo orden que las peticiones.
+DWORD WINAPI client_thread(LPVOID lpParam) {
+    SOCKET client = ((SOCKET*)lpParam)[0];
+    struct sockaddr_in clientAddr = ((struct sockaddr_in*)(((char*)lpParam) + sizeof(SOCKET)))[0];
+    free(lpParam);
+
+    Connection conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.sock = client;
+    conn.remaining = KEEPALIVE_MAX_REQUESTS;
+    strcpy(conn.ip, inet_ntoa(clientAddr.sin_addr));
+
+    // Espera máxima por la siguiente petición, y sin Nagle: la respuesta de
+    // una conexión persistente no debe quedar retenida esperando un ACK
+#ifdef _WIN32
+    DWORD timeout = KEEPALIVE_TIMEOUT_MS;
+#else
+    struct timeval timeout = { KEEPALIVE_TIMEOUT_MS / 1000, (KEEPALIVE_TIMEOUT_MS % 1000) * 1000 };
+#endif
+    int nodelay = 1;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+
+    char buffer[BUFFER_SIZE];
+    int buffered = 0;
+    for (;;) {
+        int len = request_length(buffer, buffered);
+        if (len == 0) {
+            int bytes = recv(client, buffer + buffered, BUFFER_SIZE - 1 - buffered, 0);
+            if (bytes <= 0) break; // El cliente cerró o se agotó la espera
+            buffered += bytes;
+            continue;
+        }
+        if (len < 0) {
+            reject_request(&conn, len);
+            // Cerrar con datos sin leer envía RST y el cliente podría perder
+            // la respuesta: se cierra el envío y se descarta el resto
+            shutdown(client, 1);
+            while (recv(client, buffer, sizeof(buffer), 0) > 0) {}
+            break;
+        }
+        int keep_open = handle_request(&conn, buffer, len);
+        buffered -= len;
+        memmove(buffer, buffer + len, buffered);
+        if (!keep_open) break;
     }
 
     closesocket(client);
+    listener_release(&listener, &clientAddr);
     return 0;
 }
 
+// --- Conexión admitida por el listener: un hilo por cliente ---
+void on_client_accepted(Listener *l, SOCKET client, const struct sockaddr_in *clientAddr, void *ctx) {
+    (void)ctx;
+    void *bundle = malloc(sizeof(SOCKET) + sizeof(struct sockaddr_in));
+    if (!bundle) {
+        closesocket(client);
+        listener_release(l, clientAddr);
+        return;
+    }
+    memcpy(bundle, &client, sizeof(SOCKET));
+    memcpy((char*)bundle + sizeof(SOCKET), clientAddr, sizeof(struct sockaddr_in));
+
+    if (!spawn_thread(client_thread, bundle)) {
+        free(bundle);
+        closesocket(client);
+        listener_release(l, clientAddr);
+    }
+}
+#endif
+
+#ifdef __linux__
+// ==================== MOTOR DE EVENTOS (epoll) ====================
+// Un hilo por núcleo, cada uno con su propio epoll y su propio socket de
+// escucha SO_REUSEPORT: el kernel reparte las conexiones nuevas entre los
+// sockets y cada conexión vive siempre en el mismo hilo, sin bloqueos entre
+// hilos. Los sockets son no bloqueantes y cada conexión es una máquina de
+// estados guardada en HttpConn: se lee hasta tener una petición completa, se
+// atiende acumulando la respuesta, y se envía lo que el socket admita; el
+// resto espera a EPOLLOUT. Con mucha salida pendiente, o mientras se envía
+// el cuerpo de un archivo, no se atienden más peticiones encadenadas, así un
+// cliente que no lee no hace crecer el buffer.
+
+#define MAX_EVENTS 256
+#define OUTPUT_HIGH_WATER 65536 // Salida pendiente a partir de la cual se deja de leer
+#define FILE_BURST 16            // Bloques de archivo por evento: no acapara el hilo
+
+typedef struct HttpConn {
+    Connection conn;
+    struct sockaddr_in addr;
+    char in[BUFFER_SIZE];
+    int inlen;
+    int closing;                  // Cerrar al terminar de enviar la salida pendiente
+    unsigned int events;          // Eventos registrados en epoll
+    long long last_active;        // ms (reloj monotónico)
+    struct HttpConn *prev, *next; // Lista del hilo por actividad, la más antigua primero
+} HttpConn;
+
+typedef struct {
+    int epfd;
+    int index; // Socket de escucha propio: listener.sockets[index]
+    HttpConn *oldest, *newest;
+} EventWorker;
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_socket_blocking(SOCKET sock, int blocking) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return -1;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(sock, F_SETFL, flags);
+}
+
+static void worker_unlink(EventWorker *w, HttpConn *c) {
+    if (c->prev) c->prev->next = c->next; else w->oldest = c->next;
+    if (c->next) c->next->prev = c->prev; else w->newest = c->prev;
+    c->prev = c->next = NULL;
+}
+
+// Marca actividad: la conexión pasa al final de la lista
+static void worker_touch(EventWorker *w, HttpConn *c, long long now) {
+    c->last_active = now;
+    if (w->newest == c) return;
+    if (c->prev || w->oldest == c) worker_unlink(w, c);
+    c->prev = w->newest;
+    if (w->newest) w->newest->next = c; else w->oldest = c;
+    w->newest = c;
+}
+
+static void http_conn_close(EventWorker *w, HttpConn *c) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->conn.sock, NULL);
+    worker_unlink(w, c);
+    closesocket(c->conn.sock);
+    listener_release(&listener, &c->addr);
+    if (c->conn.file) fclose(c->conn.file);
+    free(c->conn.out);
+    free(c);
+}
+
+// Lee lo disponible sin bloquear. 0 si el cliente cerró o falló la conexión.
+static int http_conn_read(HttpConn *c) {
+    while (c->inlen < BUFFER_SIZE - 1) {
+        int space = BUFFER_SIZE - 1 - c->inlen;
+        int n = recv(c->conn.sock, c->in + c->inlen, space, 0);
+        if (n > 0) {
+            c->inlen += n;
+            if (n < space) return 1; // Vacío por ahora: epoll avisará si llega más
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    return 1;
+}
+
+// Atiende en orden las peticiones completas del buffer de entrada
+static void http_conn_process(HttpConn *c) {
+    while (!c->closing && !c->conn.file && c->conn.out_len - c->conn.out_sent < OUTPUT_HIGH_WATER) {
+        int len = request_length(c->in, c->inlen);
+        if (len == 0) return;
+        if (len < 0) {
+            reject_request(&c->conn, len);
+            c->closing = 1;
+            return;
+        }
+        if (!handle_request(&c->conn, c->in, len)) c->closing = 1;
+        c->inlen -= len;
+        memmove(c->in, c->in + len, c->inlen);
+    }
+}
+
+// Envía la salida pendiente sin bloquear. -1 si la conexión falló.
+static int http_conn_flush(HttpConn *c) {
+    Connection *conn = &c->conn;
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->sock, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            conn->out_sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    conn->out_len = conn->out_sent = 0;
+    // Tras una respuesta grande no se retiene el buffer en una conexión ociosa
+    if (conn->out_cap > OUTPUT_HIGH_WATER) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_cap = 0;
+    }
+
+    // Cuerpo de archivo pendiente: del archivo al socket sin pasar por 'out'
+    for (int i = 0; i < FILE_BURST && conn->file; i++) {
+        off_t off = (off_t)conn->file_off;
+        size_t want = conn->file_left < FILE_CHUNK ? (size_t)conn->file_left : FILE_CHUNK;
+        ssize_t n = sendfile(conn->sock, fileno(conn->file), &off, want);
+        if (n > 0) {
+            conn->file_off += n;
+            conn->file_left -= n;
+            if (conn->file_left == 0) {
+                fclose(conn->file);
+                conn->file = NULL;
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        // n == 0: el archivo se acortó; el cliente no recibirá el cuerpo completo
+        return (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+    return 0;
+}
+
+static void http_conn_on_event(EventWorker *w, HttpConn *c, unsigned int events, long long now) {
+    if (events & EPOLLERR) {
+        http_conn_close(w, c);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP)) && !http_conn_read(c)) {
+        // Lo ya recibido se atiende antes de cerrar (el cliente pudo cerrar
+        // sólo su lado tras enviar las peticiones)
+        http_conn_process(c);
+        c->closing = 1;
+    }
+
+    // Al vaciarse la salida pueden quedar peticiones encadenadas retenidas
+    do {
+        http_conn_process(c);
+        if (http_conn_flush(c) != 0) {
+            http_conn_close(w, c);
+            return;
+        }
+    } while (!c->closing && c->conn.out_len == 0 && !c->conn.file && request_length(c->in, c->inlen) != 0);
+
+    if (c->closing && c->conn.out_len == 0 && !c->conn.file) {
+        // Cerrar con datos sin leer envía RST y el cliente podría perder la
+        // respuesta: se descarta lo que ya haya llegado (400/413, peticiones sobrantes)
+        char discard[4096];
+        for (int i = 0; i < 16 && recv(c->conn.sock, discard, sizeof(discard), 0) > 0; i++) {}
+        http_conn_close(w, c);
+        return;
+    }
+
+    unsigned int want = c->conn.out_len || c->conn.file ? EPOLLOUT : 0;
+    if (!c->closing && c->inlen < BUFFER_SIZE - 1 && c->conn.out_len - c->conn.out_sent < OUTPUT_HIGH_WATER)
+        want |= EPOLLIN;
+    if (want != c->events) {
+        struct epoll_event ev;
+        ev.events = want;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->conn.sock, &ev) != 0) {
+            http_conn_close(w, c);
+            return;
+        }
+        c->events = want;
+    }
+    worker_touch(w, c, now);
+}
+
+// Acepta todo lo pendiente en el socket de escucha del hilo (ya pasado por admisión)
+static void worker_accept(EventWorker *w, long long now) {
+    for (;;) {
+        struct sockaddr_in addr;
+        SOCKET sock = listener_accept(&listener, w->index, &addr);
+        if (sock == INVALID_SOCKET) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Error al aceptar conexión: %d\n", errno);
+            }
+            return;
+        }
+
+        HttpConn *c = calloc(1, sizeof(HttpConn));
+        if (!c || set_socket_blocking(sock, 0) != 0) {
+            free(c);
+            closesocket(sock);
+            listener_release(&listener, &addr);
+            continue;
+        }
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        c->conn.sock = sock;
+        c->conn.remaining = KEEPALIVE_MAX_REQUESTS;
+        c->conn.buffered = 1;
+        strcpy(c->conn.ip, inet_ntoa(addr.sin_addr));
+        c->addr = addr;
+        c->events = EPOLLIN;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+            closesocket(sock);
+            listener_release(&listener, &addr);
+            free(c);
+            continue;
+        }
+        worker_touch(w, c, now);
+    }
+}
+
+// Cierra las conexiones sin actividad en KEEPALIVE_TIMEOUT_MS (por petición
+// a medias, esperando la siguiente o con un cliente que no lee la respuesta)
+static void worker_expire(EventWorker *w, long long now) {
+    while (w->oldest && now - w->oldest->last_active >= KEEPALIVE_TIMEOUT_MS) {
+        http_conn_close(w, w->oldest);
+    }
+}
+
+static DWORD event_worker(LPVOID param) {
+    EventWorker *w = (EventWorker*)param;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("Error en epoll_wait: %d\n", errno);
+            return 1;
+        }
+
+        long long now = monotonic_ms();
+        for (int i = 0; i < n; i++) {
+            // El socket de escucha se registra sin puntero
+            if (!events[i].data.ptr) worker_accept(w, now);
+            else http_conn_on_event(w, (HttpConn*)events[i].data.ptr, events[i].events, now);
+        }
+        worker_expire(w, now);
+    }
+    return 0;
+}
+
+// Sube el límite de descriptores abiertos para soportar miles de conexiones
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int run_event_engine(void) {
+    static EventWorker workers[LISTENER_MAX_SOCKETS];
+    int count = listener.acceptors;
+
+    raise_fd_limit();
+
+    for (int i = 0; i < listener.socket_count; i++) {
+        if (set_socket_blocking(listener.sockets[i], 0) != 0) {
+            printf("Error al registrar el socket de escucha: %d\n", errno);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        EventWorker *w = &workers[i];
+        w->index = i % listener.socket_count;
+        w->epfd = epoll_create1(0);
+
+        // Sin SO_REUSEPORT los hilos comparten un socket: EPOLLEXCLUSIVE
+        // despierta a uno solo por conexión nueva
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (listener.socket_count < count ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = NULL;
+        if (w->epfd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, listener.sockets[w->index], &ev) != 0) {
+            printf("Error al crear el motor de eventos: %d\n", errno);
+            return 1;
+        }
+    }
+
+    for (int i = 1; i < count; i++) {
+        if (!spawn_thread(event_worker, &workers[i])) {
+            printf("Error al crear hilo de trabajo %d\n", i);
+        }
+    }
+    // El hilo principal también atiende conexiones
+    return (int)event_worker(&workers[0]);
+}
+#endif
+
+// --- Carpetas ---
+void make_dir(const char *path) {
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+}
+
 // --- MAIN ---
 int main() {
+#ifdef _WIN32
     WSADATA wsa;
-    SOCKET server;
-    struct sockaddr_in serverAddr, clientAddr;
-    int clientLen = sizeof(clientAddr);
+#else
+    // Un cliente que cierra mientras se le responde no debe terminar el proceso
+    signal(SIGPIPE, SIG_IGN);
+#endif
 
     InitializeCriticalSection(&log_cs);
+    InitializeCriticalSection(&log_file_cs);
 
     // Crear carpetas necesarias
-    system("mkdir \"../log\" 2>nul");
-    system("mkdir \"../../config\" 2>nul");
+    make_dir("../log");
+    make_dir("../../config");
+
+    // Logger asíncrono; sin su hilo las peticiones no se registran
+    log_buffer = malloc(LOG_BUFFER_SIZE);
+    log_spare = malloc(LOG_BUFFER_SIZE);
+    if (!log_buffer || !log_spare || !spawn_thread(log_writer, NULL)) {
+        printf("No se pudo iniciar el hilo de log; las peticiones no se registraran.\n");
+        free(log_buffer);
+        free(log_spare);
+        log_buffer = log_spare = NULL;
+    }
 
     // Crear archivo de usuarios si no existe
     FILE *fcheck = fopen(USERS_FILE, "r");
@@ -293,39 +1007,28 @@ int main() {
         fclose(fcheck);
     }
 
+#ifdef _WIN32
     if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
         printf("Error inicializando Winsock\n");
         getchar();
         return 1;
     }
+#endif
 
-    server = socket(AF_INET, SOCK_STREAM, 0);
-    if (server == INVALID_SOCKET) {
-        printf("No se pudo crear socket (%d)\n", WSAGetLastError());
-        WSACleanup();
-        getchar();
-        return 1;
-    }
-
-    int enable = 1;
-    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (char*)&enable, sizeof(enable));
-
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(PORT);
-
-    if (bind(server, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        printf("bind fallo (%d)\n", WSAGetLastError());
-        closesocket(server);
-        WSACleanup();
-        getchar();
-        return 1;
-    }
-
-    if (listen(server, 10) == SOCKET_ERROR) {
-        printf("listen fallo (%d)\n", WSAGetLastError());
-        closesocket(server);
+    ListenerConfig cfg = {
+        .port = PORT,
+        .max_connections = MAX_CONNECTIONS,
+        .max_per_ip = MAX_PER_IP,
+        .busy_reply = "HTTP/1.1 503 Service Unavailable\r\n"
+                      "Retry-After: 1\r\n"
+                      "Content-Length: 0\r\n"
+                      "Connection: close\r\n\r\n"
+    };
+    if (listener_open(&listener, &cfg) != 0) {
+        printf("No se pudo abrir el puerto %d (%d)\n", PORT, WSAGetLastError());
+#ifdef _WIN32
         WSACleanup();
+#endif
         getchar();
         return 1;
     }
@@ -334,23 +1037,22 @@ int main() {
     printf("   Rutas: /, /status, /api/echo (GET y POST)\n");
     printf("   Directorio raiz: %s\n", WWWROOT);
     printf("   Archivo de usuarios: %s\n", USERS_FILE);
-    printf("--------------------------------------------------\n");
+    printf("   Aceptadores: %d, max conexiones: %d (%d por IP)\n", listener.acceptors, MAX_CONNECTIONS, MAX_PER_IP);
 
-    while (1) {
-        SOCKET client = accept(server, (struct sockaddr*)&clientAddr, &clientLen);
-        if (client == INVALID_SOCKET) continue;
-
-        void *bundle = malloc(sizeof(SOCKET) + sizeof(struct sockaddr_in));
-        memcpy(bundle, &client, sizeof(SOCKET));
-        memcpy((char*)bundle + sizeof(SOCKET), &clientAddr, sizeof(struct sockaddr_in));
-
-        DWORD tid;
-        HANDLE h = CreateThread(NULL, 0, client_thread, bundle, 0, &tid);
-        if (h) CloseHandle(h);
-    }
+#ifdef __linux__
+    printf("   Motor de eventos epoll: %d hilos\n", listener.acceptors);
+    printf("--------------------------------------------------\n");
+    int result = run_event_engine();
+#else
+    printf("--------------------------------------------------\n");
+    listener_run(&listener, on_client_accepted, NULL);
+    int result = 0;
+#endif
 
-    closesocket(server);
+#ifdef _WIN32
     WSACleanup();
+#endif
+    if (log_buffer) log_flush();
     DeleteCriticalSection(&log_cs);
-    return 0;
+    return result;
 }
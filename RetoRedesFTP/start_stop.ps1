@@ -18,7 +18,7 @@ function Start-FTPServer {
     # Verificar que el ejecutable existe
     if (-not (Test-Path ".\ftp_server.exe")) {
         Write-Host "✗ Error: ftp_server.exe no encontrado" -ForegroundColor Red
-        Write-Host "  Compilar con: gcc ftp_server.c -o ftp_server.exe -lws2_32" -ForegroundColor Yellow
+        Write-Host "  Compilar con: gcc ftp_server.c -o ftp_server.exe -lws2_32 -lz" -ForegroundColor Yellow
         return
     }
     
@@ -16,11 +16,18 @@
 #include <direct.h>     // _mkdir
 #include <stdlib.h>
 #include <stdarg.h>
+#include "../../../common/net_listener.h"
 
 #define DEFAULT_PORT 2525
 #define RECV_BUFSZ   4096
 #define LINE_BUFSZ   2048
 #define INBOX_DIR    ".\\smtp\\inbox\\"
+#define DATA_BUFSZ   (1024 * 256)
+#define MAX_CONNECTIONS 256 // Sesiones SMTP simultáneas
+#define MAX_PER_IP   16
+
+static Listener listener;
+static volatile LONG eml_seq = 0; // Distingue .eml guardados en el mismo segundo
 
 typedef struct {
     char helo[256];
@@ -128,7 +135,7 @@ static void save_eml(const smtp_state* st, const char* data_buf) {
         tmv.tm_year+1900, tmv.tm_mon+1, tmv.tm_mday, tmv.tm_hour, tmv.tm_min, tmv.tm_sec);
 
     char path[MAX_PATH];
-    snprintf(path, sizeof(path), INBOX_DIR "%s_%u.eml", ts, (unsigned)GetTickCount());
+    snprintf(path, sizeof(path), INBOX_DIR "%s_%ld.eml", ts, (long)InterlockedIncrement(&eml_seq));
 
     FILE* f = fopen(path, "wb");
     if (!f) return;
@@ -168,8 +175,14 @@ static void handle_client(SOCKET cs) {
     send_line(cs, "220 localhost Simple SMTP ready");
 
     char line[LINE_BUFSZ];
-    static char data_accum[1024 * 256];
+    // Buffer propio de cada sesión: varias conexiones se atienden a la vez
+    char* data_accum = (char*)malloc(DATA_BUFSZ);
     size_t data_len = 0;
+    if (!data_accum) {
+        send_line(cs, "421 4.3.0 Out of memory");
+        closesocket(cs);
+        return;
+    }
 
     for (;;) {
         int r = recv_line(cs, line, sizeof(line));
@@ -234,7 +247,7 @@ static void handle_client(SOCKET cs) {
             } else {
                 rfc5321_unstuff_dot(line);
                 size_t L = strlen(line);
-                if (data_len + L + 2 < sizeof(data_accum)) {
+                if (data_len + L + 2 < DATA_BUFSZ) {
                     memcpy(data_accum + data_len, line, L);
                     data_len += L;
                     data_accum[data_len++] = '\r';
@@ -244,7 +257,40 @@ static void handle_client(SOCKET cs) {
             }
         }
     }
+    free(data_accum);
+    closesocket(cs);
+}
+
+typedef struct {
+    SOCKET cs;
+    struct sockaddr_in addr;
+} client_ctx;
+
+static DWORD WINAPI client_thread(LPVOID param) {
+    client_ctx* ctx = (client_ctx*)param;
+    handle_client(ctx->cs);
+    listener_release(&listener, &ctx->addr);
+    free(ctx);
+    return 0;
+}
+
+// Conexión ya admitida por el listener: un hilo por sesión
+static void on_client_accepted(Listener* l, SOCKET cs, const struct sockaddr_in* addr, void* unused) {
+    (void)unused;
+    client_ctx* ctx = (client_ctx*)malloc(sizeof(*ctx));
+    HANDLE h = NULL;
+    if (ctx) {
+        ctx->cs = cs;
+        ctx->addr = *addr;
+        h = CreateThread(NULL, 0, client_thread, ctx, 0, NULL);
+    }
+    if (h) {
+        CloseHandle(h);
+        return;
+    }
+    free(ctx);
     closesocket(cs);
+    listener_release(l, addr);
 }
 
 int main(int argc, char** argv) {
@@ -256,38 +302,22 @@ int main(int argc, char** argv) {
 
     int port = (argc >= 2) ? atoi(argv[1]) : DEFAULT_PORT;
 
-    SOCKET ls = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (ls == INVALID_SOCKET) { fprintf(stderr, "socket failed\n"); WSACleanup(); return 1; }
-
-    BOOL opt = 1;
-    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons((u_short)port);
-
-    if (bind(ls, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-        fprintf(stderr, "bind failed (%d)\n", WSAGetLastError());
-        closesocket(ls); WSACleanup(); return 1;
-    }
-
-    if (listen(ls, SOMAXCONN) == SOCKET_ERROR) {
-        fprintf(stderr, "listen failed (%d)\n", WSAGetLastError());
-        closesocket(ls); WSACleanup(); return 1;
+    ListenerConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = port;
+    cfg.max_connections = MAX_CONNECTIONS;
+    cfg.max_per_ip = MAX_PER_IP;
+    cfg.busy_reply = "421 4.3.2 Too many connections, try again later\r\n";
+    if (listener_open(&listener, &cfg) != 0) {
+        fprintf(stderr, "bind/listen failed (%d)\n", WSAGetLastError());
+        WSACleanup(); return 1;
     }
 
-    printf("SMTP server listening on port %d ...\n", port);
+    printf("SMTP server listening on port %d (%d acceptors) ...\n", port, listener.acceptors);
     ensure_dirs();
 
-    for (;;) {
-        SOCKET cs = accept(ls, NULL, NULL);
-        if (cs == INVALID_SOCKET) continue;
-        handle_client(cs);
-    }
+    listener_run(&listener, on_client_accepted, NULL);
 
-    closesocket(ls);
     WSACleanup();
     return 0;
 }
@@ -0,0 +1,337 @@
+// net_listener.h - Socket de escucha compartido por los servidores TCP (FTP, HTTP, SMTP)
+//
+// Uso: incluir después de winsock2.h (Windows) o de los headers de sockets
+// POSIX. Sólo header: todas las funciones son static inline.
+//
+//   Listener listener;
+//   ListenerConfig cfg = { .port = 21, .max_connections = 1024, .max_per_ip = 32,
+//                          .busy_reply = "421 Too many connections.\r\n" };
+//   listener_open(&listener, &cfg);
+//   listener_run(&listener, on_client, NULL);  // o listener_accept() desde un bucle propio
+//   ...
+//   listener_release(&listener, &client_addr); // al cerrar cada conexión admitida
+//
+// En Linux se abre un socket con SO_REUSEPORT por aceptador, de modo que el
+// kernel reparte las conexiones entre varias colas de aceptación. En el
+// resto de plataformas todos los aceptadores comparten un único socket.
+// Cada conexión pasa por el control de admisión (límite global y por IP):
+// si se supera, se responde con el mensaje configurado y se cierra en el
+// mismo hilo aceptador, sin crear sesión ni hilo.
+
+#ifndef NET_LISTENER_H
+#define NET_LISTENER_H
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define LISTENER_LOCK CRITICAL_SECTION
+#define listener_lock_init(l) InitializeCriticalSection(l)
+#define listener_lock(l) EnterCriticalSection(l)
+#define listener_unlock(l) LeaveCriticalSection(l)
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#define LISTENER_LOCK pthread_mutex_t
+#define listener_lock_init(l) pthread_mutex_init(l, NULL)
+#define listener_lock(l) pthread_mutex_lock(l)
+#define listener_unlock(l) pthread_mutex_unlock(l)
+#ifndef INVALID_SOCKET
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket(s) close(s)
+#endif
+#endif
+
+#ifdef _MSC_VER
+#define listener_add(p, n) InterlockedExchangeAdd64((volatile LONG64*)(p), (n))
+#define listener_read(p) InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0)
+#else
+#define listener_add(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define listener_read(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+#define LISTENER_MAX_SOCKETS 64
+#define LISTENER_IP_STRIPES 256 // Particiones de la tabla de conexiones por IP
+#define LISTENER_IP_SLOTS 32    // IPs distintas con conexiones abiertas por partición
+
+typedef struct {
+    int port;
+    int acceptors;           // Sockets/hilos aceptadores (0 = uno por núcleo)
+    int backlog;             // Cola de aceptación de cada socket (0 = SOMAXCONN)
+    int max_connections;     // Conexiones abiertas en total (0 = sin límite)
+    int max_per_ip;          // Conexiones abiertas por IP (0 = sin límite)
+    const char* busy_reply;  // Respuesta al rechazar por el límite global
+    const char* per_ip_reply; // Respuesta al rechazar por el límite por IP (NULL = busy_reply)
+} ListenerConfig;
+
+typedef struct {
+    unsigned int ip; // Dirección en orden de red (0 = libre)
+    int count;
+} ListenerIpSlot;
+
+typedef struct {
+    LISTENER_LOCK lock;
+    ListenerIpSlot slots[LISTENER_IP_SLOTS];
+} ListenerIpStripe;
+
+typedef struct Listener Listener;
+typedef void (*ListenerHandler)(Listener* listener, SOCKET client, const struct sockaddr_in* addr, void* ctx);
+
+struct Listener {
+    ListenerConfig cfg;
+    SOCKET sockets[LISTENER_MAX_SOCKETS];
+    int socket_count;
+    int acceptors;
+    ListenerIpStripe ip_table[LISTENER_IP_STRIPES];
+    // Contadores (atómicos)
+    long long active;
+    long long accepted;
+    long long rejected_busy;
+    long long rejected_per_ip;
+};
+
+static inline int listener_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static inline SOCKET listener_bind(int port, int backlog, int reuse_port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&opt, sizeof(opt)) != 0) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+#else
+    (void)reuse_port;
+#endif
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons((unsigned short)port);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, backlog) != 0) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Abre los sockets de escucha. Devuelve 0 si al menos uno quedó escuchando.
+static inline int listener_open(Listener* listener, const ListenerConfig* cfg) {
+    memset(listener, 0, sizeof(*listener));
+    listener->cfg = *cfg;
+    if (!listener->cfg.per_ip_reply) listener->cfg.per_ip_reply = cfg->busy_reply;
+    for (int i = 0; i < LISTENER_IP_STRIPES; i++) listener_lock_init(&listener->ip_table[i].lock);
+
+    int acceptors = cfg->acceptors > 0 ? cfg->acceptors : listener_cpu_count();
+    if (acceptors > LISTENER_MAX_SOCKETS) acceptors = LISTENER_MAX_SOCKETS;
+    int backlog = cfg->backlog > 0 ? cfg->backlog : SOMAXCONN;
+    listener->acceptors = acceptors;
+
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    // Un socket por aceptador: el kernel reparte las conexiones entre ellos
+    for (int i = 0; i < acceptors; i++) {
+        SOCKET sock = listener_bind(cfg->port, backlog, 1);
+        if (sock == INVALID_SOCKET) break;
+        listener->sockets[listener->socket_count++] = sock;
+    }
+    if (listener->socket_count > 0) return 0;
+#endif
+    // Un único socket compartido por todos los aceptadores
+    SOCKET sock = listener_bind(cfg->port, backlog, 0);
+    if (sock == INVALID_SOCKET) return -1;
+    listener->sockets[listener->socket_count++] = sock;
+    return 0;
+}
+
+// Reserva una plaza para la conexión: 0 = admitida, 1 = límite global, 2 = límite por IP
+static inline int listener_admit(Listener* listener, const struct sockaddr_in* addr) {
+    if (listener->cfg.max_connections > 0 &&
+        listener_add(&listener->active, 1) >= listener->cfg.max_connections) {
+        listener_add(&listener->active, -1);
+        listener_add(&listener->rejected_busy, 1);
+        return 1;
+    }
+    if (listener->cfg.max_connections <= 0) listener_add(&listener->active, 1);
+
+    if (listener->cfg.max_per_ip > 0) {
+        unsigned int ip = addr->sin_addr.s_addr;
+        ListenerIpStripe* stripe = &listener->ip_table[(ip * 2654435761u) >> 24];
+        ListenerIpSlot* slot = NULL;
+        ListenerIpSlot* free_slot = NULL;
+        int admitted = 0;
+
+        listener_lock(&stripe->lock);
+        for (int i = 0; i < LISTENER_IP_SLOTS; i++) {
+            if (stripe->slots[i].count > 0 && stripe->slots[i].ip == ip) slot = &stripe->slots[i];
+            else if (stripe->slots[i].count == 0 && !free_slot) free_slot = &stripe->slots[i];
+        }
+        if (!slot && free_slot) {
+            slot = free_slot;
+            slot->ip = ip;
+            slot->count = 0;
+        }
+        // Sin hueco en la partición se rechaza: demasiadas IPs distintas a la vez
+        if (slot && slot->count < listener->cfg.max_per_ip) {
+            slot->count++;
+            admitted = 1;
+        }
+        listener_unlock(&stripe->lock);
+
+        if (!admitted) {
+            listener_add(&listener->active, -1);
+            listener_add(&listener->rejected_per_ip, 1);
+            return 2;
+        }
+    }
+
+    listener_add(&listener->accepted, 1);
+    return 0;
+}
+
+// Libera la plaza de una conexión admitida
+static inline void listener_release(Listener* listener, const struct sockaddr_in* addr) {
+    listener_add(&listener->active, -1);
+    if (listener->cfg.max_per_ip <= 0) return;
+
+    unsigned int ip = addr->sin_addr.s_addr;
+    ListenerIpStripe* stripe = &listener->ip_table[(ip * 2654435761u) >> 24];
+    listener_lock(&stripe->lock);
+    for (int i = 0; i < LISTENER_IP_SLOTS; i++) {
+        if (stripe->slots[i].count > 0 && stripe->slots[i].ip == ip) {
+            stripe->slots[i].count--;
+            break;
+        }
+    }
+    listener_unlock(&stripe->lock);
+}
+
+// Acepta la siguiente conexión admitida del socket 'index'; las rechazadas se
+// responden y cierran aquí. INVALID_SOCKET si accept() falla (con un socket
+// no bloqueante, cuando la cola está vacía).
+static inline SOCKET listener_accept(Listener* listener, int index, struct sockaddr_in* addr) {
+    for (;;) {
+#ifdef _WIN32
+        int addr_len = sizeof(*addr);
+#else
+        socklen_t addr_len = sizeof(*addr);
+#endif
+        SOCKET client = accept(listener->sockets[index], (struct sockaddr*)addr, &addr_len);
+        if (client == INVALID_SOCKET) {
+#ifndef _WIN32
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+#endif
+            return INVALID_SOCKET;
+        }
+
+        int verdict = listener_admit(listener, addr);
+        if (verdict == 0) return client;
+
+        const char* reply = verdict == 1 ? listener->cfg.busy_reply : listener->cfg.per_ip_reply;
+        if (reply) send(client, reply, (int)strlen(reply), 0);
+        closesocket(client);
+    }
+}
+
+// Conexiones completadas esperando accept() en todas las colas (-1 = no disponible)
+static inline int listener_queue_depth(Listener* listener) {
+#if defined(__linux__) && defined(TCP_INFO)
+    int depth = 0;
+    for (int i = 0; i < listener->socket_count; i++) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(listener->sockets[i], IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return -1;
+        depth += (int)info.tcpi_unacked; // En un socket de escucha: longitud de la cola de aceptación
+    }
+    return depth;
+#else
+    (void)listener;
+    return -1;
+#endif
+}
+
+// Resumen en una línea de texto para las páginas/comandos de estado
+static inline void listener_format_stats(Listener* listener, char* out, size_t size) {
+    snprintf(out, size, "sockets=%d active=%lld accepted=%lld rejected_busy=%lld rejected_per_ip=%lld queue=%d",
+             listener->socket_count, (long long)listener_read(&listener->active),
+             (long long)listener_read(&listener->accepted), (long long)listener_read(&listener->rejected_busy),
+             (long long)listener_read(&listener->rejected_per_ip), listener_queue_depth(listener));
+}
+
+typedef struct {
+    Listener* listener;
+    int index;
+    ListenerHandler handler;
+    void* ctx;
+} ListenerAcceptor;
+
+#ifdef _WIN32
+static inline DWORD WINAPI listener_acceptor_thread(LPVOID param) {
+#else
+static inline void* listener_acceptor_thread(void* param) {
+#endif
+    ListenerAcceptor* acceptor = (ListenerAcceptor*)param;
+    int backoff_ms = 10;
+    for (;;) {
+        struct sockaddr_in addr;
+        SOCKET client = listener_accept(acceptor->listener, acceptor->index, &addr);
+        if (client == INVALID_SOCKET) {
+            // EINTR/ECONNABORTED ya se reintentan en listener_accept: lo que
+            // llega aquí (EMFILE, ENFILE, ENOBUFS...) suele persistir, así que
+            // se espera antes de reintentar en vez de girar al 100% de CPU
+#ifdef _WIN32
+            Sleep(backoff_ms);
+#else
+            usleep(backoff_ms * 1000);
+#endif
+            if (backoff_ms < 1000) backoff_ms *= 2;
+            continue;
+        }
+        backoff_ms = 10;
+        acceptor->handler(acceptor->listener, client, &addr, acceptor->ctx);
+    }
+    return 0;
+}
+
+// Atiende conexiones con 'acceptors' hilos (uno por socket con SO_REUSEPORT,
+// o varios sobre el socket compartido). El hilo que llama es uno de ellos:
+// no retorna. 'handler' recibe sólo conexiones ya admitidas.
+static inline void listener_run(Listener* listener, ListenerHandler handler, void* ctx) {
+    static ListenerAcceptor acceptors[LISTENER_MAX_SOCKETS];
+    for (int i = 0; i < listener->acceptors; i++) {
+        acceptors[i].listener = listener;
+        acceptors[i].index = listener->socket_count > 1 ? i % listener->socket_count : 0;
+        acceptors[i].handler = handler;
+        acceptors[i].ctx = ctx;
+    }
+    for (int i = 1; i < listener->acceptors; i++) {
+#ifdef _WIN32
+        HANDLE h = CreateThread(NULL, 0, listener_acceptor_thread, &acceptors[i], 0, NULL);
+        if (h) CloseHandle(h);
+#else
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, listener_acceptor_thread, &acceptors[i]) == 0) pthread_detach(tid);
+#endif
+    }
+    listener_acceptor_thread(&acceptors[0]);
+}
+
+#endif // NET_LISTENER_H